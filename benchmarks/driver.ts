@@ -0,0 +1,49 @@
+// 基准测试的子进程：用TypeScript版本的虚拟机或AST解释器运行一个基准程序。
+// 用法：driver.ts ts-vm 字节码文件
+//       driver.ts ast 源代码文件
+// 只计量执行程序的时间，不包括启动Node和编译的时间。结束时在stderr的最后一行输出
+// {"ms": 执行时间（毫秒）, "maxRSS": 峰值内存（KB）}，供run.ts读取。
+import * as fs from 'fs';
+import * as process from 'process';
+
+import { Interpreter } from '../packages/ast-interpreter/src/index';
+import { Parser as AstParser } from '../packages/ast-interpreter/src/parser';
+import { CharStream as AstCharStream, Scanner as AstScanner } from '../packages/ast-interpreter/src/scanner';
+import { SemanticAnalyer as AstSemanticAnalyer } from '../packages/ast-interpreter/src/semantic';
+import { BCModuleReader, VM } from '../packages/ts-vm/src/vm';
+
+function runTsVM(bcFile: string): number {
+  let bcModule = new BCModuleReader().read(Array.from(fs.readFileSync(bcFile)));
+  let begin = process.hrtime.bigint();
+  new VM().execute(bcModule);
+  return Number(process.hrtime.bigint() - begin) / 1e6;
+}
+
+function runAstInterpreter(sourceFile: string): number {
+  let parser = new AstParser(new AstScanner(new AstCharStream(fs.readFileSync(sourceFile, 'utf8'))));
+  let prog = parser.parseProg();
+  let semanticAnalyer = new AstSemanticAnalyer();
+  semanticAnalyer.execute(prog);
+  if (parser.errors.length > 0 || semanticAnalyer.errors.length > 0) {
+    let errors = parser.errors.length + semanticAnalyer.errors.length;
+    console.error(sourceFile + ': ' + errors + ' syntax or semantic errors');
+    process.exit(1);
+  }
+
+  let begin = process.hrtime.bigint();
+  new Interpreter().visit(prog);
+  return Number(process.hrtime.bigint() - begin) / 1e6;
+}
+
+let engine = process.argv[2];
+let file = process.argv[3];
+let ms: number;
+if (engine == 'ts-vm') {
+  ms = runTsVM(file);
+} else if (engine == 'ast') {
+  ms = runAstInterpreter(file);
+} else {
+  console.error('Usage: driver.ts ts-vm|ast FILENAME');
+  process.exit(1);
+}
+console.error(JSON.stringify({ ms: ms, maxRSS: process.resourceUsage().maxRSS }));
@@ -0,0 +1,325 @@
+// 基准测试：用ts-vm的BCGenerator把scripts目录下的每个程序编译成字节码，分别在C语言版本的playvm、
+// TypeScript版本的虚拟机和AST解释器上运行多次，统计执行时间的中位数、最小值、标准差和峰值内存，
+// 并与保存的基线比较。
+//
+// 用法：pnpm run bench [-- 选项]
+//   --runs N            每个程序在每个引擎上计时的次数，缺省为10
+//   --warmup N          计时前先运行N次，结果丢弃，缺省为1
+//   --engines a,b       只测试这些引擎：playvm、ts-vm、ast，缺省为全部
+//   --filter name       只运行名称包含name的程序
+//   --baseline file     基线文件，缺省为benchmarks/baseline.json
+//   --save-baseline     把这次的结果保存为基线
+//   --threshold P       中位数比基线慢P%以上，并且慢了K倍标准差以上，才算作退化，P缺省为10
+//   --sigma K           见--threshold，K缺省为2。标准差取这次和基线中较大的一个
+//   --playvm path       playvm的路径，缺省为packages/vm/dist/playvm
+// 有退化或者运行出错时，退出码为1。
+//
+// 时间：三个引擎都只计量执行程序的墙钟时间，不包括启动进程、加载字节码和编译的时间。playvm用--stats
+// 在stderr上报告，另外两个引擎见driver.ts。
+// 峰值内存：都由子进程自己报告在stderr上，是整个进程的峰值。ts-vm和ast的数字包含Node本身，
+// 表中标为*，只能在同一个引擎的不同版本之间比较，不能和playvm比较。
+import { spawn } from 'child_process';
+import * as fs from 'fs';
+import * as path from 'path';
+import * as process from 'process';
+
+import { Prog } from '../packages/ts-vm/src/ast';
+import { Parser } from '../packages/ts-vm/src/parser';
+import { CharStream, Scanner } from '../packages/ts-vm/src/scanner';
+import { SemanticAnalyer } from '../packages/ts-vm/src/semantic';
+import { BCGenerator, BCModule, BCModuleWriter } from '../packages/ts-vm/src/vm';
+
+const ENGINES = ['playvm', 'ts-vm', 'ast'];
+
+interface Options {
+  runs: number;
+  warmup: number;
+  engines: string[];
+  filter: string;
+  baseline: string;
+  saveBaseline: boolean;
+  threshold: number;
+  sigma: number;
+  playvm: string;
+}
+
+// 一个程序在一个引擎上多次运行的统计结果
+interface Result {
+  medianMs: number;
+  minMs: number;
+  stddevMs: number;
+  peakRssKB: number; // 各次运行中最大的峰值内存，是整个进程的，不知道时为0
+}
+
+// 一次运行的结果
+interface Sample {
+  ms: number;
+  rssKB: number;
+}
+
+function parseOptions(argv: string[]): Options {
+  let root = path.resolve(__dirname, '..');
+  let options: Options = {
+    runs: 10,
+    warmup: 1,
+    engines: ENGINES,
+    filter: '',
+    baseline: path.join(__dirname, 'baseline.json'),
+    saveBaseline: false,
+    threshold: 10,
+    sigma: 2,
+    playvm: path.join(root, 'packages/vm/dist/playvm'),
+  };
+  for (let i = 0; i < argv.length; i++) {
+    switch (argv[i]) {
+      case '--runs':
+        options.runs = parseInt(argv[++i]);
+        break;
+      case '--warmup':
+        options.warmup = parseInt(argv[++i]);
+        break;
+      case '--engines':
+        options.engines = argv[++i].split(',');
+        break;
+      case '--filter':
+        options.filter = argv[++i];
+        break;
+      case '--baseline':
+        options.baseline = path.resolve(argv[++i]);
+        break;
+      case '--save-baseline':
+        options.saveBaseline = true;
+        break;
+      case '--threshold':
+        options.threshold = parseFloat(argv[++i]);
+        break;
+      case '--sigma':
+        options.sigma = parseFloat(argv[++i]);
+        break;
+      case '--playvm':
+        options.playvm = path.resolve(argv[++i]);
+        break;
+      default:
+        console.log('Unknown option: ' + argv[i]);
+        process.exit(1);
+    }
+  }
+  for (let engine of options.engines) {
+    if (ENGINES.indexOf(engine) < 0) {
+      console.log('Unknown engine: ' + engine + '. Expecting one of ' + ENGINES.join(', '));
+      process.exit(1);
+    }
+  }
+  if (!(options.runs > 0)) {
+    console.log('--runs must be a positive integer');
+    process.exit(1);
+  }
+  if (!(options.warmup >= 0)) {
+    console.log('--warmup must be a non-negative integer');
+    process.exit(1);
+  }
+  return options;
+}
+
+/**
+ * 把源代码编译成字节码文件
+ * @returns 是否成功
+ */
+function compile(sourceFile: string, bcFile: string): boolean {
+  let parser = new Parser(new Scanner(new CharStream(fs.readFileSync(sourceFile, 'utf8'))));
+  let prog: Prog = parser.parseProg();
+  let semanticAnalyer = new SemanticAnalyer();
+  semanticAnalyer.execute(prog);
+  if (parser.errors.length > 0 || semanticAnalyer.errors.length > 0) {
+    let errors = parser.errors.length + semanticAnalyer.errors.length;
+    console.log(sourceFile + ': ' + errors + ' syntax or semantic errors');
+    return false;
+  }
+
+  // BCGenerator和BCModuleWriter会打印调试信息，这里不需要
+  let log = console.log;
+  console.log = () => {};
+  let bcModule = new BCGenerator().visit(prog) as BCModule;
+  let code = new BCModuleWriter().write(bcModule);
+  console.log = log;
+  fs.writeFileSync(bcFile, Buffer.from(code));
+  return true;
+}
+
+/**
+ * 运行一次。程序的输出被丢弃，免得终端的输出影响计时
+ */
+function runOnce(engine: string, sourceFile: string, bcFile: string, options: Options): Promise<Sample> {
+  return new Promise((resolve, reject) => {
+    let command: string;
+    let args: string[];
+    if (engine == 'playvm') {
+      command = options.playvm;
+      args = ['--stats', bcFile];
+    } else {
+      // 用与run.ts相同的方式（比如-r ts-node/register）运行driver.ts
+      command = process.execPath;
+      let file = engine == 'ast' ? sourceFile : bcFile;
+      args = process.execArgv.concat([path.join(__dirname, 'driver.ts'), engine, file]);
+    }
+
+    let child = spawn(command, args, { stdio: ['ignore', 'ignore', 'pipe'] });
+    let stderr = '';
+    child.stderr.on('data', (data) => (stderr += data));
+
+    child.on('error', (err) => reject(err));
+    child.on('close', (code) => {
+      let ms: number;
+      let rssKB: number;
+      if (code != 0) {
+        reject(new Error(engine + ' exited with code ' + code + '\n' + stderr));
+        return;
+      }
+      if (engine == 'playvm') {
+        // playvm --stats在stderr上打印"exec time: N ms"和"peak RSS: N KB"，不是unix时没有后一行
+        let time = /exec time: ([\d.]+) ms/.exec(stderr);
+        if (time == null) {
+          reject(new Error('playvm --stats did not report the exec time; rebuild packages/vm\n' + stderr));
+          return;
+        }
+        ms = parseFloat(time[1]);
+        let match = /peak RSS: (\d+) KB/.exec(stderr);
+        rssKB = match != null ? parseInt(match[1]) : 0;
+      } else {
+        // driver.ts在stderr的最后一行报告执行时间和峰值内存
+        let lines = stderr.trim().split('\n');
+        let report = JSON.parse(lines[lines.length - 1]);
+        ms = report.ms;
+        rssKB = report.maxRSS;
+      }
+      resolve({ ms: ms, rssKB: rssKB });
+    });
+  });
+}
+
+function summarize(samples: Sample[]): Result {
+  let times = samples.map((s) => s.ms).sort((a, b) => a - b);
+  let n = times.length;
+  let median = n % 2 == 1 ? times[(n - 1) / 2] : (times[n / 2 - 1] + times[n / 2]) / 2;
+  let mean = times.reduce((a, b) => a + b, 0) / n;
+  let variance = n > 1 ? times.reduce((a, t) => a + (t - mean) * (t - mean), 0) / (n - 1) : 0;
+  return {
+    medianMs: median,
+    minMs: times[0],
+    stddevMs: Math.sqrt(variance),
+    peakRssKB: Math.max(...samples.map((s) => s.rssKB)),
+  };
+}
+
+function pad(s: string, width: number, left: boolean = false): string {
+  while (s.length < width) {
+    s = left ? s + ' ' : ' ' + s;
+  }
+  return s;
+}
+
+async function main() {
+  let options = parseOptions(process.argv.slice(2));
+
+  // 1.编译所有的程序
+  let scriptsDir = path.join(__dirname, 'scripts');
+  let outDir = path.join(__dirname, 'out');
+  fs.mkdirSync(outDir, { recursive: true });
+  let names = fs
+    .readdirSync(scriptsDir)
+    .filter((f) => f.endsWith('.cs'))
+    .map((f) => f.substring(0, f.length - 3))
+    .filter((name) => name.indexOf(options.filter) >= 0)
+    .sort();
+  for (let name of names) {
+    if (!compile(path.join(scriptsDir, name + '.cs'), path.join(outDir, name + '.bc'))) {
+      process.exit(1);
+    }
+  }
+
+  let baseline: { [key: string]: Result } = {};
+  if (fs.existsSync(options.baseline)) {
+    baseline = JSON.parse(fs.readFileSync(options.baseline, 'utf8')).results;
+  }
+
+  // 2.运行，并与基线比较
+  console.log(
+    pad('benchmark', 12, true) +
+      pad('engine', 8, true) +
+      pad('median ms', 12) +
+      pad('min ms', 12) +
+      pad('stddev ms', 12) +
+      pad('peak RSS MB', 13) +
+      pad('baseline ms', 13) +
+      pad('change', 9),
+  );
+  let results: { [key: string]: Result } = {};
+  let failed = false;
+  for (let name of names) {
+    for (let engine of options.engines) {
+      let key = name + '/' + engine;
+      let sourceFile = path.join(scriptsDir, name + '.cs');
+      let bcFile = path.join(outDir, name + '.bc');
+      let samples: Sample[] = [];
+      try {
+        // 预热：让文件缓存、CPU频率等稳定下来
+        for (let i = 0; i < options.warmup; i++) {
+          await runOnce(engine, sourceFile, bcFile, options);
+        }
+        for (let i = 0; i < options.runs; i++) {
+          samples.push(await runOnce(engine, sourceFile, bcFile, options));
+        }
+      } catch (err) {
+        console.log(pad(name, 12, true) + pad(engine, 8, true) + '  failed: ' + (err as Error).message);
+        failed = true;
+        continue;
+      }
+
+      let result = summarize(samples);
+      results[key] = result;
+      let line =
+        pad(name, 12, true) +
+        pad(engine, 8, true) +
+        pad(result.medianMs.toFixed(1), 12) +
+        pad(result.minMs.toFixed(1), 12) +
+        pad(result.stddevMs.toFixed(1), 12) +
+        pad(result.peakRssKB > 0 ? (result.peakRssKB / 1024).toFixed(1) + (engine == 'playvm' ? ' ' : '*') : '-', 13);
+      let base = baseline[key];
+      if (base != undefined) {
+        let change = ((result.medianMs - base.medianMs) / base.medianMs) * 100;
+        line += pad(base.medianMs.toFixed(1), 13) + pad((change >= 0 ? '+' : '') + change.toFixed(1) + '%', 9);
+        // 只有超出阈值，并且超出噪声，才算退化
+        let noise = options.sigma * Math.max(result.stddevMs, base.stddevMs);
+        if (change > options.threshold && result.medianMs - base.medianMs > noise) {
+          line += '  REGRESSION';
+          failed = true;
+        }
+      }
+      console.log(line);
+    }
+  }
+  if (options.engines.some((engine) => engine != 'playvm')) {
+    console.log('\n* peak RSS of the whole Node process, including the runtime itself');
+  }
+
+  // 3.保存基线。只更新这次运行过的项目
+  if (options.saveBaseline) {
+    for (let key in results) {
+      baseline[key] = results[key];
+    }
+    let data = {
+      runs: options.runs,
+      warmup: options.warmup,
+      platform: process.platform + '-' + process.arch,
+      timing: 'execution wall time, excluding process startup, bytecode loading and compilation',
+      memory: 'peak RSS of the whole process; for ts-vm and ast it includes the Node runtime',
+      results: baseline,
+    };
+    fs.writeFileSync(options.baseline, JSON.stringify(data, null, 2) + '\n');
+    console.log('\nBaseline saved to ' + options.baseline);
+  }
+
+  process.exit(failed ? 1 : 0);
+}
+
+main();
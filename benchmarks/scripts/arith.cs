@@ -0,0 +1,27 @@
+/**
+算术：整数的乘加运算，以及用莱布尼茨级数计算圆周率的decimal运算。
+*/
+let checksum: integer = 0;
+for (let round: integer = 0; round < 8; round++) {
+  checksum = round;
+  for (let i: integer = 0; i < 250; i++) {
+    for (let j: integer = 0; j < 250; j++) {
+      checksum = checksum + i * j - i * 3 - j * 5;
+    }
+  }
+}
+println(checksum);
+
+let pi: decimal = 0.0;
+let sign: decimal = 4.0;
+let den: decimal = 1.0;
+for (let round: integer = 0; round < 8; round++) {
+  for (let i: integer = 0; i < 250; i++) {
+    for (let j: integer = 0; j < 250; j++) {
+      pi = pi + sign / den;
+      sign = 0.0 - sign;
+      den = den + 2.0;
+    }
+  }
+}
+println(pi);
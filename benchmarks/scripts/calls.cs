@@ -0,0 +1,28 @@
+/**
+函数调用：循环中调用很多个小函数，测试调用的开销，以及JIT和内联的效果。
+*/
+function square(x: integer): integer {
+  return x * x;
+}
+
+function add(a: integer, b: integer): integer {
+  return a + b;
+}
+
+function clamp(x: integer, limit: integer): integer {
+  if (x > limit) {
+    return x - limit;
+  }
+  return x;
+}
+
+let limit: integer = 250 * 250;
+let acc: integer = 0;
+for (let i: integer = 0; i < 250; i++) {
+  for (let j: integer = 0; j < 250; j++) {
+    for (let k: integer = 0; k < 40; k++) {
+      acc = clamp(add(acc, square(j - k)), limit);
+    }
+  }
+}
+println(acc);
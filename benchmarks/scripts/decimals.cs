@@ -0,0 +1,16 @@
+/**
+decimal的打印：打印各种量级的小数，测试把decimal格式化成最短的十进制字符串的速度。
+*/
+let x: decimal = 0.1;
+let y: decimal = 1.0;
+for (let round: integer = 0; round < 20; round++) {
+  for (let i: integer = 0; i < 10000; i++) {
+    x = x * 1.37 + 0.01;
+    if (x > 1000000000000.0) {
+      x = x / 1000000000000000000000.0;
+    }
+    y = y + 0.1;
+    println(x);
+    println(y / 3.0);
+  }
+}
@@ -0,0 +1,12 @@
+/**
+嵌套循环：三层循环里只做本地变量的读写和整数运算，测试分派和超级指令。
+*/
+let sum: integer = 0;
+for (let i: integer = 0; i < 250; i++) {
+  for (let j: integer = 0; j < 250; j++) {
+    for (let k: integer = 0; k < 200; k++) {
+      sum = sum + i - j + k;
+    }
+  }
+}
+println(sum);
@@ -0,0 +1,11 @@
+/**
+递归：朴素的斐波那契数列，几乎全部时间都花在函数调用和返回上。
+*/
+function fibonacci(n: integer): integer {
+  if (n < 2) {
+    return n;
+  }
+  return fibonacci(n - 1) + fibonacci(n - 2);
+}
+
+println(fibonacci(32));
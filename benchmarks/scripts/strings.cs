@@ -0,0 +1,18 @@
+/**
+字符串拼接：反复把短字符串接到越来越长的字符串后面，测试字符串的分配和垃圾收集。
+*/
+function build(n: integer): string {
+  let s: string = "";
+  for (let i: integer = 0; i < n; i++) {
+    s = s + integer_to_string(i) + ",";
+  }
+  return s;
+}
+
+let last: string = "";
+for (let round: integer = 0; round < 250; round++) {
+  for (let k: integer = 0; k < 30; k++) {
+    last = build(200);
+  }
+}
+println(last);
@@ -29,7 +29,7 @@ import { Symbol, VarSymbol } from './symbol';
 /**
  * 遍历 AST，执行函数调用。
  */
-class Interpreter extends AstVisitor {
+export class Interpreter extends AstVisitor {
   //调用栈
   callStack: StackFrame[] = [];
 
@@ -452,16 +452,19 @@ function compileAndRun(fileName: string, program: string) {
   console.log('耗时：' + (date2.getTime() - date1.getTime()) / 1000 + '秒');
 }
 
-// 要求命令行的第三个参数，一定是一个文件名。
-if (process.argv.length < 3) {
-  console.log('Usage: node ' + process.argv[1] + ' FILENAME');
-  process.exit(1);
-}
+// 作为程序运行时才处理命令行。基准测试等工具会import这个模块，使用其中的Interpreter
+if (require.main === module) {
+  // 要求命令行的第三个参数，一定是一个文件名。
+  if (process.argv.length < 3) {
+    console.log('Usage: node ' + process.argv[1] + ' FILENAME');
+    process.exit(1);
+  }
 
-// 编译和运行源代码
-let fileName = process.argv[2] as string;
-let fs = require('fs');
-fs.readFile(fileName, 'utf8', function (err: any, data: string) {
-  if (err) throw err;
-  compileAndRun(fileName, data);
-});
+  // 编译和运行源代码
+  let fileName = process.argv[2] as string;
+  let fs = require('fs');
+  fs.readFile(fileName, 'utf8', function (err: any, data: string) {
+    if (err) throw err;
+    compileAndRun(fileName, data);
+  });
+}
@@ -67,6 +67,18 @@ import { SysTypes, Type } from './types';
 ////////////////////////////////////////////////////////////////////////////////
 //Parser
 
+// 可以作为类型名称的关键字
+const typeKeywords: Set<Keyword> = new Set([
+  Keyword.Any,
+  Keyword.Number,
+  Keyword.String,
+  Keyword.Boolean,
+  Keyword.Symbol,
+  Keyword.Void,
+  Keyword.Undefined,
+  Keyword.Null,
+]);
+
 /**
  * 语法解析器。
  * 通常用parseProg()作为入口，解析整个程序。也可以用下级的某个节点作为入口，只解析一部分语法。
@@ -378,7 +390,7 @@ export class Parser {
         //':'
         this.scanner.next();
         t1 = this.scanner.peek();
-        if (t1.kind == TokenKind.Identifier) {
+        if (this.isTypeName(t1)) {
           this.scanner.next();
           varType = t1.text;
         } else {
@@ -411,6 +423,10 @@ export class Parser {
         return SysTypes.Any;
       case 'number':
         return SysTypes.Number;
+      case 'integer':
+        return SysTypes.Integer;
+      case 'decimal':
+        return SysTypes.Decimal;
       case 'boolean':
         return SysTypes.Boolean;
       case 'string':
@@ -587,7 +603,7 @@ export class Parser {
     this.scanner.next();
 
     let t = this.scanner.peek();
-    if (t.kind == TokenKind.Identifier) {
+    if (this.isTypeName(t)) {
       this.scanner.next();
       theType = t.text;
     } else {
@@ -597,6 +613,15 @@ export class Parser {
     return theType;
   }
 
+  /**
+   * 能否作为类型注解中的类型名称：integer、decimal等是标识符；number、string、boolean、void等是关键字，
+   * 但for、if这样的其他关键字不是类型名称。
+   * @param t
+   */
+  private isTypeName(t: Token): boolean {
+    return t.kind == TokenKind.Identifier || (t.kind == TokenKind.Keyword && typeKeywords.has(t.code as Keyword));
+  }
+
   /**
    * 解析函数体
    * 语法规则：
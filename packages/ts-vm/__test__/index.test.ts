@@ -0,0 +1,168 @@
+import { Prog } from '../src/ast';
+import { Parser } from '../src/parser';
+import { CharStream, Scanner } from '../src/scanner';
+import { SemanticAnalyer } from '../src/semantic';
+import { FunctionSymbol } from '../src/symbol';
+import { BCGenerator, BCModule, BCModuleReader, BCModuleWriter, DecimalConst, VM } from '../src/vm';
+
+/**
+ * 把源代码编译成BCModule。BCGenerator会打印调试信息，这里不需要
+ */
+function compile(program: string): BCModule {
+  let parser = new Parser(new Scanner(new CharStream(program)));
+  let prog: Prog = parser.parseProg();
+  let semanticAnalyer = new SemanticAnalyer();
+  semanticAnalyer.execute(prog);
+  expect(parser.errors.length + semanticAnalyer.errors.length).toBe(0);
+
+  let log = jest.spyOn(console, 'log').mockImplementation(() => {});
+  try {
+    return new BCGenerator().visit(prog) as BCModule;
+  } finally {
+    log.mockRestore();
+  }
+}
+
+/**
+ * 运行BCModule，返回println打印的内容
+ */
+function run(bcModule: BCModule): any[] {
+  let output: any[] = [];
+  let log = jest.spyOn(console, 'log').mockImplementation((x) => {
+    output.push(x);
+  });
+  let retVal = new VM().execute(bcModule);
+  log.mockRestore();
+  expect(retVal).toBe(0);
+  return output;
+}
+
+/**
+ * 写成字节码再读回来
+ */
+function roundTrip(bcModule: BCModule): { bc: number[]; module: BCModule } {
+  let bc = new BCModuleWriter().write(bcModule);
+  return { bc: bc, module: new BCModuleReader().read(bc) };
+}
+
+/**
+ * 常量池中的内容，函数用名称和字节码表示。读出来的模块不包含系统函数
+ */
+function describeConsts(bcModule: BCModule): any[] {
+  return bcModule.consts
+    .filter((c) => !(c instanceof FunctionSymbol) || c.byteCode != null)
+    .map((c) => (c instanceof FunctionSymbol ? { name: c.name, byteCode: c.byteCode } : c));
+}
+
+/**
+ * 字节码中某个字符串出现的次数
+ */
+function countString(bc: number[], s: string): number {
+  let bytes = Array.from(new TextEncoder().encode(s));
+  let count = 0;
+  for (let i = 0; i + bytes.length <= bc.length; i++) {
+    if (bytes.every((b, j) => bc[i + j] == b)) count++;
+  }
+  return count;
+}
+
+describe('BCModuleWriter and BCModuleReader', () => {
+  // 300个字符串常量，后面的常量只能用ldc_w、sldc_w加载
+  let lines: string[] = ['let first: string = "str0";', 'let s: string = "str1";'];
+  for (let i = 2; i < 300; i++) {
+    lines.push('s = "str' + i + '";');
+  }
+  // 函数体超过255个字节：if语句中的跳转地址的高字节不为0，前面40条语句再给它加上偏移量，低字节会向高字节进位
+  let preamble: string[] = [];
+  for (let i = 0; i < 40; i++) {
+    preamble.push('  t = t + 1;');
+  }
+  let padding: string[] = [];
+  for (let i = 0; i < 70; i++) {
+    padding.push('    s = s + 7;');
+  }
+  let program =
+    [
+      'function big(n: integer): integer {',
+      '  let s: integer = 0;',
+      '  let t: integer = 100000;',
+      ...preamble,
+      '  if (n > 0) {',
+      ...padding,
+      '    for (let i: integer = 0; i < n; i++) {',
+      '      s = s + i;',
+      '    }',
+      '  }',
+      '  return s + t;',
+      '}',
+      'function empty(x: integer) {',
+      '}',
+      ...lines,
+      'let a: string = "twice";',
+      'let b: string = "twice";',
+      'let d: decimal = 3.25;',
+      'let e: decimal = 0.1;',
+      'let large: integer = 2147483647;',
+      'let mid: integer = 100000;',
+      'empty(1);',
+      'println(first);',
+      'println(s);',
+      'println(a + b);',
+      'println(d + e);',
+      'println(large);',
+      'println(mid);',
+      'println(big(0));',
+      'println(big(10));',
+    ].join('\n') + '\n';
+
+  let bcModule = compile(program);
+  // 源代码中写不出负数常量，直接加到常量池里。integer是32位的
+  bcModule.consts.push(-1, -128, -129, -2147483648, 2147483647, new DecimalConst(-1e-7), new DecimalConst(1e300));
+
+  test('the module has more than 256 constants', () => {
+    expect(bcModule.consts.length).toBeGreaterThan(256);
+  });
+
+  test('the function with jumps is larger than 255 bytes', () => {
+    let big = bcModule.consts.find((c) => c instanceof FunctionSymbol && c.name == 'big') as FunctionSymbol;
+    expect((big.byteCode as number[]).length).toBeGreaterThan(255);
+  });
+
+  test('constants and code survive a round trip', () => {
+    let { module } = roundTrip(bcModule);
+    expect(describeConsts(module)).toEqual(describeConsts(bcModule));
+    expect(module._main?.name).toBe(bcModule._main?.name);
+  });
+
+  test('an empty function body is read as code', () => {
+    let { module } = roundTrip(bcModule);
+    let empty = module.consts.find((c) => c instanceof FunctionSymbol && c.name == 'empty') as FunctionSymbol;
+    expect(empty.byteCode).toEqual([]);
+  });
+
+  test('strings used more than once are stored once', () => {
+    let { bc } = roundTrip(bcModule);
+    expect(countString(bc, 'twice')).toBe(1);
+    expect(countString(bc, 'str299')).toBe(1);
+  });
+
+  test('the module read back runs like the original', () => {
+    // println的integer参数先经过integer_to_string
+    let expected = ['str0', 'str299', 'twicetwice', 3.35, '2147483647', '100000', '100040', String(100040 + 70 * 7 + 45)];
+    expect(run(bcModule)).toEqual(expected);
+    expect(run(roundTrip(bcModule).module)).toEqual(expected);
+  });
+
+  test('a function with more than 256 local variables is rejected', () => {
+    let decls: string[] = [];
+    for (let i = 0; i < 257; i++) {
+      decls.push('let v' + i + ': integer = ' + i + ';');
+    }
+    expect(() => compile(decls.join('\n'))).toThrow('too many local variables');
+  });
+
+  test('writing the module read back gives the same bytes', () => {
+    let { bc, module } = roundTrip(bcModule);
+    expect(new BCModuleWriter().write(module)).toEqual(bc);
+  });
+});
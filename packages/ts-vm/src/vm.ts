@@ -8,6 +8,9 @@ import {
   AstVisitor,
   Binary,
   Block,
+  DecimalLiteral,
+  Expression,
+  ExpressionStatement,
   ForStatement,
   FunctionCall,
   FunctionDecl,
@@ -35,9 +38,12 @@ enum OpCode {
   iconst_3 = 0x06,
   iconst_4 = 0x07,
   iconst_5 = 0x08,
+  dconst_0 = 0x0e,
+  dconst_1 = 0x0f,
   bipush = 0x10, // 8位整数入栈
   sipush = 0x11, // 16位整数入栈
   ldc = 0x12, // 从常量池加载，load const
+  ldc2_w = 0x14, // 从常量池加载decimal，常量的下标占2个字节
   iload = 0x15, // 本地变量入栈
   iload_0 = 0x1a,
   iload_1 = 0x1b,
@@ -48,12 +54,21 @@ enum OpCode {
   istore_1 = 0x3c,
   istore_2 = 0x3d,
   istore_3 = 0x3e,
+  pop = 0x57, // 丢掉栈顶的值，用于值没有被使用的表达式语句
   iadd = 0x60,
+  dadd = 0x63,
   isub = 0x64,
+  dsub = 0x67,
   imul = 0x68,
+  dmul = 0x6b,
   idiv = 0x6c,
+  ddiv = 0x6f,
   iinc = 0x84,
+  i2d = 0x87, // integer转decimal
+  d2i = 0x8e, // decimal转integer，向0截断
   lcmp = 0x94,
+  dcmpl = 0x97, // 比较两个decimal，结果是-1、0或1；有NaN时为-1
+  dcmpg = 0x98, // 同dcmpl，有NaN时为1
   ifeq = 0x99,
   ifne = 0x9a,
   iflt = 0x9b,
@@ -74,6 +89,148 @@ enum OpCode {
   // 自行扩展的操作码
   sadd = 0x61, // 字符串连接
   sldc = 0x13, // 把字符串常量入栈。字符串放在常量区，用两个操作数记录下标。
+
+  // 超级指令：把常见的指令序列合并成一条指令，减少分派的次数。由BCGenerator在生成函数的代码之后合并。
+  // 其中x、y、z是本地变量的下标，c是8位有符号整数，addr是2个字节的跳转地址。
+  isub_lc = 0xe0, // iload x; iconst/bipush c; isub。操作数：x, c
+  if_icmpeq_lc = 0xe1, // iload x; iconst/bipush c; if_icmpeq addr。操作数：x, c, addr
+  if_icmpne_lc = 0xe2, // 同上，if_icmpne
+  if_icmplt_lc = 0xe3, // 同上，if_icmplt
+  if_icmpge_lc = 0xe4, // 同上，if_icmpge
+  if_icmpgt_lc = 0xe5, // 同上，if_icmpgt
+  if_icmple_lc = 0xe6, // 同上，if_icmple
+  iadd_ll_st = 0xe7, // iload x; iload y; iadd; istore z。操作数：x, y, z
+  iinc_goto = 0xe8, // iinc x c; goto addr。操作数：x, c, addr
+
+  // 尾调用：return f(...)时，被调用的函数复用当前函数的栈桢，返回时直接回到当前函数的调用者。操作数同invokestatic
+  invoketail = 0xe9,
+
+  // 宽格式：常量的下标超过255时使用，下标占2个字节，高位在前
+  ldc_w = 0xea,
+  sldc_w = 0xeb,
+}
+
+/**
+ * 带操作数的指令的编码格式：[指令, 所占的字节数（包括操作码本身）, 是否是跳转指令]。跳转指令的最后两个字节是跳转地址。
+ * 没有列出的指令只有操作码，占1个字节。新增指令时只需要在这里登记，逐条扫描字节码的地方都通过getOpLength和isJumpOp查询。
+ */
+const opFormats: [OpCode, number, boolean][] = [
+  [OpCode.bipush, 2, false],
+  [OpCode.ldc, 2, false],
+  [OpCode.sldc, 2, false],
+  [OpCode.iload, 2, false],
+  [OpCode.istore, 2, false],
+  [OpCode.sipush, 3, false],
+  [OpCode.ldc_w, 3, false],
+  [OpCode.sldc_w, 3, false],
+  [OpCode.ldc2_w, 3, false],
+  [OpCode.iinc, 3, false],
+  [OpCode.invokestatic, 3, false],
+  [OpCode.invoketail, 3, false],
+  [OpCode.isub_lc, 3, false],
+  [OpCode.ifeq, 3, true],
+  [OpCode.ifne, 3, true],
+  [OpCode.iflt, 3, true],
+  [OpCode.ifge, 3, true],
+  [OpCode.ifgt, 3, true],
+  [OpCode.ifle, 3, true],
+  [OpCode.if_icmpeq, 3, true],
+  [OpCode.if_icmpne, 3, true],
+  [OpCode.if_icmplt, 3, true],
+  [OpCode.if_icmpge, 3, true],
+  [OpCode.if_icmpgt, 3, true],
+  [OpCode.if_icmple, 3, true],
+  [OpCode.goto, 3, true],
+  [OpCode.iadd_ll_st, 4, false],
+  [OpCode.if_icmpeq_lc, 5, true],
+  [OpCode.if_icmpne_lc, 5, true],
+  [OpCode.if_icmplt_lc, 5, true],
+  [OpCode.if_icmpge_lc, 5, true],
+  [OpCode.if_icmpgt_lc, 5, true],
+  [OpCode.if_icmple_lc, 5, true],
+  [OpCode.iinc_goto, 5, true],
+];
+
+// 以操作码为下标的指令长度表，不认识的指令为0
+const opLengths: number[] = new Array(256).fill(0);
+const jumpOps: boolean[] = new Array(256).fill(false);
+for (let op = 0; op < 256; op++) {
+  if (OpCode[op] !== undefined) opLengths[op] = 1;
+}
+for (let [op, length, jump] of opFormats) {
+  opLengths[op] = length;
+  jumpOps[op] = jump;
+}
+
+/**
+ * 获取指令所占的字节数（包括操作码本身）。不认识的指令返回0。
+ * @param op
+ */
+function getOpLength(op: number): number {
+  return opLengths[op] ?? 0;
+}
+
+/**
+ * 判断是否是跳转指令。跳转指令的最后两个字节是跳转地址。
+ * @param op
+ */
+function isJumpOp(op: number): boolean {
+  return jumpOps[op] ?? false;
+}
+
+/**
+ * 查找函数体中带值的return语句，不进入嵌套的函数声明。
+ */
+class ValueReturnFinder extends AstVisitor {
+  found: boolean = false;
+
+  visitFunctionDecl(functionDecl: FunctionDecl): any {}
+
+  visitReturnStatement(stmt: ReturnStatement): any {
+    if (stmt.exp != null) {
+      this.found = true;
+    }
+  }
+}
+
+/**
+ * 调用函数之后，调用者的操作数栈上是否多了一个返回值。
+ * 类型注解中的void被解析成Undefined；没有声明返回类型的函数，看函数体中有没有带值的return，与C语言版本的校验器一致。
+ * @param functionSym
+ */
+function returnsValue(functionSym: FunctionSymbol): boolean {
+  let returnType = (functionSym.theType as FunctionType).returnType;
+  if (returnType === SysTypes.Void || returnType === SysTypes.Undefined) {
+    return false;
+  }
+  if (returnType === SysTypes.Any && functionSym.decl != null) {
+    let finder = new ValueReturnFinder();
+    finder.visit(functionSym.decl.body);
+    return finder.found;
+  }
+  return true;
+}
+
+/**
+ * 窥孔优化时使用的指令
+ */
+interface PeepholeInstr {
+  op: number;
+  operands: number[]; // 除跳转地址以外的操作数
+  target: number; // 跳转指令在优化前的目标地址，其他指令为-1
+  address: number; // 优化前的地址
+}
+
+/**
+ * 常量池中的decimal常量。
+ * 在JavaScript里integer和decimal都是number，所以用这个类把decimal常量与integer常量区分开。
+ */
+export class DecimalConst {
+  value: number;
+
+  constructor(value: number) {
+    this.value = value;
+  }
 }
 
 /**
@@ -104,6 +261,8 @@ export class BCModuleDumper {
     for (let x of bcModule.consts) {
       if (typeof x == 'number') {
         console.log('Number: ' + x);
+      } else if (x instanceof DecimalConst) {
+        console.log('Decimal: ' + x.value);
       } else if (typeof x == 'string') {
         console.log('String: ' + x);
       } else if (typeof (x as Symbol).kind == 'number') {
@@ -142,9 +301,9 @@ export class BCGenerator extends AstVisitor {
   visitProg(prog: Prog): any {
     this.functionSym = prog.sym;
     if (this.functionSym != null) {
-      this.m.consts.push(this.functionSym);
+      this.addConst(this.functionSym);
       this.m._main = this.functionSym;
-      this.functionSym.byteCode = this.visitBlock(prog) as number[];
+      this.setFunctionCode(this.functionSym, this.visitBlock(prog) as number[]);
     }
 
     return this.m;
@@ -160,7 +319,9 @@ export class BCGenerator extends AstVisitor {
     this.functionSym = functionDecl.sym;
 
     // 添加到Module
-    this.m.consts.push(this.functionSym);
+    if (this.functionSym != null) {
+      this.addFunctionConst(this.functionSym);
+    }
 
     // 2.为函数体生成代码
     let code1 = this.visit(functionDecl.callSignature);
@@ -169,13 +330,32 @@ export class BCGenerator extends AstVisitor {
     this.addOffsetToJumpOp(code2, code1.length);
 
     if (this.functionSym != null) {
-      this.functionSym.byteCode = code1.concat(code2);
+      this.setFunctionCode(this.functionSym, code1.concat(code2));
     }
 
     // 3.恢复当前函数
     this.functionSym = lastFunctionSym;
   }
 
+  /**
+   * 合并超级指令，把结果作为函数的字节码，并算出操作数栈的大小。
+   * 跳转地址占2个字节，所以一个函数的字节码不能超过64K；本地变量的下标占1个字节，所以最多有256个本地变量。
+   * 超出时无法生成代码。
+   * @param functionSym
+   * @param code 函数完整的字节码
+   */
+  private setFunctionCode(functionSym: FunctionSymbol, code: number[]) {
+    if (functionSym.vars.length > 256) {
+      throw new Error('Function ' + functionSym.name + ' has too many local variables: ' + functionSym.vars.length + ', at most 256.');
+    }
+    let byteCode = this.fuseSuperInstructions(code);
+    if (byteCode.length > 0xffff) {
+      throw new Error('Function ' + functionSym.name + ' is too large: ' + byteCode.length + ' bytes, at most 65535.');
+    }
+    functionSym.byteCode = byteCode;
+    functionSym.opStackSize = this.maxStackDepth(byteCode);
+  }
+
   /**
    * 遍历一个块，把每个语句产生的代码拼起来。
    * @param block
@@ -205,6 +385,7 @@ export class BCGenerator extends AstVisitor {
       // 获取初始化部分的Code
       let ret = this.visit(variableDecl.init) as number[];
       code = code.concat(ret);
+      code = code.concat(this.convertNumber(variableDecl.init.theType, variableDecl.sym?.theType));
       // 生成变量赋值的指令
       code = code.concat(this.setVariableValue(variableDecl.sym));
     }
@@ -223,8 +404,17 @@ export class BCGenerator extends AstVisitor {
       let code1 = this.visit(returnStatement.exp) as number[];
       //  console.log(code1);
       code = code.concat(code1);
-      // 生成ireturn代码
-      code.push(OpCode.ireturn);
+      // 返回值转换成函数声明的返回类型。需要转换时，转换要在调用返回之后做，所以不能是尾调用
+      let returnType = (this.functionSym?.theType as FunctionType | undefined)?.returnType;
+      let conversion = this.convertNumber(returnStatement.exp.theType, returnType);
+      if (conversion.length == 0 && this.isTailCall(returnStatement.exp)) {
+        // 尾调用：把最后的invokestatic换成invoketail，不再需要ireturn
+        code[code.length - 3] = OpCode.invoketail;
+      } else {
+        // 生成ireturn代码
+        code = code.concat(conversion);
+        code.push(OpCode.ireturn);
+      }
       return code;
     } else {
       // 2.生成return代码，返回值是void
@@ -233,19 +423,58 @@ export class BCGenerator extends AstVisitor {
     }
   }
 
+  /**
+   * 表达式语句：表达式的值没有被使用，要用pop丢掉，否则在循环中操作数栈会越来越深。
+   * @param stmt
+   */
+  visitExpressionStatement(stmt: ExpressionStatement): any {
+    let code = this.visit(stmt.exp) as number[];
+    return this.discardValue(stmt.exp, code);
+  }
+
+  /**
+   * 如果表达式会在操作数栈上留下一个值，在它的代码后面加上pop。
+   * 赋值和作为语句的++、--不留下值；调用不返回值的函数也不留下值。
+   * @param exp
+   * @param code 表达式的代码
+   */
+  private discardValue(exp: Expression, code: number[]): number[] {
+    let leavesValue = true;
+    if (exp instanceof FunctionCall) {
+      leavesValue = exp.sym != null && returnsValue(exp.sym);
+    } else if (exp instanceof Binary) {
+      leavesValue = exp.op != Op.Assign;
+    } else if (exp instanceof Unary) {
+      leavesValue = false;
+    }
+    return leavesValue ? code.concat([OpCode.pop]) : code;
+  }
+
+  /**
+   * return后面的表达式是否是对自定义函数的调用。
+   * 内置函数没有自己的栈桢，不做尾调用。
+   * @param exp
+   */
+  private isTailCall(exp: any): boolean {
+    return exp instanceof FunctionCall && exp.sym != null && !built_ins.has(exp.sym.name);
+  }
+
   visitFunctionCall(functionCall: FunctionCall): any {
     //  console.log("in AstVisitor.visitFunctionCall "+ functionCall.name);
     let code: number[] = [];
-    // 1.依次生成与参数计算有关的指令，也就是把参数压到计算栈里
-    for (let param of functionCall.arguments) {
+    // 1.依次生成与参数计算有关的指令，也就是把参数压到计算栈里，并转换成形参的类型
+    let paramTypes = (functionCall.sym?.theType as FunctionType | undefined)?.paramTypes ?? [];
+    for (let i = 0; i < functionCall.arguments.length; i++) {
+      let param = functionCall.arguments[i];
       let code1 = this.visit(param);
       code = code.concat(code1 as number[]);
+      code = code.concat(this.convertNumber(param.theType, paramTypes[i]));
     }
 
     // 2.生成invoke指令
     //  console.log(functionCall.sym);
-    let index = this.m.consts.indexOf(functionCall.sym);
-    assert(index != -1, '生成字节码时，在模块中查找函数失败！');
+    assert(functionCall.sym != null, '生成字节码时，在模块中查找函数失败！');
+    let index = this.addFunctionConst(functionCall.sym as FunctionSymbol);
     //  console.log(this.module);
     code.push(OpCode.invokestatic);
     code.push(index >> 8);
@@ -306,13 +535,19 @@ export class BCGenerator extends AstVisitor {
    */
   visitForStatement(forStmt: ForStatement): any {
     let code: number[] = [];
-    let code_init: number[] = forStmt.init == null ? [] : this.visit(forStmt.init);
+    let code_init: number[] = [];
+    if (forStmt.init instanceof VariableDecl) {
+      code_init = this.visit(forStmt.init);
+    } else if (forStmt.init != null) {
+      code_init = this.discardValue(forStmt.init, this.visit(forStmt.init));
+    }
     this.inExpression = false; // 重置
 
     let code_condition: number[] = forStmt.condition == null ? [] : this.visit(forStmt.condition);
     this.inExpression = false; // 重置
 
-    let code_increment: number[] = forStmt.increment == null ? [] : this.visit(forStmt.increment);
+    let code_increment: number[] =
+      forStmt.increment == null ? [] : this.discardValue(forStmt.increment, this.visit(forStmt.increment));
     this.inExpression = false; // 重置
 
     let code_stmt: number[] = forStmt.stmt == null ? [] : this.visit(forStmt.stmt);
@@ -368,77 +603,278 @@ export class BCGenerator extends AstVisitor {
 
     let codeIndex = 0;
     while (codeIndex < code.length) {
-      switch (code[codeIndex]) {
-        // 纯指令，后面不带操作数
-        case OpCode.iadd:
-        case OpCode.sadd:
-        case OpCode.isub:
-        case OpCode.imul:
-        case OpCode.idiv:
+      let op = code[codeIndex];
+      let len = getOpLength(op);
+      if (len == 0) {
+        console.log('unrecognized Op Code in addOffsetToJumpOp: ' + op);
+        return code;
+      }
+      // 跳转指令的最后两个字节是跳转地址，加上offset
+      if (isJumpOp(op)) {
+        let address = ((code[codeIndex + len - 2] << 8) | code[codeIndex + len - 1]) + offset;
+        code[codeIndex + len - 2] = address >> 8;
+        code[codeIndex + len - 1] = address & 0xff;
+      }
+      codeIndex += len;
+    }
+    return code;
+  }
+
+  /**
+   * 窥孔优化：把常见的指令序列合并成超级指令。
+   * 只有序列中除第一条以外的指令都不是跳转目标时，才可以合并。合并以后重新计算地址，并修正跳转地址。
+   * @param code 一个函数完整的字节码
+   */
+  private fuseSuperInstructions(code: number[]): number[] {
+    // 1.把字节码拆分成指令，同时记下所有的跳转目标
+    let instrs: PeepholeInstr[] = [];
+    let targets: Set<number> = new Set();
+    let codeIndex = 0;
+    while (codeIndex < code.length) {
+      let op = code[codeIndex];
+      let len = getOpLength(op);
+      if (len == 0) {
+        console.log('unrecognized Op Code in fuseSuperInstructions: ' + op);
+        return code;
+      }
+      let instr: PeepholeInstr = { op: op, operands: [], target: -1, address: codeIndex };
+      if (isJumpOp(op)) {
+        instr.operands = code.slice(codeIndex + 1, codeIndex + len - 2);
+        instr.target = (code[codeIndex + len - 2] << 8) | code[codeIndex + len - 1];
+        targets.add(instr.target);
+      } else {
+        instr.operands = code.slice(codeIndex + 1, codeIndex + len);
+      }
+      instrs.push(instr);
+      codeIndex += len;
+    }
+
+    // 从第i条指令开始的n条指令，是否能合并
+    let canFuse = (i: number, n: number): boolean => {
+      if (i + n > instrs.length) return false;
+      for (let k = 1; k < n; k++) {
+        if (targets.has(instrs[i + k].address)) return false;
+      }
+      return true;
+    };
+
+    // 2.合并
+    let fused: PeepholeInstr[] = [];
+    let i = 0;
+    while (i < instrs.length) {
+      let a = instrs[i];
+      let x = BCGenerator.loadIndex(a);
+      if (x >= 0 && canFuse(i, 4)) {
+        // iload x; iload y; iadd; istore z
+        let y = BCGenerator.loadIndex(instrs[i + 1]);
+        let z = BCGenerator.storeIndex(instrs[i + 3]);
+        if (y >= 0 && instrs[i + 2].op == OpCode.iadd && z >= 0) {
+          fused.push({ op: OpCode.iadd_ll_st, operands: [x, y, z], target: -1, address: a.address });
+          i += 4;
+          continue;
+        }
+      }
+      if (x >= 0 && canFuse(i, 3)) {
+        // iload x; iconst/bipush c; isub 或 if_icmpXX
+        let c = BCGenerator.constValue(instrs[i + 1]);
+        let third = instrs[i + 2];
+        if (c != null && third.op == OpCode.isub) {
+          fused.push({ op: OpCode.isub_lc, operands: [x, c], target: -1, address: a.address });
+          i += 3;
+          continue;
+        }
+        if (c != null && third.op >= OpCode.if_icmpeq && third.op <= OpCode.if_icmple) {
+          let op = OpCode.if_icmpeq_lc + (third.op - OpCode.if_icmpeq);
+          fused.push({ op: op, operands: [x, c], target: third.target, address: a.address });
+          i += 3;
+          continue;
+        }
+      }
+      if (a.op == OpCode.iinc && canFuse(i, 2) && instrs[i + 1].op == OpCode.goto) {
+        // iinc x c; goto addr
+        fused.push({ op: OpCode.iinc_goto, operands: a.operands, target: instrs[i + 1].target, address: a.address });
+        i += 2;
+        continue;
+      }
+      fused.push(a);
+      i++;
+    }
+
+    // 3.重新计算地址
+    let newAddresses: Map<number, number> = new Map();
+    let address = 0;
+    for (let instr of fused) {
+      newAddresses.set(instr.address, address);
+      address += 1 + instr.operands.length + (instr.target >= 0 ? 2 : 0);
+    }
+    newAddresses.set(code.length, address); // 跳转到代码末尾
+
+    // 4.生成新的代码
+    let ret: number[] = [];
+    for (let instr of fused) {
+      ret.push(instr.op);
+      for (let operand of instr.operands) {
+        ret.push(operand);
+      }
+      if (instr.target >= 0) {
+        let target = newAddresses.get(instr.target);
+        if (target == undefined) {
+          console.log('invalid jump target in fuseSuperInstructions: ' + instr.target);
+          return code;
+        }
+        ret.push(target >> 8);
+        ret.push(target & 0xff);
+      }
+    }
+    return ret;
+  }
+
+  /**
+   * 计算一个函数的操作数栈最多有多深，作为opStackSize写入字节码文件。
+   * 虚拟机加载时会校验操作数栈不超过opStackSize，运行时不再检查。
+   * 从第一条指令开始，沿着顺序执行和跳转两条路径，记下每条指令执行前栈的最大深度。
+   * @param code 一个函数完整的字节码
+   */
+  private maxStackDepth(code: number[]): number {
+    let depths: number[] = new Array(code.length).fill(-1);
+    let worklist: number[] = [0];
+    depths[0] = 0;
+    let max = 0;
+    while (worklist.length > 0) {
+      let codeIndex = worklist.pop() as number;
+      let op = code[codeIndex];
+      let len = getOpLength(op);
+      let depth = depths[codeIndex];
+
+      // 指令执行后栈的深度
+      switch (op) {
         case OpCode.iconst_0:
         case OpCode.iconst_1:
         case OpCode.iconst_2:
         case OpCode.iconst_3:
         case OpCode.iconst_4:
         case OpCode.iconst_5:
-        case OpCode.istore_0:
-        case OpCode.istore_1:
-        case OpCode.istore_2:
-        case OpCode.istore_3:
+        case OpCode.dconst_0:
+        case OpCode.dconst_1:
+        case OpCode.bipush:
+        case OpCode.sipush:
+        case OpCode.ldc:
+        case OpCode.sldc:
+        case OpCode.ldc_w:
+        case OpCode.sldc_w:
+        case OpCode.ldc2_w:
+        case OpCode.iload:
         case OpCode.iload_0:
         case OpCode.iload_1:
         case OpCode.iload_2:
         case OpCode.iload_3:
-        case OpCode.ireturn:
-        case OpCode.return:
-        case OpCode.lcmp:
-          codeIndex++;
-          continue;
-
-        // 指令后面带1个字节的操作数
-        case OpCode.iload:
+        case OpCode.isub_lc:
+          depth++;
+          break;
         case OpCode.istore:
-        case OpCode.bipush:
-        case OpCode.ldc:
-        case OpCode.sldc:
-          codeIndex += 2;
-          continue;
-
-        // 指令后面带2个字节的操作数
-        case OpCode.iinc:
-        case OpCode.invokestatic:
-        case OpCode.sipush:
-          codeIndex += 3;
-          continue;
-
-        // 跳转语句，需要给跳转指令加上offset
-        case OpCode.if_icmpeq:
-        case OpCode.if_icmpne:
-        case OpCode.if_icmpge:
-        case OpCode.if_icmpgt:
-        case OpCode.if_icmple:
-        case OpCode.if_icmplt:
+        case OpCode.istore_0:
+        case OpCode.istore_1:
+        case OpCode.istore_2:
+        case OpCode.istore_3:
+        case OpCode.pop:
         case OpCode.ifeq:
         case OpCode.ifne:
+        case OpCode.iflt:
         case OpCode.ifge:
         case OpCode.ifgt:
         case OpCode.ifle:
-        case OpCode.iflt:
-        case OpCode.goto:
-          let byte1 = code[codeIndex + 1];
-          let byte2 = code[codeIndex + 2];
-          let address = (byte1 << 8) | (byte2 + offset);
-          code[codeIndex + 1] = address >> 8;
-          code[codeIndex + 2] = address;
-          codeIndex += 3;
-          continue;
+        case OpCode.iadd:
+        case OpCode.sadd:
+        case OpCode.isub:
+        case OpCode.imul:
+        case OpCode.idiv:
+        case OpCode.dadd:
+        case OpCode.dsub:
+        case OpCode.dmul:
+        case OpCode.ddiv:
+        case OpCode.lcmp:
+        case OpCode.dcmpl:
+        case OpCode.dcmpg:
+          depth--;
+          break;
+        case OpCode.if_icmpeq:
+        case OpCode.if_icmpne:
+        case OpCode.if_icmplt:
+        case OpCode.if_icmpge:
+        case OpCode.if_icmpgt:
+        case OpCode.if_icmple:
+          depth -= 2;
+          break;
+        case OpCode.invokestatic: {
+          let calleeSym = this.m.consts[(code[codeIndex + 1] << 8) | code[codeIndex + 2]] as FunctionSymbol;
+          let functionType = calleeSym.theType as FunctionType;
+          depth -= functionType.paramTypes.length;
+          if (returnsValue(calleeSym)) depth++;
+          break;
+        }
+        default:
+          // i2d、d2i、iinc、goto和其他超级指令不改变栈的深度；ireturn、_return、invoketail之后没有后继指令
+          break;
+      }
+      if (depth > max) max = depth;
 
+      // 后继指令
+      let successors: number[] = [];
+      switch (op) {
+        case OpCode.goto:
+        case OpCode.iinc_goto:
+        case OpCode.ireturn:
+        case OpCode.return:
+        case OpCode.invoketail:
+          break;
         default:
-          console.log('unrecognized Op Code in addOffsetToJumpOp: ' + OpCode[code[codeIndex]]);
-          return code;
+          successors.push(codeIndex + len);
+      }
+      if (isJumpOp(op)) {
+        successors.push((code[codeIndex + len - 2] << 8) | code[codeIndex + len - 1]);
+      }
+      for (let s of successors) {
+        if (s < code.length && depth > depths[s]) {
+          if (depth > 0xff) {
+            // 表达式语句都用pop丢掉了值，正常生成的代码不会这样
+            throw new Error('Operand stack grows without bound in function ' + this.functionSym?.name + '.');
+          }
+          depths[s] = depth;
+          worklist.push(s);
+        }
       }
     }
-    return code;
+    return max;
+  }
+
+  /**
+   * 如果是iload类的指令，返回本地变量的下标，否则返回-1
+   * @param instr
+   */
+  private static loadIndex(instr: PeepholeInstr): number {
+    if (instr.op >= OpCode.iload_0 && instr.op <= OpCode.iload_3) return instr.op - OpCode.iload_0;
+    if (instr.op == OpCode.iload) return instr.operands[0];
+    return -1;
+  }
+
+  /**
+   * 如果是istore类的指令，返回本地变量的下标，否则返回-1
+   * @param instr
+   */
+  private static storeIndex(instr: PeepholeInstr): number {
+    if (instr.op >= OpCode.istore_0 && instr.op <= OpCode.istore_3) return instr.op - OpCode.istore_0;
+    if (instr.op == OpCode.istore) return instr.operands[0];
+    return -1;
+  }
+
+  /**
+   * 如果是iconst或bipush指令，返回所加载的整数，否则返回null
+   * @param instr
+   */
+  private static constValue(instr: PeepholeInstr): number | null {
+    if (instr.op >= OpCode.iconst_0 && instr.op <= OpCode.iconst_5) return instr.op - OpCode.iconst_0;
+    if (instr.op == OpCode.bipush) return instr.operands[0];
+    return null;
   }
 
   /**
@@ -520,10 +956,71 @@ export class BCGenerator extends AstVisitor {
       console.log(varSymbol);
       // 加入右子树的代码
       code = code2;
+      code = code.concat(this.convertNumber(bi.exp2.theType, varSymbol.theType));
       // 加入istore代码
       code = code.concat(this.setVariableValue(varSymbol));
     }
-    // // 2.处理其他二元运算
+    // // 2.decimal运算：操作数中有decimal，另一个操作数是integer或decimal
+    else if (this.isDecimalOperation(bi)) {
+      code = code1.concat(this.convertNumber(bi.exp1.theType, SysTypes.Decimal));
+      code = code.concat(code2).concat(this.convertNumber(bi.exp2.theType, SysTypes.Decimal));
+      switch (bi.op) {
+        case Op.Plus:
+          code.push(OpCode.dadd);
+          break;
+        case Op.Minus:
+          code.push(OpCode.dsub);
+          break;
+        case Op.Multiply:
+          code.push(OpCode.dmul);
+          break;
+        case Op.Divide:
+          code.push(OpCode.ddiv);
+          break;
+        case Op.G:
+        case Op.GE:
+        case Op.L:
+        case Op.LE:
+        case Op.EQ:
+        case Op.NE:
+          // 与JVM一样，用dcmpl或dcmpg得到-1、0、1，再与0比较。有NaN时比较的结果都是false
+          if (bi.op == Op.G) {
+            code.push(OpCode.dcmpl);
+            tempCode = OpCode.ifle;
+          } else if (bi.op == Op.GE) {
+            code.push(OpCode.dcmpl);
+            tempCode = OpCode.iflt;
+          } else if (bi.op == Op.L) {
+            code.push(OpCode.dcmpg);
+            tempCode = OpCode.ifge;
+          } else if (bi.op == Op.LE) {
+            code.push(OpCode.dcmpg);
+            tempCode = OpCode.ifgt;
+          } else if (bi.op == Op.EQ) {
+            code.push(OpCode.dcmpl);
+            tempCode = OpCode.ifne;
+          } else {
+            code.push(OpCode.dcmpl);
+            tempCode = OpCode.ifeq;
+          }
+
+          address1 = code.length + 7;
+          address2 = address1 + 1;
+          code.push(tempCode);
+          code.push(address1 >> 8);
+          code.push(address1);
+          code.push(OpCode.iconst_1);
+          code.push(OpCode.goto);
+          code.push(address2 >> 8);
+          code.push(address2);
+          code.push(OpCode.iconst_0);
+          break;
+        default:
+          console.log('Unsupported binary operation: ' + bi.op);
+          return [];
+      }
+    }
+    // // 3.处理其他二元运算
     else {
       // 加入左子树的代码
       code = code1;
@@ -587,6 +1084,31 @@ export class BCGenerator extends AstVisitor {
     return code;
   }
 
+  /**
+   * 二元运算是否要按decimal计算：至少一个操作数是decimal，另一个是integer或decimal
+   * @param bi
+   */
+  private isDecimalOperation(bi: Binary): boolean {
+    let t1 = bi.exp1.theType;
+    let t2 = bi.exp2.theType;
+    let isNumber = (t: Type | null) => t === SysTypes.Integer || t === SysTypes.Decimal;
+    return isNumber(t1) && isNumber(t2) && (t1 === SysTypes.Decimal || t2 === SysTypes.Decimal);
+  }
+
+  /**
+   * 在integer和decimal之间转换的指令。其他情况不需要转换，返回空数组
+   * @param from 栈顶的值的类型
+   * @param to 需要的类型
+   */
+  private convertNumber(from: Type | null, to: Type | null | undefined): number[] {
+    if (from === SysTypes.Integer && to === SysTypes.Decimal) {
+      return [OpCode.i2d];
+    } else if (from === SysTypes.Decimal && to === SysTypes.Integer) {
+      return [OpCode.d2i];
+    }
+    return [];
+  }
+
   visitUnary(u: Unary): any {
     let code: number[] = [];
     let v = this.visit(u.exp);
@@ -695,23 +1217,75 @@ export class BCGenerator extends AstVisitor {
 
     // 大于16位的，采用ldc指令，从常量池中去取
     else {
-      ret.push(OpCode.ldc);
       // 把value值放入常量池。
-      this.m.consts.push(value);
-      ret.push(this.m.consts.length - 1);
+      ret = this.loadConst(OpCode.ldc, OpCode.ldc_w, this.addConst(value));
     }
     //  console.log(ret);
     return ret;
   }
 
+  /**
+   * 生成decimal常量入栈的指令。0和1用快捷指令，其他的值放到常量池里，用ldc2_w加载
+   * @param decimalLiteral
+   */
+  visitDecimalLiteral(decimalLiteral: DecimalLiteral): any {
+    let ret: number[] = [];
+    let value = decimalLiteral.value;
+    if (Object.is(value, 0)) {
+      ret.push(OpCode.dconst_0);
+    } else if (value == 1) {
+      ret.push(OpCode.dconst_1);
+    } else {
+      let index = this.addConst(new DecimalConst(value));
+      ret.push(OpCode.ldc2_w);
+      ret.push(index >> 8);
+      ret.push(index & 0xff);
+    }
+    return ret;
+  }
+
   visitStringLiteral(stringLiteral: StringLiteral): any {
     let ret: number[] = [];
     let value = stringLiteral.value;
-    this.m.consts.push(value);
-    ret.push(OpCode.sldc);
-    ret.push(this.m.consts.length - 1);
+    ret = this.loadConst(OpCode.sldc, OpCode.sldc_w, this.addConst(value));
     return ret;
   }
+
+  /**
+   * 把常量加入常量池，返回它的下标。
+   * 指令中常量的下标最多占2个字节，常量池更大时无法生成代码。
+   * @param value
+   */
+  private addConst(value: any): number {
+    if (this.m.consts.length > 0xffff) {
+      throw new Error('Too many constants in module, at most 65536.');
+    }
+    this.m.consts.push(value);
+    return this.m.consts.length - 1;
+  }
+
+  /**
+   * 获取函数在常量池中的下标，还不在常量池中就加进去。
+   * 调用在后面声明的函数（比如相互递归）时，函数在生成它的代码之前就要有下标。
+   * @param functionSym
+   */
+  private addFunctionConst(functionSym: FunctionSymbol): number {
+    let index = this.m.consts.indexOf(functionSym);
+    return index != -1 ? index : this.addConst(functionSym);
+  }
+
+  /**
+   * 常量入栈的指令：下标不超过255时用1个字节的短格式，否则用宽格式。
+   * @param op 短格式的操作码
+   * @param wideOp 宽格式的操作码
+   * @param index 常量的下标
+   */
+  private loadConst(op: OpCode, wideOp: OpCode, index: number): number[] {
+    if (index <= 0xff) {
+      return [op, index];
+    }
+    return [wideOp, index >> 8, index & 0xff];
+  }
 }
 
 /**
@@ -764,6 +1338,8 @@ export class VM {
     let constIndex: number = 0;
     let numValue: number = 0;
     let strValue: string = '';
+    let localIndex: number = 0;
+    let constValue: number = 0;
 
     while (true) {
       switch (opCode) {
@@ -791,14 +1367,22 @@ export class VM {
           frame.oprandStack.push(5);
           opCode = code[++codeIndex];
           continue;
+        case OpCode.dconst_0:
+          frame.oprandStack.push(0.0);
+          opCode = code[++codeIndex];
+          continue;
+        case OpCode.dconst_1:
+          frame.oprandStack.push(1.0);
+          opCode = code[++codeIndex];
+          continue;
         case OpCode.bipush: // 取出1个字节
-          frame.oprandStack.push(code[++codeIndex]);
+          frame.oprandStack.push((code[++codeIndex] << 24) >> 24); // 8位有符号整数
           opCode = code[++codeIndex];
           continue;
-        case OpCode.sipush: // 取出2个字节
+        case OpCode.sipush: // 取出2个字节，16位有符号整数
           byte1 = code[++codeIndex];
           byte2 = code[++codeIndex];
-          frame.oprandStack.push((byte1 << 8) | byte2);
+          frame.oprandStack.push(((byte1 << 24) >> 16) | (byte2 & 0xff));
           opCode = code[++codeIndex];
           continue;
         case OpCode.ldc: // 从常量池加载
@@ -807,12 +1391,25 @@ export class VM {
           frame.oprandStack.push(numValue);
           opCode = code[++codeIndex];
           continue;
-        case OpCode.sldc: // 从常量池加载字符串
+        case OpCode.ldc2_w: // 从常量池加载decimal
+          byte1 = code[++codeIndex];
+          byte2 = code[++codeIndex];
+          frame.oprandStack.push((bcModule.consts[(byte1 << 8) | byte2] as DecimalConst).value);
+          opCode = code[++codeIndex];
+          continue;
+        case OpCode.sldc: // 从常量池加载字符串
           constIndex = code[++codeIndex];
           strValue = bcModule.consts[constIndex];
           frame.oprandStack.push(strValue);
           opCode = code[++codeIndex];
           continue;
+        case OpCode.ldc_w: // 宽格式，下标占2个字节
+        case OpCode.sldc_w:
+          byte1 = code[++codeIndex];
+          byte2 = code[++codeIndex];
+          frame.oprandStack.push(bcModule.consts[(byte1 << 8) | byte2]);
+          opCode = code[++codeIndex];
+          continue;
         case OpCode.iload:
           frame.oprandStack.push(frame.localVars[code[++codeIndex]]);
           opCode = code[++codeIndex];
@@ -853,6 +1450,10 @@ export class VM {
           frame.localVars[3] = frame.oprandStack.pop();
           opCode = code[++codeIndex];
           continue;
+        case OpCode.pop:
+          frame.oprandStack.pop();
+          opCode = code[++codeIndex];
+          continue;
         case OpCode.iadd:
         case OpCode.sadd:
           vright = frame.oprandStack.pop();
@@ -876,9 +1477,69 @@ export class VM {
           frame.oprandStack.push(vleft / vright);
           opCode = code[++codeIndex];
           continue;
+        case OpCode.dadd:
+          vright = frame.oprandStack.pop();
+          vleft = frame.oprandStack.pop();
+          frame.oprandStack.push(vleft + vright);
+          opCode = code[++codeIndex];
+          continue;
+        case OpCode.dsub:
+          vright = frame.oprandStack.pop();
+          vleft = frame.oprandStack.pop();
+          frame.oprandStack.push(vleft - vright);
+          opCode = code[++codeIndex];
+          continue;
+        case OpCode.dmul:
+          vright = frame.oprandStack.pop();
+          vleft = frame.oprandStack.pop();
+          frame.oprandStack.push(vleft * vright);
+          opCode = code[++codeIndex];
+          continue;
+        case OpCode.ddiv:
+          vright = frame.oprandStack.pop();
+          vleft = frame.oprandStack.pop();
+          frame.oprandStack.push(vleft / vright);
+          opCode = code[++codeIndex];
+          continue;
+        case OpCode.lcmp:
+          vright = frame.oprandStack.pop();
+          vleft = frame.oprandStack.pop();
+          frame.oprandStack.push(vleft < vright ? -1 : vleft > vright ? 1 : 0);
+          opCode = code[++codeIndex];
+          continue;
+        case OpCode.dcmpl:
+        case OpCode.dcmpg:
+          vright = frame.oprandStack.pop();
+          vleft = frame.oprandStack.pop();
+          if (vleft < vright) {
+            frame.oprandStack.push(-1);
+          } else if (vleft > vright) {
+            frame.oprandStack.push(1);
+          } else if (vleft == vright) {
+            frame.oprandStack.push(0);
+          } else {
+            frame.oprandStack.push(opCode == OpCode.dcmpl ? -1 : 1); // 有NaN
+          }
+          opCode = code[++codeIndex];
+          continue;
+        case OpCode.i2d:
+          // JavaScript中integer和decimal都是number，不需要转换
+          opCode = code[++codeIndex];
+          continue;
+        case OpCode.d2i:
+          // 向0截断，超出范围时取最大或最小的integer，NaN转换成0
+          numValue = frame.oprandStack.pop();
+          if (isNaN(numValue)) {
+            numValue = 0;
+          } else {
+            numValue = Math.max(-2147483648, Math.min(2147483647, Math.trunc(numValue)));
+          }
+          frame.oprandStack.push(numValue);
+          opCode = code[++codeIndex];
+          continue;
         case OpCode.iinc:
           let varIndex = code[++codeIndex];
-          let offset = code[++codeIndex];
+          let offset = (code[++codeIndex] << 24) >> 24; // 8位有符号整数
           frame.localVars[varIndex] = frame.localVars[varIndex] + offset;
           opCode = code[++codeIndex];
           continue;
@@ -975,6 +1636,34 @@ export class VM {
             }
           }
           continue;
+        case OpCode.invoketail: {
+          // 从常量池找到被调用的函数
+          byte1 = code[++codeIndex];
+          byte2 = code[++codeIndex];
+          let calleeSym = bcModule.consts[(byte1 << 8) | byte2] as FunctionSymbol;
+
+          // 用新的栈桢替换当前栈桢，返回地址仍然保存在调用者的栈桢里
+          let lastFrame = frame;
+          frame = new StackFrame(calleeSym);
+          this.callStack[this.callStack.length - 1] = frame;
+
+          // 传递参数
+          let paramCount = (calleeSym.theType as FunctionType).paramTypes.length;
+          for (let i = paramCount - 1; i >= 0; i--) {
+            frame.localVars[i] = lastFrame.oprandStack.pop();
+          }
+
+          if (calleeSym.byteCode != null) {
+            // 切换到被调用函数的代码
+            code = calleeSym.byteCode;
+            codeIndex = 0;
+            opCode = code[codeIndex];
+            continue;
+          } else {
+            console.log('Can not find code for ' + calleeSym.name);
+            return -1;
+          }
+        }
         case OpCode.ifeq:
           byte1 = code[++codeIndex];
           byte2 = code[++codeIndex];
@@ -995,6 +1684,49 @@ export class VM {
             opCode = code[++codeIndex];
           }
           continue;
+        case OpCode.iflt:
+        case OpCode.ifge:
+        case OpCode.ifgt:
+        case OpCode.ifle:
+          byte1 = code[++codeIndex];
+          byte2 = code[++codeIndex];
+          numValue = frame.oprandStack.pop();
+          if (
+            (opCode == OpCode.iflt && numValue < 0) ||
+            (opCode == OpCode.ifge && numValue >= 0) ||
+            (opCode == OpCode.ifgt && numValue > 0) ||
+            (opCode == OpCode.ifle && numValue <= 0)
+          ) {
+            codeIndex = (byte1 << 8) | byte2;
+            opCode = code[codeIndex];
+          } else {
+            opCode = code[++codeIndex];
+          }
+          continue;
+        case OpCode.if_icmpeq:
+          byte1 = code[++codeIndex];
+          byte2 = code[++codeIndex];
+          vright = frame.oprandStack.pop();
+          vleft = frame.oprandStack.pop();
+          if (vleft == vright) {
+            codeIndex = (byte1 << 8) | byte2;
+            opCode = code[codeIndex];
+          } else {
+            opCode = code[++codeIndex];
+          }
+          continue;
+        case OpCode.if_icmpne:
+          byte1 = code[++codeIndex];
+          byte2 = code[++codeIndex];
+          vright = frame.oprandStack.pop();
+          vleft = frame.oprandStack.pop();
+          if (vleft != vright) {
+            codeIndex = (byte1 << 8) | byte2;
+            opCode = code[codeIndex];
+          } else {
+            opCode = code[++codeIndex];
+          }
+          continue;
         case OpCode.if_icmplt:
           byte1 = code[++codeIndex];
           byte2 = code[++codeIndex];
@@ -1050,7 +1782,108 @@ export class VM {
           opCode = code[codeIndex];
           continue;
 
+        // 超级指令
+        case OpCode.isub_lc:
+          localIndex = code[++codeIndex];
+          constValue = (code[++codeIndex] << 24) >> 24; // 8位有符号整数
+          frame.oprandStack.push(frame.localVars[localIndex] - constValue);
+          opCode = code[++codeIndex];
+          continue;
+        case OpCode.if_icmpeq_lc:
+          localIndex = code[++codeIndex];
+          constValue = (code[++codeIndex] << 24) >> 24; // 8位有符号整数
+          byte1 = code[++codeIndex];
+          byte2 = code[++codeIndex];
+          if (frame.localVars[localIndex] == constValue) {
+            codeIndex = (byte1 << 8) | byte2;
+            opCode = code[codeIndex];
+          } else {
+            opCode = code[++codeIndex];
+          }
+          continue;
+        case OpCode.if_icmpne_lc:
+          localIndex = code[++codeIndex];
+          constValue = (code[++codeIndex] << 24) >> 24; // 8位有符号整数
+          byte1 = code[++codeIndex];
+          byte2 = code[++codeIndex];
+          if (frame.localVars[localIndex] != constValue) {
+            codeIndex = (byte1 << 8) | byte2;
+            opCode = code[codeIndex];
+          } else {
+            opCode = code[++codeIndex];
+          }
+          continue;
+        case OpCode.if_icmplt_lc:
+          localIndex = code[++codeIndex];
+          constValue = (code[++codeIndex] << 24) >> 24; // 8位有符号整数
+          byte1 = code[++codeIndex];
+          byte2 = code[++codeIndex];
+          if (frame.localVars[localIndex] < constValue) {
+            codeIndex = (byte1 << 8) | byte2;
+            opCode = code[codeIndex];
+          } else {
+            opCode = code[++codeIndex];
+          }
+          continue;
+        case OpCode.if_icmpge_lc:
+          localIndex = code[++codeIndex];
+          constValue = (code[++codeIndex] << 24) >> 24; // 8位有符号整数
+          byte1 = code[++codeIndex];
+          byte2 = code[++codeIndex];
+          if (frame.localVars[localIndex] >= constValue) {
+            codeIndex = (byte1 << 8) | byte2;
+            opCode = code[codeIndex];
+          } else {
+            opCode = code[++codeIndex];
+          }
+          continue;
+        case OpCode.if_icmpgt_lc:
+          localIndex = code[++codeIndex];
+          constValue = (code[++codeIndex] << 24) >> 24; // 8位有符号整数
+          byte1 = code[++codeIndex];
+          byte2 = code[++codeIndex];
+          if (frame.localVars[localIndex] > constValue) {
+            codeIndex = (byte1 << 8) | byte2;
+            opCode = code[codeIndex];
+          } else {
+            opCode = code[++codeIndex];
+          }
+          continue;
+        case OpCode.if_icmple_lc:
+          localIndex = code[++codeIndex];
+          constValue = (code[++codeIndex] << 24) >> 24; // 8位有符号整数
+          byte1 = code[++codeIndex];
+          byte2 = code[++codeIndex];
+          if (frame.localVars[localIndex] <= constValue) {
+            codeIndex = (byte1 << 8) | byte2;
+            opCode = code[codeIndex];
+          } else {
+            opCode = code[++codeIndex];
+          }
+          continue;
+        case OpCode.iadd_ll_st:
+          byte1 = code[++codeIndex];
+          byte2 = code[++codeIndex];
+          localIndex = code[++codeIndex];
+          frame.localVars[localIndex] = frame.localVars[byte1] + frame.localVars[byte2];
+          opCode = code[++codeIndex];
+          continue;
+        case OpCode.iinc_goto:
+          localIndex = code[++codeIndex];
+          constValue = (code[++codeIndex] << 24) >> 24; // 8位有符号整数
+          frame.localVars[localIndex] = frame.localVars[localIndex] + constValue;
+          byte1 = code[++codeIndex];
+          byte2 = code[++codeIndex];
+          codeIndex = (byte1 << 8) | byte2;
+          opCode = code[codeIndex];
+          continue;
+
         default:
+          // 执行到代码末尾，与C语言版本的虚拟机一样，当作一条return指令
+          if (codeIndex >= code.length) {
+            opCode = OpCode.return;
+            continue;
+          }
           console.log('Unknown op code: ' + opCode?.toString(16));
           return -2;
       }
@@ -1080,37 +1913,104 @@ class StackFrame {
 // // // // // // // // // // // // // // // // // // // // // // // // // // // // // //
 // 生成字节码
 
+/**
+ * 字节码文件的格式（版本2），与C语言版本的虚拟机一致，见packages/vm/src/vm/playvm.c中的readBCModule()。
+ *
+ * 文件头8个字节：魔数"PLBC"、版本号（1字节）、节的数量（1字节）、2个保留字节。
+ * 之后是节表，每一项9个字节：节的编号（1字节）、节在文件中的偏移量和长度（各4字节，低位在前）。
+ * 节的内容中，整数都是LEB128编码的变长整数（varint），常量中的integer是有符号的。
+ *   字符串表：字符串数量，每个字符串是UTF-8的字节数、字节和一个结尾的0。名称都用字符串表中的下标表示
+ *   类型：类型数量，每个类型是类别（1字节）、名称，以及引用的其他类型。被引用的类型总是在前面，所以读一遍就可以
+ *   常量：常量数量，每个常量是类别（1字节）和值。函数常量的值是函数在函数节中的下标
+ *   函数：函数数量、main函数的下标（没有main时等于函数数量）、每个函数记录在本节中的偏移量（各4字节，低位在前），
+ *         然后是函数记录：名称、类型、操作数栈大小、本地变量（名称和类型）、字节码在代码节中的偏移量和长度。
+ *         有了偏移量，C语言版本的虚拟机在函数第一次被调用时才读取它的记录
+ *   代码：所有函数的字节码，首尾相接
+ * 引用类型时用的是类型的下标：前BC_SYS_TYPES.length个是内置类型，之后是类型节中的类型。
+ */
+const BC_MAGIC = [0x50, 0x4c, 0x42, 0x43]; // "PLBC"
+const BC_VERSION = 2;
+const BC_HEADER_SIZE = 8;
+const BC_SECTION_ENTRY_SIZE = 9;
+
+enum BCSection {
+  Strings = 1,
+  Types = 2,
+  Consts = 3,
+  Functions = 4,
+  Code = 5,
+}
+
+// 内置类型在字节码文件中的下标，顺序是格式的一部分，不能改变
+const BC_SYS_TYPES: Type[] = [
+  SysTypes.Any,
+  SysTypes.Number,
+  SysTypes.String,
+  SysTypes.Boolean,
+  SysTypes.Null,
+  SysTypes.Undefined,
+  SysTypes.Integer,
+  SysTypes.Decimal,
+  SysTypes.Void,
+];
+
 /**
  * 从bcModule生成字节码
  */
 export class BCModuleWriter {
-  private types: Type[] = []; // 保存该模块所涉及的类型
+  private strings: string[] = []; // 字符串表
+  private stringIndexes: Map<string, number> = new Map();
+  private types: Type[] = []; // 该模块所涉及的自定义类型，下标加上内置类型的数量就是类型的引用
+  private typeIndexes: Map<Type, number> = new Map();
+  private code: number[] = []; // 所有函数的字节码
+  private functionOffsets: number[] = []; // 每个函数记录相对于第一个函数记录的偏移量
 
   /**
    * 从bcModule生成字节码
    * @param bcModule
    */
   write(bcModule: BCModule): number[] {
-    let bc2: number[] = [];
-    this.types = []; // 重置状态变量
-
-    // 写入常量
+    // 重置状态变量
+    this.strings = [];
+    this.stringIndexes.clear();
+    this.types = [];
+    this.typeIndexes.clear();
+    this.code = [];
+    this.functionOffsets = [];
+
+    // 写入常量和函数。函数的字节码写入代码节
+    let consts: number[] = [];
+    let functions: number[] = [];
     let numConsts = 0;
+    let mainIndex = -1;
     for (let c of bcModule.consts) {
       if (typeof c == 'number') {
-        bc2.push(1); // 代表接下来是一个number；
-        bc2.push(c);
+        consts.push(1); // 代表接下来是一个number；
+        this.writeSignedVarint(consts, c);
         numConsts++;
       } else if (typeof c == 'string') {
-        bc2.push(2); // 代表接下来是一个string；
-        this.writeString(bc2, c);
+        consts.push(2); // 代表接下来是一个string；
+        this.writeString(consts, c);
+        numConsts++;
+      } else if (c instanceof DecimalConst) {
+        consts.push(4); // 代表接下来是一个decimal，8个字节，高位在前
+        let view = new DataView(new ArrayBuffer(8));
+        view.setFloat64(0, c.value);
+        for (let i = 0; i < 8; i++) {
+          consts.push(view.getUint8(i));
+        }
         numConsts++;
       } else if (typeof c == 'object') {
         let functionSym = c as FunctionSymbol;
         if (!built_ins.has(functionSym.name)) {
           // 不用写入系统函数
-          bc2.push(3); // 代表接下来是一个FunctionSymbol.
-          bc2 = bc2.concat(this.writeFunctionSymbol(functionSym));
+          consts.push(3); // 代表接下来是一个FunctionSymbol.
+          if (functionSym == bcModule._main) {
+            mainIndex = this.functionOffsets.length;
+          }
+          this.writeVarint(consts, this.functionOffsets.length);
+          this.functionOffsets.push(functions.length);
+          this.writeFunctionSymbol(functions, functionSym);
           numConsts++;
         }
       } else {
@@ -1119,161 +2019,215 @@ export class BCModuleWriter {
       }
     }
 
-    // 写入类型
-    let bc1: number[] = [];
-    this.writeString(bc1, 'types');
-    bc1.push(this.types.length);
-    for (let t of this.types) {
+    // 写入类型。类型表中，被引用的类型都排在引用它的类型前面，见addType()
+    let types: number[] = [];
+    for (let i = 0; i < this.types.length; i++) {
+      let t = this.types[i];
       if (Type.isFunctionType(t)) {
-        bc1 = bc1.concat(this.writeFunctionType(t as FunctionType));
+        this.writeFunctionType(types, t as FunctionType);
       } else if (Type.isSimpleType(t)) {
-        bc1 = bc1.concat(this.writeSimpleType(t as SimpleType));
+        this.writeSimpleType(types, t as SimpleType);
       } else if (Type.isUnionType(t)) {
-        bc1 = bc1.concat(this.writeUnionType(t as UnionType));
+        this.writeUnionType(types, t as UnionType);
       } else {
         console.log('Unsupported type in BCModuleWriter');
         console.log(t);
       }
     }
 
-    this.writeString(bc1, 'consts');
-    bc1.push(numConsts);
-
-    return bc1.concat(bc2);
-  }
-
-  private writeVarSymbol(sym: VarSymbol): number[] {
-    let bc: number[] = [];
-
-    // 写入变量名称
-    this.writeString(bc, sym.name);
+    // 最后写入字符串表，这时所有的名称都已经加入了
+    let strings: number[] = [];
+    let encoder = new TextEncoder();
+    for (let str of this.strings) {
+      let bytes = encoder.encode(str);
+      this.writeVarint(strings, bytes.length);
+      for (let b of bytes) {
+        strings.push(b);
+      }
+      strings.push(0);
+    }
 
-    // 写入类型名称
-    this.writeString(bc, sym.theType.name);
-    if (!SysTypes.isSysType(sym.theType) && this.types.indexOf(sym.theType) == -1) {
-      this.types.push(sym.theType);
+    // 函数节的开头：函数数量、main函数的下标和函数记录的偏移量表。偏移量从节的开头算起
+    let numFunctions = this.functionOffsets.length;
+    let functionTable: number[] = [];
+    this.writeVarint(functionTable, numFunctions);
+    this.writeVarint(functionTable, mainIndex >= 0 ? mainIndex : numFunctions);
+    let recordsOffset = functionTable.length + numFunctions * 4;
+    for (let offset of this.functionOffsets) {
+      this.writeUint32(functionTable, recordsOffset + offset);
     }
 
+    let sections: [BCSection, number[]][] = [
+      [BCSection.Strings, this.withCount(this.strings.length, strings)],
+      [BCSection.Types, this.withCount(this.types.length, types)],
+      [BCSection.Consts, this.withCount(numConsts, consts)],
+      [BCSection.Functions, functionTable.concat(functions)],
+      [BCSection.Code, this.code],
+    ];
+
+    // 文件头和节表
+    let bc: number[] = BC_MAGIC.concat([BC_VERSION, sections.length, 0, 0]);
+    let offset = BC_HEADER_SIZE + sections.length * BC_SECTION_ENTRY_SIZE;
+    for (let [id, data] of sections) {
+      bc.push(id);
+      this.writeUint32(bc, offset);
+      this.writeUint32(bc, data.length);
+      offset += data.length;
+    }
+    for (let [, data] of sections) {
+      for (let b of data) {
+        bc.push(b);
+      }
+    }
     return bc;
   }
 
-  writeFunctionSymbol(sym: FunctionSymbol): number[] {
-    let bc: number[] = [];
-
-    // 写入函数名称
+  private writeFunctionSymbol(bc: number[], sym: FunctionSymbol) {
+    // 写入函数名称和类型
     this.writeString(bc, sym.name);
-
-    // 写入类型名称
-    this.writeString(bc, sym.theType.name);
-    if (!SysTypes.isSysType(sym.theType) && this.types.indexOf(sym.theType) == -1) {
-      this.types.push(sym.theType);
-    }
+    this.writeType(bc, sym.theType);
 
     // 写入操作数栈最大的大小
-    bc.push(sym.opStackSize);
+    this.writeVarint(bc, sym.opStackSize);
 
-    // 写入本地变量个数
-    bc.push(sym.vars.length);
-
-    // 逐一写入变量
+    // 逐一写入本地变量
     // TODO：其实具体变量的信息不是必需的。
+    this.writeVarint(bc, sym.vars.length);
     for (let v of sym.vars) {
-      bc = bc.concat(this.writeVarSymbol(v));
+      this.writeString(bc, v.name);
+      this.writeType(bc, v.theType);
     }
 
-    // 写入函数函数体的字节码
-    if (sym.byteCode == null) {
-      // 内置函数
-      bc.push(0);
-    } else {
-      // 自定义函数
-      bc.push((sym.byteCode as number[]).length);
-      bc = bc.concat(sym.byteCode as number[]);
+    // 写入函数体的字节码在代码节中的位置。生成字节码时，操作数可能是负数，在这里截成一个字节
+    let byteCode = sym.byteCode == null ? [] : (sym.byteCode as number[]);
+    this.writeVarint(bc, this.code.length);
+    this.writeVarint(bc, byteCode.length);
+    for (let b of byteCode) {
+      this.code.push(b & 0xff);
     }
-
-    return bc;
   }
 
-  writeSimpleType(t: SimpleType): number[] {
-    let bc: number[] = [];
-    if (SysTypes.isSysType(t)) {
-      // 内置类型不用添加
-      return bc;
-    }
-
+  private writeSimpleType(bc: number[], t: SimpleType) {
     bc.push(1); // 代表SimpleType
-
-    // 写入类型名称
     this.writeString(bc, t.name);
 
-    // 写入父类型的数量
-    bc.push(t.upperTypes.length);
+    // 写入父类型
+    this.writeVarint(bc, t.upperTypes.length);
     for (let ut of t.upperTypes) {
-      this.writeString(bc, ut.name);
-      if (!SysTypes.isSysType(ut) && this.types.indexOf(ut) == -1) {
-        this.types.push(ut);
-      }
+      this.writeType(bc, ut);
     }
-
-    return bc;
   }
 
-  writeFunctionType(t: FunctionType): number[] {
-    let bc: number[] = [];
-
+  private writeFunctionType(bc: number[], t: FunctionType) {
     bc.push(2); // 代表FunctionType
-
-    // 写入类型名称
     this.writeString(bc, t.name);
+    this.writeType(bc, t.returnType);
 
-    // 写入返回值名称
-    this.writeString(bc, t.returnType.name);
-
-    // 写入参数数量
-    bc.push(t.paramTypes.length);
-
-    // 写入参数的类型名称
+    // 写入参数的类型
+    this.writeVarint(bc, t.paramTypes.length);
     for (let pt of t.paramTypes) {
-      this.writeString(bc, pt.name);
-      if (this.types.indexOf(pt) == -1) {
-        this.types.push(pt);
-      }
+      this.writeType(bc, pt);
     }
-
-    return bc;
   }
 
-  writeUnionType(t: UnionType): number[] {
-    let bc: number[] = [];
-
+  private writeUnionType(bc: number[], t: UnionType) {
     bc.push(3); // 代表UnionType
-
-    // 写入类型名称
     this.writeString(bc, t.name);
 
-    // 写入联合的各类型名称
+    // 写入联合的各个类型
+    this.writeVarint(bc, t.types.length);
     for (let ut of t.types) {
-      this.writeString(bc, ut.name);
-      if (this.types.indexOf(ut) == -1) {
-        this.types.push(ut);
-      }
+      this.writeType(bc, ut);
     }
+  }
 
-    return bc;
+  /**
+   * 写入对类型的引用，即类型的下标
+   */
+  private writeType(bc: number[], t: Type) {
+    this.writeVarint(bc, this.addType(t));
   }
 
   /**
-   * 把字符串添加的字节码数组中
-   * @param bc
-   * @param str
+   * 返回类型的下标。第一次遇到的自定义类型会加到类型表中，在此之前先加入它所引用的类型，
+   * 这样读取时每个类型引用的都是已经读过的类型。
+   */
+  private addType(t: Type): number {
+    let index = BC_SYS_TYPES.indexOf(t);
+    if (index != -1) {
+      return index;
+    }
+    let known = this.typeIndexes.get(t);
+    if (known != undefined) {
+      return known;
+    }
+
+    let refs: Type[] = [];
+    if (Type.isFunctionType(t)) {
+      refs = [(t as FunctionType).returnType].concat((t as FunctionType).paramTypes);
+    } else if (Type.isSimpleType(t)) {
+      refs = (t as SimpleType).upperTypes;
+    } else if (Type.isUnionType(t)) {
+      refs = (t as UnionType).types;
+    }
+    for (let ref of refs) {
+      this.addType(ref);
+    }
+
+    index = BC_SYS_TYPES.length + this.types.length;
+    this.types.push(t);
+    this.typeIndexes.set(t, index);
+    return index;
+  }
+
+  /**
+   * 写入对字符串的引用，即字符串在字符串表中的下标。相同的字符串只保存一次
    */
   private writeString(bc: number[], str: string) {
-    // 写入字符串的长度
-    bc.push(str.length);
-    for (let i = 0; i < str.length; i++) {
-      bc.push(str.charCodeAt(i));
+    let index = this.stringIndexes.get(str);
+    if (index == undefined) {
+      index = this.strings.length;
+      this.strings.push(str);
+      this.stringIndexes.set(str, index);
+    }
+    this.writeVarint(bc, index);
+  }
+
+  // 无符号的LEB128：每个字节存7位，低位在前，最高位为1表示后面还有字节
+  private writeVarint(bc: number[], value: number) {
+    do {
+      let b = value & 0x7f;
+      value >>>= 7;
+      bc.push(value != 0 ? b | 0x80 : b);
+    } while (value != 0);
+  }
+
+  // 有符号的LEB128：最后一个字节的第6位是符号位
+  private writeSignedVarint(bc: number[], value: number) {
+    value |= 0;
+    for (;;) {
+      let b = value & 0x7f;
+      value >>= 7;
+      if ((value == 0 && (b & 0x40) == 0) || (value == -1 && (b & 0x40) != 0)) {
+        bc.push(b);
+        return;
+      }
+      bc.push(b | 0x80);
     }
   }
+
+  private writeUint32(bc: number[], value: number) {
+    for (let i = 0; i < 4; i++) {
+      bc.push((value >>> (i * 8)) & 0xff);
+    }
+  }
+
+  // 在一个节的内容前面加上其中的项数
+  private withCount(count: number, data: number[]): number[] {
+    let bc: number[] = [];
+    this.writeVarint(bc, count);
+    return bc.concat(data);
+  }
 }
 
 /**
@@ -1283,10 +2237,14 @@ export class BCModuleReader {
   // 读取字节码时的下标
   private index: number = 0;
 
-  // 解析出来的所有类型
-  private types: Map<string, Type> = new Map();
+  // 字符串表
+  private strings: string[] = [];
+
+  // 类型表，前面是内置类型
+  private types: Type[] = [];
 
-  private typeInfos: Map<string, any> = new Map();
+  // 代码节的起始位置
+  private codeOffset: number = 0;
 
   /**
    * 从字节码生成BCModule
@@ -1295,53 +2253,90 @@ export class BCModuleReader {
   read(bc: number[]): BCModule {
     // 重置状态变量
     this.index = 0;
-    this.types.clear();
+    this.strings = [];
+    this.types = BC_SYS_TYPES.slice();
 
     let bcModule = new BCModule();
 
-    // 1.读取类型
-    // 1.1加入系统内置类型
-    this.addSystemTypes();
+    // 1.文件头和节表
+    for (let i = 0; i < BC_MAGIC.length; i++) {
+      if (bc[i] != BC_MAGIC[i]) {
+        throw new Error('Not a bytecode file.');
+      }
+    }
+    if (bc[4] != BC_VERSION) {
+      throw new Error('Unsupported bytecode version ' + bc[4] + ', expecting ' + BC_VERSION + '.');
+    }
+    let sections: Map<number, number> = new Map();
+    for (let i = 0; i < bc[5]; i++) {
+      this.index = BC_HEADER_SIZE + i * BC_SECTION_ENTRY_SIZE;
+      let id = bc[this.index++];
+      let offset = this.readUint32(bc);
+      let size = this.readUint32(bc);
+      if (offset + size > bc.length) {
+        throw new Error('Truncated bytecode file: section ' + id + ' ends at ' + (offset + size) + '.');
+      }
+      sections.set(id, offset);
+    }
+    for (let id of [BCSection.Strings, BCSection.Types, BCSection.Consts, BCSection.Functions, BCSection.Code]) {
+      if (!sections.has(id)) {
+        throw new Error('Missing section ' + id + ' in bytecode file.');
+      }
+    }
+    this.codeOffset = sections.get(BCSection.Code) as number;
+
+    // 2.读取字符串表
+    this.index = sections.get(BCSection.Strings) as number;
+    let numStrings = this.readVarint(bc);
+    let decoder = new TextDecoder();
+    for (let i = 0; i < numStrings; i++) {
+      let len = this.readVarint(bc);
+      this.strings.push(decoder.decode(new Uint8Array(bc.slice(this.index, this.index + len))));
+      this.index += len + 1; // 跳过结尾的0
+    }
 
-    // 1.2从字节码中读取类型
-    let str = this.readString(bc);
-    assert(str == 'types', "从字节码中读取的字符串不是'types'");
-    let numTypes = bc[this.index++];
+    // 3.读取类型。类型只引用前面的类型，读一遍就可以
+    this.index = sections.get(BCSection.Types) as number;
+    let numTypes = this.readVarint(bc);
     for (let i = 0; i < numTypes; i++) {
-      let typeKind = bc[this.index++];
-      switch (typeKind) {
-        case 1:
-          this.readSimpleType(bc);
-          break;
-        case 2:
-          this.readFunctionType(bc);
-          break;
-        case 3:
-          this.readUnionType(bc);
-          break;
-        default:
-          console.log('Unsupported type kind: ' + typeKind);
-      }
+      this.types.push(this.readType(bc));
+    }
+
+    // 4.读取函数：先读偏移量表，再按偏移量读取每个函数记录
+    let functionsOffset = sections.get(BCSection.Functions) as number;
+    this.index = functionsOffset;
+    let numFunctions = this.readVarint(bc);
+    let mainIndex = this.readVarint(bc);
+    let recordOffsets: number[] = [];
+    for (let i = 0; i < numFunctions; i++) {
+      recordOffsets.push(functionsOffset + this.readUint32(bc));
+    }
+    let functions: FunctionSymbol[] = [];
+    for (let offset of recordOffsets) {
+      this.index = offset;
+      functions.push(this.readFunctionSymbol(bc));
+    }
+    if (mainIndex < numFunctions) {
+      bcModule._main = functions[mainIndex];
     }
-    this.buildTypes();
 
-    // 2.读取常量
-    str = this.readString(bc);
-    assert(str == 'consts', "从字节码中读取的字符串不是'consts'");
-    let numConsts = bc[this.index++];
+    // 5.读取常量
+    this.index = sections.get(BCSection.Consts) as number;
+    let numConsts = this.readVarint(bc);
     for (let i = 0; i < numConsts; i++) {
       let constType = bc[this.index++];
       if (constType == 1) {
-        bcModule.consts.push(bc[this.index++]);
+        bcModule.consts.push(this.readSignedVarint(bc));
       } else if (constType == 2) {
-        let str = this.readString(bc);
-        bcModule.consts.push(str);
-      } else if (constType == 3) {
-        let functionSym = this.readFunctionSymbol(bc);
-        bcModule.consts.push(functionSym);
-        if (functionSym.name == 'main') {
-          bcModule._main = functionSym;
+        bcModule.consts.push(this.readString(bc));
+      } else if (constType == 4) {
+        let view = new DataView(new ArrayBuffer(8));
+        for (let i = 0; i < 8; i++) {
+          view.setUint8(i, bc[this.index++]);
         }
+        bcModule.consts.push(new DecimalConst(view.getFloat64(0)));
+      } else if (constType == 3) {
+        bcModule.consts.push(functions[this.readVarint(bc)]);
       } else {
         console.log('Unsupported const type: ' + constType);
       }
@@ -1350,103 +2345,43 @@ export class BCModuleReader {
     return bcModule;
   }
 
-  private readString(bc: number[]): string {
-    let len = bc[this.index++];
-    let str = '';
-    for (let i = 0; i < len; i++) {
-      str += String.fromCharCode(bc[this.index++]);
-    }
-    return str;
-  }
-
-  private readSimpleType(bc: number[]) {
-    let typeName = this.readString(bc);
-    let numUpperTypes = bc[this.index++];
-    let upperTypes: string[] = [];
-    for (let i = 0; i < numUpperTypes; i++) {
-      upperTypes.push(this.readString(bc));
-    }
-
-    let t = new SimpleType(typeName, []);
-    this.types.set(typeName, t);
-    this.typeInfos.set(typeName, upperTypes);
-  }
-
-  private readFunctionType(bc: number[]) {
+  /**
+   * 读取一个类型
+   */
+  private readType(bc: number[]): Type {
+    let typeKind = bc[this.index++];
     let typeName = this.readString(bc);
-    let returnType = this.readString(bc);
-    let numParams = bc[this.index++];
-    let paramTypes: string[] = [];
-    for (let i = 0; i < numParams; i++) {
-      paramTypes.push(this.readString(bc));
+    switch (typeKind) {
+      case 1:
+        return new SimpleType(typeName, this.readTypes(bc) as SimpleType[]);
+      case 2: {
+        let returnType = this.readTypeRef(bc);
+        return new FunctionType(returnType, this.readTypes(bc), typeName);
+      }
+      case 3:
+        return new UnionType(this.readTypes(bc), typeName);
+      default:
+        throw new Error('Unsupported type kind: ' + typeKind);
     }
-
-    let t = new FunctionType(SysTypes.Any, [], typeName);
-    this.types.set(typeName, t);
-    this.typeInfos.set(typeName, { returnType: returnType, paramTypes: paramTypes });
   }
 
-  private readUnionType(bc: number[]) {
-    let typeName = this.readString(bc);
-    let numTypes = bc[this.index++];
-    let unionTypes: string[] = [];
-    for (let i = 0; i < numTypes; i++) {
-      unionTypes.push(this.readString(bc));
+  // 读取对类型的引用。只能引用已经读过的类型
+  private readTypeRef(bc: number[]): Type {
+    let index = this.readVarint(bc);
+    if (index >= this.types.length) {
+      throw new Error('Forward reference to type ' + index + ' in bytecode file.');
     }
-
-    let t = new UnionType([], typeName);
-    this.types.set(typeName, t);
-    this.typeInfos.set(typeName, unionTypes);
+    return this.types[index];
   }
 
-  private addSystemTypes() {
-    this.types.set('any', SysTypes.Any);
-    this.types.set('number', SysTypes.Number);
-    this.types.set('string', SysTypes.String);
-    this.types.set('integer', SysTypes.Integer);
-    this.types.set('decimal', SysTypes.Decimal);
-    this.types.set('boolean', SysTypes.Boolean);
-    this.types.set('null', SysTypes.Null);
-    this.types.set('undefined', SysTypes.Undefined);
-    this.types.set('void', SysTypes.Void);
-  }
-
-  /**
-   * 生成类型，并建立类型之间正确的引用关系
-   */
-  private buildTypes() {
-    for (let typeName of this.typeInfos.keys()) {
-      let t = this.types.get(typeName) as Type;
-      if (Type.isSimpleType(t)) {
-        let simpleType = t as SimpleType;
-        let upperTypes = this.typeInfos.get(typeName) as string[];
-        for (let utName of upperTypes) {
-          let ut = this.types.get(utName) as Type;
-          simpleType.upperTypes.push(ut);
-        }
-      } else if (Type.isFunctionType(t)) {
-        let funtionType = t as FunctionType;
-        let returnType = this.typeInfos.get(typeName).returnType as string;
-        let paramTypes = this.typeInfos.get(typeName).paramTypes as string[];
-        funtionType.returnType = this.types.get(returnType) as Type;
-        for (let utName of paramTypes) {
-          let ut = this.types.get(utName) as Type;
-          funtionType.paramTypes.push(ut);
-        }
-      } else if (Type.isUnionType(t)) {
-        let unionType = t as UnionType;
-        let types = this.typeInfos.get(typeName) as string[];
-        for (let utName of types) {
-          let ut = this.types.get(utName) as Type;
-          unionType.types.push(ut);
-        }
-      } else {
-        console.log('Unsupported type in BCModuleReader.');
-        console.log(t);
-      }
+  // 读取一组类型的引用
+  private readTypes(bc: number[]): Type[] {
+    let types: Type[] = [];
+    let count = this.readVarint(bc);
+    for (let i = 0; i < count; i++) {
+      types.push(this.readTypeRef(bc));
     }
-
-    this.typeInfos.clear();
+    return types;
   }
 
   /**
@@ -1454,35 +2389,26 @@ export class BCModuleReader {
    * @param bc 字节码
    */
   private readFunctionSymbol(bc: number[]): FunctionSymbol {
-    // 函数名称
+    // 函数名称和类型
     let functionName = this.readString(bc);
-
-    // 读取类型名称
-    let typeName = this.readString(bc);
-    let functionType = this.types.get(typeName) as FunctionType;
+    let functionType = this.readTypeRef(bc) as FunctionType;
 
     // 操作数栈的大小
-    let opStackSize = bc[this.index++];
-
-    // 变量个数
-    let numVars = bc[this.index++];
+    let opStackSize = this.readVarint(bc);
 
     // 读取变量
+    let numVars = this.readVarint(bc);
     let vars: VarSymbol[] = [];
     for (let i: number = 0; i < numVars; i++) {
-      vars.push(this.readVarSymbol(bc));
+      let varName = this.readString(bc);
+      vars.push(new VarSymbol(varName, this.readTypeRef(bc)));
     }
 
     // 读取函数体的字节码
-    let numByteCodes = bc[this.index++];
-    let byteCodes: number[] | null;
-    if (numByteCodes == 0) {
-      // 系统函数
-      byteCodes = null;
-    } else {
-      byteCodes = bc.slice(this.index, this.index + numByteCodes);
-      this.index += numByteCodes;
-    }
+    let codeOffset = this.codeOffset + this.readVarint(bc);
+    let numByteCodes = this.readVarint(bc);
+    // 系统函数不写入字节码文件，这里都是自定义函数。函数体可能为空，执行到代码末尾时返回
+    let byteCodes = bc.slice(codeOffset, codeOffset + numByteCodes);
 
     // 创建函数符号
     let functionSym = new FunctionSymbol(functionName, functionType);
@@ -1493,18 +2419,42 @@ export class BCModuleReader {
     return functionSym;
   }
 
-  /**
-   * 从字节码中读取VarSymbol
-   * @param bc
-   */
-  private readVarSymbol(bc: number[]): VarSymbol {
-    // 变量名称
-    let varName = this.readString(bc);
+  private readString(bc: number[]): string {
+    return this.strings[this.readVarint(bc)];
+  }
 
-    // 类型名称
-    let typeName = this.readString(bc);
-    let varType = this.types.get(typeName) as Type;
+  private readVarint(bc: number[]): number {
+    let value = 0;
+    let shift = 0;
+    let b: number;
+    do {
+      b = bc[this.index++];
+      value |= (b & 0x7f) << shift;
+      shift += 7;
+    } while (b & 0x80);
+    return value >>> 0;
+  }
 
-    return new VarSymbol(varName, varType);
+  private readSignedVarint(bc: number[]): number {
+    let value = 0;
+    let shift = 0;
+    let b: number;
+    do {
+      b = bc[this.index++];
+      value |= (b & 0x7f) << shift;
+      shift += 7;
+    } while (b & 0x80);
+    if (shift < 32 && (b & 0x40) != 0) {
+      value |= -1 << shift;
+    }
+    return value;
+  }
+
+  private readUint32(bc: number[]): number {
+    let value = 0;
+    for (let i = 0; i < 4; i++) {
+      value |= bc[this.index++] << (i * 8);
+    }
+    return value >>> 0;
   }
 }
@@ -3,12 +3,290 @@
 
 #include "mem.h"
 #include "object.h"
+#include "output.h"
+
+//对象的标记位，保存在Object.flags中
+#define GC_MARKED 0x1
+
+//每个对象前面的头部，只在内存管理内部使用。所有对象链成一个双向链表，供清除阶段遍历。
+//小对象被释放之后，next字段用来把它链入所在尺寸类别的空闲链表。
+typedef struct _GCHeader{
+    struct _GCHeader* prev;
+    struct _GCHeader* next;
+    size_t size;            //申请的大小，不含头部
+}GCHeader;
+
+#define HEADER_OF(obj) ((GCHeader*)(obj) - 1)
+#define OBJECT_OF(header) ((Object*)((header) + 1))
+
+/////////////////////////////////////////////////////////
+//小对象的分配
+//不超过SMALL_OBJECT_MAX字节的对象按大小归入几个尺寸类别，每个类别从SLAB_SIZE大小的slab中
+//切出定长的块，释放的块放回这个类别的空闲链表，不必每次都调用malloc和free。
+//更大的对象直接用malloc申请。虚拟机是单线程的，空闲链表不需要加锁。
+
+#define SLAB_SIZE (64*1024)
+
+//slab的头部。所有slab链在一起，在gc_shutdown()时释放。
+typedef struct _Slab{
+    struct _Slab* next;
+}Slab;
+
+//尺寸类别，不含GCHeader
+static const size_t classSizes[NUM_SIZE_CLASSES] = {16, 32, 48, 64, 96, 128, 192, 256};
+
+//按(size+15)/16查找尺寸类别
+static const unsigned char classOfSize[SMALL_OBJECT_MAX/16 + 1] = {
+    0, 0, 1, 2, 3, 4, 4, 5, 5, 6, 6, 6, 6, 7, 7, 7, 7
+};
+
+#define SIZE_CLASS_OF(size) (classOfSize[((size) + 15) >> 4])
+
+typedef struct _SizeClass{
+    GCHeader* freeList;     //被释放的块
+    char* next;             //最新的slab中还没有切出去的部分
+    char* end;
+    size_t blockSize;       //每个块的大小，包括GCHeader
+}SizeClass;
+
+typedef struct _Heap{
+    GCHeader* objects;      //所有对象的链表
+    size_t bytesAllocated;  //当前所有对象的大小
+    size_t nextGC;          //超过这个大小就请求垃圾收集
+    size_t initialHeap;
+    int growFactor;
+    size_t maxHeap;
+    RootScanner scanner;
+    SizeClass classes[NUM_SIZE_CLASSES];
+    Slab* slabs;
+    MemStats stats[NUM_SIZE_CLASSES + 1];  //最后一项是大对象
+}Heap;
+
+static Heap heap = {.nextGC = 1024*1024, .initialHeap = 1024*1024, .growFactor = 2, .maxHeap = (size_t)-1};
+
+int gc_requested = 0;
+
+void gc_init(size_t initialHeap, int growFactor, size_t maxHeap, RootScanner scanner){
+    heap.initialHeap = initialHeap;
+    heap.nextGC = initialHeap;
+    heap.growFactor = growFactor;
+    heap.maxHeap = maxHeap;
+    heap.scanner = scanner;
+}
+
+//从尺寸类别中取一个块，空闲链表为空时从slab中切
+static GCHeader* allocSmall(int sizeClass){
+    SizeClass* sc = &heap.classes[sizeClass];
+    GCHeader* header = sc->freeList;
+    if (header != NULL){
+        sc->freeList = header->next;
+        return header;
+    }
+
+    if (sc->blockSize == 0){
+        sc->blockSize = sizeof(GCHeader) + classSizes[sizeClass];
+    }
+    if ((size_t)(sc->end - sc->next) < sc->blockSize){
+        Slab* slab = (Slab*)malloc(SLAB_SIZE);
+        if (slab == NULL){
+            return NULL;
+        }
+        slab->next = heap.slabs;
+        heap.slabs = slab;
+        //剩下的零头不足一个块，算作碎片
+        sc->next = (char*)(slab + 1);
+        sc->end = (char*)slab + SLAB_SIZE;
+        heap.stats[sizeClass].slabBytes += SLAB_SIZE;
+    }
+    header = (GCHeader*)sc->next;
+    sc->next += sc->blockSize;
+    return header;
+}
 
-//玩具版本。之后要改成自己的内存管理
 Object * PlayAlloc(size_t size){
-    return (void*)malloc(size); 
+    GCHeader* header;
+    int sizeClass;
+    if (size <= SMALL_OBJECT_MAX){
+        sizeClass = SIZE_CLASS_OF(size);
+        header = allocSmall(sizeClass);
+    }
+    else{
+        sizeClass = NUM_SIZE_CLASSES;
+        header = (GCHeader*)malloc(sizeof(GCHeader) + size);
+    }
+    if (header == NULL){
+        output_flush();
+        fprintf(stderr, "Out of memory.\n");
+        exit(EXIT_OUT_OF_MEMORY);
+    }
+    header->size = size;
+    header->prev = NULL;
+    header->next = heap.objects;
+    if (heap.objects != NULL){
+        heap.objects->prev = header;
+    }
+    heap.objects = header;
+
+    heap.stats[sizeClass].allocs++;
+    heap.stats[sizeClass].bytesInUse += size;
+    heap.stats[sizeClass].blocksInUse++;
+
+    heap.bytesAllocated += size;
+    if (heap.bytesAllocated > heap.nextGC && heap.scanner != NULL){
+        gc_requested = 1;
+    }
+
+    Object* obj = OBJECT_OF(header);
+    obj->flags = 0;
+    return obj;
 }
 
 void PlayFree(Object* obj){
-    free(obj);
-}
\ No newline at end of file
+    GCHeader* header = HEADER_OF(obj);
+    if (header->prev != NULL){
+        header->prev->next = header->next;
+    }
+    else{
+        heap.objects = header->next;
+    }
+    if (header->next != NULL){
+        header->next->prev = header->prev;
+    }
+    heap.bytesAllocated -= header->size;
+
+    int sizeClass = header->size <= SMALL_OBJECT_MAX ? SIZE_CLASS_OF(header->size) : NUM_SIZE_CLASSES;
+    heap.stats[sizeClass].frees++;
+    heap.stats[sizeClass].bytesInUse -= header->size;
+    heap.stats[sizeClass].blocksInUse--;
+
+    if (sizeClass < NUM_SIZE_CLASSES){
+        SizeClass* sc = &heap.classes[sizeClass];
+        header->next = sc->freeList;
+        sc->freeList = header;
+    }
+    else{
+        free(header);
+    }
+}
+
+void mem_get_stats(int sizeClass, MemStats* stats){
+    *stats = heap.stats[sizeClass];
+}
+
+void mem_dump_stats(FILE* out){
+    fprintf(out, "%10s %10s %10s %10s %10s %10s %8s\n",
+            "class", "allocs", "frees", "live", "bytes", "slabBytes", "frag%");
+    for (int i = 0; i <= NUM_SIZE_CLASSES; i++){
+        MemStats* st = &heap.stats[i];
+        if (st->allocs == 0){
+            continue;
+        }
+        if (i < NUM_SIZE_CLASSES){
+            //碎片：slab中没有被存活对象使用的部分，包括空闲的块、块内多出来的空间和头部
+            double frag = st->slabBytes == 0 ? 0 : 100.0 * (st->slabBytes - st->bytesInUse) / st->slabBytes;
+            fprintf(out, "%10zu %10zu %10zu %10zu %10zu %10zu %8.1f\n", classSizes[i],
+                    st->allocs, st->frees, st->blocksInUse, st->bytesInUse, st->slabBytes, frag);
+        }
+        else{
+            fprintf(out, "%10s %10zu %10zu %10zu %10zu %10s %8s\n", "large",
+                    st->allocs, st->frees, st->blocksInUse, st->bytesInUse, "-", "-");
+        }
+    }
+}
+
+//标记栈：已经标记、但还没有扫描它引用的对象的那些对象。
+//绳索可能很深，所以用显式的栈，而不是递归。
+static Object** markStack = NULL;
+static size_t markTop = 0;
+static size_t markCapacity = 0;
+
+//标记一个对象，并把它放入标记栈
+static void markObject(Object* obj){
+    if (obj == NULL || (obj->flags & GC_MARKED)){
+        return;
+    }
+    obj->flags |= GC_MARKED;
+    if (markTop == markCapacity){
+        markCapacity = markCapacity == 0 ? 256 : markCapacity * 2;
+        markStack = (Object**)realloc(markStack, markCapacity * sizeof(Object*));
+        if (markStack == NULL){
+            output_flush();
+            fprintf(stderr, "Out of memory.\n");
+            exit(EXIT_OUT_OF_MEMORY);
+        }
+    }
+    markStack[markTop++] = obj;
+}
+
+//标记标记栈中的对象引用的对象，直到栈空。以后增加的对象种类在这里标记它们引用的对象。
+static void traceReferences(){
+    while (markTop > 0){
+        Object* obj = markStack[--markTop];
+        if (obj->kind == StringObj){
+            PlayString* str = (PlayString*)obj;
+            markObject((Object*)str->left);
+            markObject((Object*)str->right);
+        }
+    }
+}
+
+void gc_mark_value(Value v){
+    if (IS_OBJECT(v)){
+        markObject(AS_OBJECT(v));
+    }
+}
+
+//清除所有没有被标记的对象，并清掉存活对象的标记
+static void sweep(){
+    GCHeader* header = heap.objects;
+    while (header != NULL){
+        GCHeader* next = header->next;
+        Object* obj = OBJECT_OF(header);
+        if (obj->flags & GC_MARKED){
+            obj->flags &= ~GC_MARKED;
+        }
+        else{
+            PlayFree(obj);
+        }
+        header = next;
+    }
+}
+
+void gc_collect(){
+    gc_requested = 0;
+    if (heap.scanner == NULL){
+        return;
+    }
+
+    heap.scanner();
+    traceReferences();
+    sweep();
+
+    if (heap.bytesAllocated > heap.maxHeap){
+        output_flush();
+        fprintf(stderr, "Out of memory: %zu bytes in use after garbage collection.\n", heap.bytesAllocated);
+        exit(EXIT_OUT_OF_MEMORY);
+    }
+    heap.nextGC = heap.bytesAllocated * heap.growFactor;
+    if (heap.nextGC < heap.initialHeap){
+        heap.nextGC = heap.initialHeap;
+    }
+}
+
+void gc_shutdown(){
+    while (heap.objects != NULL){
+        PlayFree(OBJECT_OF(heap.objects));
+    }
+    free(markStack);
+    markStack = NULL;
+    markTop = markCapacity = 0;
+    while (heap.slabs != NULL){
+        Slab* next = heap.slabs->next;
+        free(heap.slabs);
+        heap.slabs = next;
+    }
+    for (int i = 0; i < NUM_SIZE_CLASSES; i++){
+        heap.classes[i].freeList = NULL;
+        heap.classes[i].next = heap.classes[i].end = NULL;
+    }
+}
@@ -1,5 +1,10 @@
 /**
  * 与内存管理有关的功能
+ * 堆中的对象由标记-清除（mark-sweep）垃圾收集器管理。
+ * 申请内存时只是累计堆的大小，超过阈值就设置gc_requested；虚拟机在安全点（函数调用、向后跳转）
+ * 检查这个标志，先把栈顶写回栈桢，再调用gc_collect()。这样收集时所有活着的值都在栈桢里，
+ * 根集合是精确的，运行时库的函数在执行过程中也不会有对象被回收。
+ * 小对象从按尺寸分类的slab中分配，大对象直接用malloc申请。
  * */
 
 #ifndef MEM_H
@@ -7,11 +12,55 @@
 
 #include <stdio.h>
 #include "object.h"
+#include "value.h"
 
 //申请相应大小的内存
 Object * PlayAlloc(size_t size);
 
-//释放内存
+//释放内存。用于确定不再被引用的对象，比如转换过程中临时创建的字符串
 void PlayFree(Object* obj);
 
+//不超过SMALL_OBJECT_MAX字节的对象从slab中分配，分成NUM_SIZE_CLASSES个尺寸类别
+#define SMALL_OBJECT_MAX 256
+#define NUM_SIZE_CLASSES 8
+
+//内存分配的统计，每个尺寸类别一份，大对象另算一份
+typedef struct _MemStats{
+    size_t allocs;        //申请的次数
+    size_t frees;         //释放的次数
+    size_t blocksInUse;   //存活的对象个数
+    size_t bytesInUse;    //存活的对象申请的字节数
+    size_t slabBytes;     //这个类别占用的slab的总大小，大对象为0
+}MemStats;
+
+//取得一个尺寸类别的统计，sizeClass为NUM_SIZE_CLASSES时是大对象
+void mem_get_stats(int sizeClass, MemStats* stats);
+
+//打印所有尺寸类别的统计
+void mem_dump_stats(FILE* out);
+
+//内存不足时进程的退出码，和vm.h中的其他EXIT_*不重复
+#define EXIT_OUT_OF_MEMORY 71
+
+//扫描根集合的函数，由虚拟机提供。它对每个根调用gc_mark_value()
+typedef void (*RootScanner)(void);
+
+//初始化垃圾收集器
+//initialHeap：堆的大小超过这个值时进行第一次收集；
+//growFactor：每次收集之后，下一次收集的阈值是存活对象大小的growFactor倍，但不小于initialHeap；
+//maxHeap：收集之后存活的对象仍然超过这个值，就报告内存不足并退出。
+void gc_init(size_t initialHeap, int growFactor, size_t maxHeap, RootScanner scanner);
+
+//标记一个根
+void gc_mark_value(Value v);
+
+//进行一次垃圾收集
+void gc_collect();
+
+//释放堆中所有的对象
+void gc_shutdown();
+
+//是否需要在下一个安全点进行垃圾收集
+extern int gc_requested;
+
 #endif
@@ -3,7 +3,15 @@
 
 #include "string.h"
 
-PlayString* integer_to_string();
-PlayString* decimal_to_string();
+//格式化数值所需的缓冲区大小，够放下任何integer或decimal，包括末尾的0
+#define NUMBER_BUFFER_SIZE 32
 
-#endif
\ No newline at end of file
+//把数值格式化成字符串，写入buf，返回长度（不含末尾的0）
+//decimal使用能精确还原的最短形式，排版与JavaScript的Number.prototype.toString一致
+int number_format_integer(int num, char* buf);
+int number_format_decimal(double num, char* buf);
+
+PlayString* integer_to_string(int num);
+PlayString* decimal_to_string(double num);
+
+#endif
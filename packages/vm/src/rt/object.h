@@ -1,13 +1,19 @@
 /**
  * 对象的内存布局
- * 
+ *
  * */
 
 #ifndef OBJECT_H
 #define OBJECT_H
 
+//对象的种类
+typedef enum _ObjectKind{
+    StringObj,
+}ObjectKind;
+
 typedef struct _Object{
     unsigned int flags;   //与并发、垃圾收集有关的标志位
+    unsigned int kind;    //对象的种类，见ObjectKind
 }Object;
 
 #endif
\ No newline at end of file
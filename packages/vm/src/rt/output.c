@@ -0,0 +1,60 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "output.h"
+
+static char buffer[OUTPUT_BUFFER_SIZE];
+static size_t used = 0;
+static int interactiveMode = 0;
+
+void output_init(int interactive){
+    static int registered = 0;
+    interactiveMode = interactive;
+    if (!registered){
+        atexit(output_flush);
+        registered = 1;
+    }
+}
+
+char* output_reserve(size_t n){
+    if (used + n > OUTPUT_BUFFER_SIZE){
+        output_flush();
+    }
+    return buffer + used;
+}
+
+void output_commit(size_t n){
+    used += n;
+}
+
+void output_write(const char* data, size_t length){
+    if (used + length > OUTPUT_BUFFER_SIZE){
+        output_flush();
+        //比缓冲区还大的数据直接写出
+        if (length > OUTPUT_BUFFER_SIZE){
+            fwrite(data, 1, length, stdout);
+            return;
+        }
+    }
+    memcpy(buffer + used, data, length);
+    used += length;
+}
+
+void output_newline(){
+    if (used == OUTPUT_BUFFER_SIZE){
+        output_flush();
+    }
+    buffer[used++] = '\n';
+    if (interactiveMode){
+        output_flush();
+    }
+}
+
+void output_flush(){
+    if (used > 0){
+        fwrite(buffer, 1, used, stdout);
+        used = 0;
+    }
+    fflush(stdout);
+}
@@ -0,0 +1,33 @@
+/**
+ * 程序的输出
+ * println等内置函数不直接调用printf，而是把格式化好的内容写入一个大的输出缓冲区，
+ * 在缓冲区满了、程序退出、或者虚拟机自己要向stdout打印信息之前，才一次性写到stdout。
+ * 这样每一行输出都不需要解析格式串、也不需要给stdio加锁，系统调用也少得多。
+ * 交互模式下每输出一行就写出一次，以便及时看到输出。
+ * */
+
+#ifndef OUTPUT_H
+#define OUTPUT_H
+
+#include <stddef.h>
+
+//输出缓冲区的大小
+#define OUTPUT_BUFFER_SIZE (64*1024)
+
+//初始化输出。interactive为1时每一行都立即写出。程序退出时会自动写出缓冲区中剩下的内容
+void output_init(int interactive);
+
+//预留至少n个字节（n不超过OUTPUT_BUFFER_SIZE），返回写入的位置。写完之后用output_commit()确认实际写入的字节数
+char* output_reserve(size_t n);
+void output_commit(size_t n);
+
+//写入一段数据
+void output_write(const char* data, size_t length);
+
+//结束一行。交互模式下这时写出
+void output_newline();
+
+//把缓冲区中的内容写到stdout。虚拟机向stdout打印自己的信息之前要先调用它，以免顺序错乱
+void output_flush();
+
+#endif
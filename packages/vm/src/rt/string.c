@@ -1,15 +1,21 @@
 
 #include "string.h"
 #include "mem.h"
+#include <stdlib.h>
 
 PlayString* string_create_by_length(size_t length){
-    //申请内存
-    size_t size = sizeof(Object) + sizeof(size_t) + sizeof(unsigned char)*(length+1);
+    //申请内存：字符数据紧跟在PlayString结构体的后面
+    size_t size = sizeof(PlayString) + sizeof(unsigned char)*(length+1);
     PlayString * pstr =  (PlayString*)PlayAlloc(size);
+    pstr->object.flags = 0;
+    pstr->object.kind = StringObj;
     //设置字符串长度
     pstr->length = length;
     //设置数据指针
-    pstr->data = (char*)(pstr + sizeof(Object) + sizeof(size_t));
+    pstr->data = (char*)(pstr + 1);
+    pstr->left = NULL;
+    pstr->right = NULL;
+    pstr->hash = 0;
 
     return pstr;
 }
@@ -33,17 +39,161 @@ int string_length(PlayString * str){
 }
 
 PlayString* string_concat(PlayString* str1, PlayString* str2){
-    size_t str_length1 = strlen(str1->data);
-    size_t str_length2 = strlen(str2->data);
-    size_t size = sizeof(Object) + sizeof(size_t) + sizeof(unsigned char)*(str_length1+str_length2+1);
+    size_t str_length1 = str1->length;
+    size_t str_length2 = str2->length;
+
+    //较长的结果只创建一个绳索节点，等到需要时再展平
+    if (str_length1 + str_length2 >= ROPE_MIN_LENGTH){
+        PlayString* rope = (PlayString*)PlayAlloc(sizeof(PlayString));
+        rope->object.flags = 0;
+        rope->object.kind = StringObj;
+        rope->length = str_length1 + str_length2;
+        rope->data = NULL;
+        rope->left = str1;
+        rope->right = str2;
+        rope->hash = 0;
+        return rope;
+    }
+
     //申请内存
-    PlayString * pstr = (PlayString*)PlayAlloc(size);
-    //设置字符串长度
-    pstr->length = str_length1 + str_length2;
-    //设置数据指针
-    pstr->data = (char*)(pstr + sizeof(Object) + sizeof(size_t));
-    //拷贝数据
-    strcpy(pstr->data, str1->data);
-    strcpy(pstr->data+str_length1, str2->data);
+    PlayString * pstr = string_create_by_length(str_length1 + str_length2);
+    //拷贝数据，包括str2末尾的0
+    memcpy(pstr->data, string_data(str1), str_length1);
+    memcpy(pstr->data+str_length1, string_data(str2), str_length2+1);
     return pstr;
-}
\ No newline at end of file
+}
+
+const char* string_data(PlayString* str){
+    if (str->data != NULL){
+        return str->data;
+    }
+
+    //展平：从左到右拷贝所有平坦的叶子。绳索可能很深，所以用一个显式的栈，而不是递归。
+    PlayString* flat = string_create_by_length(str->length);
+    size_t capacity = 16;
+    size_t top = 0;
+    PlayString** stack = (PlayString**)malloc(capacity * sizeof(PlayString*));
+    stack[top++] = str;
+    char* dest = flat->data;
+    while (top > 0){
+        PlayString* node = stack[--top];
+        if (node->data != NULL){
+            memcpy(dest, node->data, node->length);
+            dest += node->length;
+            continue;
+        }
+        if (top + 2 > capacity){
+            capacity *= 2;
+            stack = (PlayString**)realloc(stack, capacity * sizeof(PlayString*));
+        }
+        stack[top++] = node->right;
+        stack[top++] = node->left;
+    }
+    free(stack);
+    *dest = 0;
+
+    str->data = flat->data;
+    str->left = flat;
+    str->right = NULL;
+    return str->data;
+}
+
+/////////////////////////////////////////////////////////
+//哈希和驻留
+
+static unsigned int hashBytes(const char* data, size_t length){
+    unsigned int hash = 2166136261u;
+    for (size_t i = 0; i < length; i++){
+        hash ^= (unsigned char)data[i];
+        hash *= 16777619u;
+    }
+    //0表示还没有计算
+    return hash == 0 ? 1 : hash;
+}
+
+unsigned int string_hash(PlayString* str){
+    if (str->hash == 0){
+        str->hash = hashBytes(string_data(str), str->length);
+    }
+    return str->hash;
+}
+
+int string_equals(PlayString* str1, PlayString* str2){
+    if (str1 == str2){
+        return 1;
+    }
+    if ((str1->object.flags & str2->object.flags & STRING_INTERNED) || str1->length != str2->length){
+        return 0;
+    }
+    if (str1->hash != 0 && str2->hash != 0 && str1->hash != str2->hash){
+        return 0;
+    }
+    return memcmp(string_data(str1), string_data(str2), str1->length) == 0;
+}
+
+//驻留表：开放定址、线性探测的哈希表，容量是2的幂，装载因子不超过3/4
+typedef struct _InternTable{
+    PlayString** entries;
+    size_t capacity;
+    size_t count;
+}InternTable;
+
+static InternTable internTable = {NULL, 0, 0};
+
+static void growInternTable(){
+    size_t capacity = internTable.capacity == 0 ? 64 : internTable.capacity * 2;
+    PlayString** entries = (PlayString**)calloc(capacity, sizeof(PlayString*));
+    for (size_t i = 0; i < internTable.capacity; i++){
+        PlayString* str = internTable.entries[i];
+        if (str != NULL){
+            size_t j = str->hash & (capacity - 1);
+            while (entries[j] != NULL){
+                j = (j + 1) & (capacity - 1);
+            }
+            entries[j] = str;
+        }
+    }
+    free(internTable.entries);
+    internTable.entries = entries;
+    internTable.capacity = capacity;
+}
+
+PlayString* string_intern(const char* str, size_t length){
+    if ((internTable.count + 1) * 4 > internTable.capacity * 3){
+        growInternTable();
+    }
+
+    unsigned int hash = hashBytes(str, length);
+    size_t i = hash & (internTable.capacity - 1);
+    PlayString* entry;
+    while ((entry = internTable.entries[i]) != NULL){
+        if (entry->hash == hash && entry->length == length && memcmp(entry->data, str, length) == 0){
+            return entry;
+        }
+        i = (i + 1) & (internTable.capacity - 1);
+    }
+
+    PlayString* pstr = string_create_by_length(length);
+    memcpy(pstr->data, str, length);
+    pstr->data[length] = 0;
+    pstr->hash = hash;
+    pstr->object.flags |= STRING_INTERNED;
+    internTable.entries[i] = pstr;
+    internTable.count++;
+    return pstr;
+}
+
+void string_mark_interned(){
+    for (size_t i = 0; i < internTable.capacity; i++){
+        if (internTable.entries[i] != NULL){
+            gc_mark_value(OBJECT_VALUE(internTable.entries[i]));
+        }
+    }
+}
+
+void string_intern_clear(){
+    free(internTable.entries);
+    internTable.entries = NULL;
+    internTable.capacity = 0;
+    internTable.count = 0;
+}
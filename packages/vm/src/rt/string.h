@@ -4,14 +4,30 @@
 #include "object.h"
 #include <string.h>
 
+/**
+ * 字符串
+ * 一个字符串要么是平坦的：字符数据连续存放，data指向它们；
+ * 要么是一个绳索（rope）节点：它是left和right连接起来的结果，data为NULL，在需要连续的字符时才展平。
+ * 这样用+反复连接字符串时，每次只需要创建一个节点，而不必拷贝已有的字符。
+ * 展平之后，data指向一个新的平坦字符串的数据，left指向这个字符串（以免它被回收），right为NULL。
+ * */
 typedef struct _PlayString{
     Object object;
     size_t length;       //字符串的长度。
     //以0结尾的字符串，以便复用C语言的一些功能。实际占用内存是length+1。
-    //我们不需要保存这个指针，只需要在PlayString的基础上增加一个偏移量就行。
+    //平坦字符串的数据紧跟在PlayString的后面；绳索节点在展平之前为NULL。
     char* data;     
+    struct _PlayString* left;    //绳索节点的左右两部分，平坦字符串为NULL
+    struct _PlayString* right;
+    unsigned int hash;           //哈希值，0表示还没有计算
 }PlayString;
 
+//Object.flags中的标志位：字符串已经驻留。（0x1是垃圾收集的标记位）
+#define STRING_INTERNED 0x2
+
+//连接结果的长度达到这个值才创建绳索节点，更短的字符串直接拷贝
+#define ROPE_MIN_LENGTH 64
+
 PlayString* string_create_by_length(size_t length);
 
 PlayString* string_create_by_str(const char* str);
@@ -22,5 +38,23 @@ int string_length(PlayString * str);
 
 PlayString* string_concat(PlayString* str1, PlayString* str2);
 
-#endif
+//取得以0结尾的连续的字符数据。绳索节点在这时被展平
+const char* string_data(PlayString* str);
+
+//字符串的哈希值（FNV-1a），第一次计算之后保存在字符串中
+unsigned int string_hash(PlayString* str);
+
+//两个字符串的内容是否相同。同一个对象、或者都是驻留的字符串时，只比较指针
+int string_equals(PlayString* str1, PlayString* str2);
 
+//驻留：内容相同的字符串只有一个对象。返回驻留表中的字符串，没有的话就创建一个并加入驻留表。
+//驻留的字符串一直存活，直到调用string_intern_clear()。
+PlayString* string_intern(const char* str, size_t length);
+
+//标记驻留表中的字符串，在垃圾收集扫描根的时候调用
+void string_mark_interned();
+
+//清空驻留表。其中的字符串留给垃圾收集器释放
+void string_intern_clear();
+
+#endif
@@ -1,12 +1,45 @@
 #include <stdio.h>
 #include <time.h> 
 
-//打印一个整数
-void println(int n){
-    printf("%d\n",n);
+#include "sysfuncs.h"
+#include "number.h"
+#include "output.h"
+
+//打印一个值。数值直接格式化到输出缓冲区里，不经过printf解析格式串
+int native_println(int argc, Value* args, Value* result){
+    (void)argc;
+    (void)result;  //没有返回值
+    Value v = args[0];
+    if (IS_INT(v)){
+        char* p = output_reserve(NUMBER_BUFFER_SIZE);
+        output_commit(number_format_integer(AS_INT(v), p));
+    }
+    else if (IS_DECIMAL(v)){
+        char* p = output_reserve(NUMBER_BUFFER_SIZE);
+        output_commit(number_format_decimal(AS_DECIMAL(v), p));
+    }
+    else{
+        PlayString* str = value_to_string(v);
+        output_write(string_data(str), str->length);
+        if (!IS_STRING(v)){
+            string_destroy(str);
+        }
+    }
+    output_newline();
+    return 0;
 }
 
 //获得时钟时间
-int tick(){
-    return clock();
+int native_tick(int argc, Value* args, Value* result){
+    (void)argc;
+    (void)args;
+    *result = INT_VALUE(clock());
+    return 1;
+}
+
+//把数值转换成字符串
+int native_integer_to_string(int argc, Value* args, Value* result){
+    (void)argc;
+    *result = OBJECT_VALUE(value_to_string(args[0]));
+    return 1;
 }
@@ -0,0 +1,17 @@
+/**
+ * 系统内置函数的C语言实现
+ * 它们都遵循NativeFunction的调用约定，在加载模块时绑定到相应的FunctionSymbol上。
+ * */
+
+#ifndef SYSFUNCS_H
+#define SYSFUNCS_H
+
+#include "../vm/playvm.h"
+
+int native_println(int argc, Value* args, Value* result);
+
+int native_tick(int argc, Value* args, Value* result);
+
+int native_integer_to_string(int argc, Value* args, Value* result);
+
+#endif
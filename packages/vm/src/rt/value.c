@@ -0,0 +1,178 @@
+
+#include <stdlib.h>
+#include <stdio.h>
+
+#include "value.h"
+#include "number.h"
+
+double value_to_number(Value v){
+    if (IS_INT(v)){
+        return AS_INT(v);
+    }
+    else if (IS_DECIMAL(v)){
+        return AS_DECIMAL(v);
+    }
+    else if (IS_BOOLEAN(v)){
+        return AS_BOOLEAN(v);
+    }
+    else if (IS_NULL(v)){
+        return 0;
+    }
+    return AS_DECIMAL(CANONICAL_NAN);
+}
+
+PlayString* value_to_string(Value v){
+    if (IS_INT(v)){
+        return integer_to_string(AS_INT(v));
+    }
+    else if (IS_DECIMAL(v)){
+        return decimal_to_string(AS_DECIMAL(v));
+    }
+    else if (IS_BOOLEAN(v)){
+        return string_create_by_str(AS_BOOLEAN(v) ? "true" : "false");
+    }
+    else if (IS_STRING(v)){
+        return AS_STRING(v);
+    }
+    else if (IS_NULL(v)){
+        return string_create_by_str("null");
+    }
+    return string_create_by_str("[object]");
+}
+
+Value value_concat(Value a, Value b){
+    PlayString* str1 = value_to_string(a);
+    PlayString* str2 = value_to_string(b);
+    PlayString* pstr = string_concat(str1, str2);
+    //转换时临时创建的字符串。如果结果是绳索节点，它们成了结果的一部分，交给垃圾收集器
+    if (pstr->data != NULL){
+        if (!IS_STRING(a)){
+            string_destroy(str1);
+        }
+        if (!IS_STRING(b)){
+            string_destroy(str2);
+        }
+    }
+    return OBJECT_VALUE(pstr);
+}
+
+Value value_add(Value a, Value b){
+    if (BOTH_INT(a, b)){
+        return INT_VALUE((uint32_t)a + (uint32_t)b);
+    }
+    if (IS_STRING(a) || IS_STRING(b)){
+        return value_concat(a, b);
+    }
+    return DECIMAL_VALUE(value_to_number(a) + value_to_number(b));
+}
+
+Value value_sub(Value a, Value b){
+    if (BOTH_INT(a, b)){
+        return INT_VALUE((uint32_t)a - (uint32_t)b);
+    }
+    return DECIMAL_VALUE(value_to_number(a) - value_to_number(b));
+}
+
+Value value_mul(Value a, Value b){
+    if (BOTH_INT(a, b)){
+        return INT_VALUE((uint32_t)a * (uint32_t)b);
+    }
+    return DECIMAL_VALUE(value_to_number(a) * value_to_number(b));
+}
+
+Value value_div(Value a, Value b){
+    if (BOTH_INT(a, b)){
+        return INT_VALUE(AS_INT(a) / AS_INT(b));
+    }
+    return DECIMAL_VALUE(value_to_number(a) / value_to_number(b));
+}
+
+Value value_dadd(Value a, Value b){
+    return DECIMAL_VALUE(value_to_number(a) + value_to_number(b));
+}
+
+Value value_dsub(Value a, Value b){
+    return DECIMAL_VALUE(value_to_number(a) - value_to_number(b));
+}
+
+Value value_dmul(Value a, Value b){
+    return DECIMAL_VALUE(value_to_number(a) * value_to_number(b));
+}
+
+Value value_ddiv(Value a, Value b){
+    return DECIMAL_VALUE(value_to_number(a) / value_to_number(b));
+}
+
+Value value_dcmp(Value a, Value b, int nanResult){
+    return INT_VALUE(decimal_compare(value_to_number(a), value_to_number(b), nanResult));
+}
+
+Value value_i2d(Value v){
+    return DECIMAL_VALUE(value_to_number(v));
+}
+
+Value value_d2i(Value v){
+    return INT_VALUE(decimal_to_int(value_to_number(v)));
+}
+
+Value value_lcmp(Value a, Value b){
+    if (value_compare(CMP_LT, a, b)){
+        return INT_VALUE(-1);
+    }
+    return INT_VALUE(value_compare(CMP_GT, a, b) ? 1 : 0);
+}
+
+int value_compare(CompareOp op, Value a, Value b){
+    //字符串按字典序比较，其他的值按数值比较。相等比较不需要字典序，驻留的字符串只比较指针
+    if (IS_STRING(a) && IS_STRING(b)){
+        if (op == CMP_EQ || op == CMP_NE){
+            return string_equals(AS_STRING(a), AS_STRING(b)) == (op == CMP_EQ);
+        }
+        int c = strcmp(string_data(AS_STRING(a)), string_data(AS_STRING(b)));
+        switch(op){
+            case CMP_EQ: return c == 0;
+            case CMP_NE: return c != 0;
+            case CMP_LT: return c < 0;
+            case CMP_GE: return c >= 0;
+            case CMP_GT: return c > 0;
+            case CMP_LE: return c <= 0;
+        }
+    }
+    else if (IS_OBJECT(a) || IS_OBJECT(b) || IS_NULL(a) || IS_NULL(b)){
+        //对象和null只比较是否相同
+        switch(op){
+            case CMP_EQ: return a == b;
+            case CMP_NE: return a != b;
+            default: return 0;
+        }
+    }
+
+    double x = value_to_number(a);
+    double y = value_to_number(b);
+    switch(op){
+        case CMP_EQ: return x == y;
+        case CMP_NE: return x != y;
+        case CMP_LT: return x < y;
+        case CMP_GE: return x >= y;
+        case CMP_GT: return x > y;
+        case CMP_LE: return x <= y;
+    }
+    return 0;
+}
+
+int value_is_true(Value v){
+    if (IS_INT(v)){
+        return AS_INT(v) != 0;
+    }
+    else if (IS_DECIMAL(v)){
+        double d = AS_DECIMAL(v);
+        return d == d && d != 0;
+    }
+    else if (IS_BOOLEAN(v)){
+        return AS_BOOLEAN(v);
+    }
+    else if (IS_STRING(v)){
+        return AS_STRING(v)->length > 0;
+    }
+    return !IS_NULL(v);
+}
@@ -0,0 +1,132 @@
+/**
+ * 值的表示
+ * 操作数栈和本地变量中的每个值都是一个64位的字，采用NaN-boxing：
+ * decimal就是IEEE 754的double本身；其他类型的值放在double的NaN空间中，用高16位做标签：
+ *   0xFFF9  integer，低32位是值
+ *   0xFFFA  boolean，最低位是值
+ *   0xFFFB  null
+ *   0xFFFC  对象的引用，低48位是指针
+ * 正常的double都小于0xFFF9000000000000，NaN被规范成0x7FF8000000000000，所以不会与这些标签冲突。
+ * 整数、布尔值和null都不需要另外申请内存。
+ * */
+
+#ifndef VALUE_H
+#define VALUE_H
+
+#include <stdint.h>
+#include <string.h>
+
+#include "object.h"
+#include "string.h"
+
+typedef uint64_t Value;
+
+#define TAG_MASK      0xFFFF000000000000ull
+#define TAG_INTEGER   0xFFF9000000000000ull
+#define TAG_BOOLEAN   0xFFFA000000000000ull
+#define TAG_NULL      0xFFFB000000000000ull
+#define TAG_OBJECT    0xFFFC000000000000ull
+#define CANONICAL_NAN 0x7FF8000000000000ull
+
+//integer
+#define INT_VALUE(i) ((Value)(uint32_t)(i) | TAG_INTEGER)
+#define AS_INT(v) ((int32_t)(uint32_t)(v))
+#define IS_INT(v) (((v) & TAG_MASK) == TAG_INTEGER)
+
+//两个值是否都是integer，只需要一次比较。整数的第32到47位总是0。
+#define BOTH_INT(a, b) (((((a) ^ TAG_INTEGER) | ((b) ^ TAG_INTEGER)) >> 32) == 0)
+
+//boolean和null
+#define BOOLEAN_VALUE(b) (TAG_BOOLEAN | ((b) ? 1 : 0))
+#define AS_BOOLEAN(v) ((int)((v) & 1))
+#define IS_BOOLEAN(v) (((v) & TAG_MASK) == TAG_BOOLEAN)
+#define NULL_VALUE TAG_NULL
+#define IS_NULL(v) ((v) == TAG_NULL)
+
+//对象的引用
+#define OBJECT_VALUE(p) (TAG_OBJECT | (Value)(uintptr_t)(p))
+#define AS_OBJECT(v) ((Object*)(uintptr_t)((v) & ~TAG_MASK))
+#define IS_OBJECT(v) (((v) & TAG_MASK) == TAG_OBJECT)
+#define IS_STRING(v) (IS_OBJECT(v) && AS_OBJECT(v)->kind == StringObj)
+#define AS_STRING(v) ((PlayString*)AS_OBJECT(v))
+
+//decimal
+#define IS_DECIMAL(v) ((v) < TAG_INTEGER)
+#define DECIMAL_VALUE(d) value_from_double(d)
+#define AS_DECIMAL(v) value_to_double(v)
+
+//两个值是否都是decimal
+#define BOTH_DECIMAL(a, b) ((a) < TAG_INTEGER && (b) < TAG_INTEGER)
+
+static inline Value value_from_double(double d){
+    Value v;
+    if (d != d){  //NaN
+        return CANONICAL_NAN;
+    }
+    memcpy(&v, &d, sizeof(v));
+    return v;
+}
+
+static inline double value_to_double(Value v){
+    double d;
+    memcpy(&d, &v, sizeof(d));
+    return d;
+}
+
+//比较两个decimal：a<b为-1，a==b为0，a>b为1；有NaN时为nanResult（dcmpl是-1，dcmpg是1）
+static inline int decimal_compare(double a, double b, int nanResult){
+    return a < b ? -1 : a > b ? 1 : a == b ? 0 : nanResult;
+}
+
+//decimal转integer：向0截断，超出范围时取最大或最小的integer，NaN为0
+static inline int32_t decimal_to_int(double d){
+    if (d != d){
+        return 0;
+    }
+    if (d >= 2147483647.0){
+        return INT32_MAX;
+    }
+    if (d <= -2147483648.0){
+        return INT32_MIN;
+    }
+    return (int32_t)d;
+}
+
+//比较运算的种类
+typedef enum _CompareOp{CMP_EQ, CMP_NE, CMP_LT, CMP_GE, CMP_GT, CMP_LE} CompareOp;
+
+//以下是慢速路径：操作数不都是integer时，由虚拟机调用。
+//有字符串参与的加法是字符串连接；其他的都转换成decimal计算。
+Value value_add(Value a, Value b);
+Value value_sub(Value a, Value b);
+Value value_mul(Value a, Value b);
+Value value_div(Value a, Value b);
+
+//decimal指令的慢速路径：操作数不都是decimal时（比如没有经过i2d的integer），先转换成数值
+Value value_dadd(Value a, Value b);
+Value value_dsub(Value a, Value b);
+Value value_dmul(Value a, Value b);
+Value value_ddiv(Value a, Value b);
+Value value_dcmp(Value a, Value b, int nanResult);
+Value value_i2d(Value v);
+Value value_d2i(Value v);
+
+//比较两个值，返回1表示a op b成立
+int value_compare(CompareOp op, Value a, Value b);
+
+//lcmp的慢速路径：按value_compare比较，结果是-1、0或1
+Value value_lcmp(Value a, Value b);
+
+//值是否为真：0、false、null、NaN和空字符串是假，其他都是真
+int value_is_true(Value v);
+
+//转换成数值
+double value_to_number(Value v);
+
+//转换成字符串。v本身是字符串时直接返回它
+PlayString* value_to_string(Value v);
+
+//把两个值转换成字符串并连接起来
+Value value_concat(Value a, Value b);
+
+#endif
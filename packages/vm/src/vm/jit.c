@@ -0,0 +1,866 @@
+//模板JIT
+//把预解码后的指令逐条翻译成x86-64机器码，每种指令对应一段固定的机器码模板。
+//寄存器与execute()中缓存的变量一一对应：
+//  rax  操作数栈栈顶的值（tos）
+//  r12  指向栈顶下面的那个元素（sp）
+//  rbx  本地变量数组（locals）
+//  rbp  常数TAG_INTEGER，用于检查和生成integer
+//每个值都是64位的Value。指令模板中只内联integer的快速路径，其他类型的值跳到函数末尾的慢速路径，
+//调用rt/value.c中的函数处理。
+//JIT函数的栈桢也在虚拟机栈中，布局与解释器相同：本地变量 | StackFrame | 哨兵 | 操作数栈。
+//参数就地成为被调用者的本地变量，这与解释器是一致的，所以JIT代码和解释器可以互相调用。
+//StackFrame中只填写垃圾收集器需要的字段，并把它链到topFrame上。
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+#include "playvm.h"
+#include "symbol.h"
+#include "vm.h"
+#include "jit.h"
+#include "../rt/mem.h"
+#include "../rt/output.h"
+
+#ifdef USE_JIT
+
+_Static_assert(sizeof(Value) == 8, "JIT only supports 64-bit Value");
+
+//虚拟机栈的上界
+static unsigned char* jitStackLimit = NULL;
+
+//JIT函数还会占用C语言的栈，深度递归时它可能比虚拟机栈先用完，所以也要检查。rsp不能低于这个位置。
+static unsigned char* nativeStackLimit = NULL;
+
+//C语言的栈至少留出这么多空间，给解释器和内置函数使用
+#define NATIVE_STACK_RESERVE (256*1024)
+
+///////////////////////////////////////////////////////////////
+//生成的机器码所在的内存，运行结束时释放
+
+typedef struct _JitCodeBlock{
+    void* mem;
+    size_t size;
+}JitCodeBlock;
+
+static JitCodeBlock* codeBlocks = NULL;
+static int numCodeBlocks = 0;
+static int codeBlocksCapacity = 0;
+
+void initJit(unsigned char* stackLimit){
+    jitStackLimit = stackLimit;
+
+    //以当前栈桢的位置作为C语言栈的顶部来估算。栈的大小没有限制时，按8M计算
+    unsigned char* here = (unsigned char*)__builtin_frame_address(0);
+    struct rlimit rl;
+    size_t stackSize = 8*1024*1024;
+    if (getrlimit(RLIMIT_STACK, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY){
+        stackSize = (size_t)rl.rlim_cur;
+    }
+    nativeStackLimit = here - (stackSize - NATIVE_STACK_RESERVE);
+}
+
+void deleteJit(){
+    for (int i = 0; i < numCodeBlocks; i++){
+        munmap(codeBlocks[i].mem, codeBlocks[i].size);
+    }
+    free(codeBlocks);
+    codeBlocks = NULL;
+    numCodeBlocks = 0;
+    codeBlocksCapacity = 0;
+}
+
+//把生成的机器码拷贝到一块可执行的内存中。先以可写的方式映射，写完以后改成只读、可执行。
+static void* installCode(unsigned char* code, size_t codeSize){
+    size_t pageSize = (size_t)sysconf(_SC_PAGESIZE);
+    size_t size = (codeSize + pageSize - 1) / pageSize * pageSize;
+    void* mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED){
+        return NULL;
+    }
+    memcpy(mem, code, codeSize);
+    if (mprotect(mem, size, PROT_READ | PROT_EXEC) != 0){
+        munmap(mem, size);
+        return NULL;
+    }
+
+    if (numCodeBlocks == codeBlocksCapacity){
+        codeBlocksCapacity = codeBlocksCapacity == 0 ? 16 : codeBlocksCapacity*2;
+        codeBlocks = (JitCodeBlock*)realloc(codeBlocks, codeBlocksCapacity*sizeof(JitCodeBlock));
+    }
+    codeBlocks[numCodeBlocks].mem = mem;
+    codeBlocks[numCodeBlocks].size = size;
+    numCodeBlocks++;
+    return mem;
+}
+
+///////////////////////////////////////////////////////////////
+//JIT代码调用的辅助函数
+
+//调用还没有编译的函数：累计调用次数，到了阈值就编译，否则解释执行
+static JitResult jitFallback(Value* args, FunctionSymbol* functionSym){
+    if (functionSym->state != FunctionReady){  //第一次调用，先加载再编译
+        output_flush();
+        if (prepareFunction(functionSym) != 0){
+            exit(EXIT_BAD_FILE);
+        }
+    }
+    if (functionSym->jitCode == NULL && functionSym->callCount >= 0
+        && ++functionSym->callCount >= JIT_THRESHOLD){
+        compileFunction(functionSym);
+    }
+    if (functionSym->jitCode != NULL){
+        return functionSym->jitCode(args, functionSym);
+    }
+
+    JitResult result;
+    int rtn = executeFunction(functionSym, args, &result.value);
+    if (rtn < 0){  //机器码无法处理解释器中的错误，只能退出
+        exit(-rtn);
+    }
+    result.hasValue = rtn;
+    return result;
+}
+
+//idiv的慢速路径：操作数不都是integer时交给value_div；除数为0或者结果溢出时报错并退出
+static Value jitDivide(Value a, Value b, FunctionSymbol* functionSym){
+    if (!BOTH_INT(a, b)){
+        return value_div(a, b);
+    }
+    if (DIVISION_FAILS(AS_INT(a), AS_INT(b))){
+        reportDivisionError(functionSym, AS_INT(b));
+        exit(EXIT_RUNTIME_ERROR);
+    }
+    return INT_VALUE(AS_INT(a) / AS_INT(b));
+}
+
+static void jitStackOverflow(FunctionSymbol* functionSym){
+    output_flush();
+    fprintf(stderr, "Stack overflow in function '%s'.\n", ((Symbol*)functionSym)->name);
+    exit(EXIT_STACK_OVERFLOW);
+}
+
+///////////////////////////////////////////////////////////////
+//机器码缓冲区
+
+typedef struct _CodeBuffer{
+    unsigned char* data;
+    size_t size;
+    size_t capacity;
+}CodeBuffer;
+
+static void emitBytes(CodeBuffer* buf, const unsigned char* bytes, size_t n){
+    if (buf->size + n > buf->capacity){
+        buf->capacity = buf->capacity*2 + n;
+        buf->data = (unsigned char*)realloc(buf->data, buf->capacity);
+    }
+    memcpy(buf->data + buf->size, bytes, n);
+    buf->size += n;
+}
+
+#define EMIT(buf, ...) do{ \
+        const unsigned char bytes_[] = {__VA_ARGS__}; \
+        emitBytes(buf, bytes_, sizeof(bytes_)); \
+    }while(0)
+
+static void emit32(CodeBuffer* buf, int32_t value){
+    emitBytes(buf, (unsigned char*)&value, 4);
+}
+
+static void emit64(CodeBuffer* buf, uint64_t value){
+    emitBytes(buf, (unsigned char*)&value, 8);
+}
+
+//跳转的目标
+typedef enum _FixupKind{
+    ToInstruction,  //第target条指令
+    ToCode,         //函数体中的位置
+    ToStub,         //慢速路径中的位置
+}FixupKind;
+
+//跳转指令中有待填写的rel32
+typedef struct _Fixup{
+    CodeBuffer* buf;  //rel32所在的缓冲区
+    size_t pos;       //rel32在缓冲区中的位置
+    FixupKind kind;
+    size_t target;
+}Fixup;
+
+//编译一个函数时的状态。函数体和慢速路径分别生成，最后把慢速路径接在函数体后面。
+typedef struct _JitCompiler{
+    CodeBuffer code;    //函数体，只包含快速路径
+    CodeBuffer stubs;   //慢速路径
+    Fixup* fixups;
+    int numFixups;
+    int fixupsCapacity;
+    int frameOffset;    //StackFrame相对于本地变量的偏移量
+}JitCompiler;
+
+//在buf的当前位置写一个待填写的rel32
+static void emitFixup(JitCompiler* jc, CodeBuffer* buf, FixupKind kind, size_t target){
+    if (jc->numFixups == jc->fixupsCapacity){
+        jc->fixupsCapacity = jc->fixupsCapacity == 0 ? 64 : jc->fixupsCapacity*2;
+        jc->fixups = (Fixup*)realloc(jc->fixups, jc->fixupsCapacity*sizeof(Fixup));
+    }
+    Fixup* fixup = &jc->fixups[jc->numFixups++];
+    fixup->buf = buf;
+    fixup->pos = buf->size;
+    fixup->kind = kind;
+    fixup->target = target;
+    emit32(buf, 0);
+}
+
+//jmp或jcc。cc为0表示无条件跳转
+static void emitJump(JitCompiler* jc, CodeBuffer* buf, unsigned char cc, FixupKind kind, size_t target){
+    if (cc == 0){
+        EMIT(buf, 0xe9);                 //jmp rel32
+    }
+    else{
+        EMIT(buf, 0x0f, cc);             //jcc rel32
+    }
+    emitFixup(jc, buf, kind, target);
+}
+
+#define JNZ 0x85
+#define JZ  0x84
+
+///////////////////////////////////////////////////////////////
+//指令模板
+
+//通用寄存器的编号
+enum {RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI};
+
+//mov dst, src
+static void emitMov(CodeBuffer* buf, int dst, int src){
+    EMIT(buf, 0x48, 0x89, 0xc0 | src<<3 | dst);
+}
+
+//mov reg, imm64
+static void emitMovImm(CodeBuffer* buf, int reg, uint64_t imm){
+    EMIT(buf, 0x48, 0xb8 + reg);
+    emit64(buf, imm);
+}
+
+//调用C语言函数，参数已经放在rdi、rsi、rdx中
+static void emitCall(CodeBuffer* buf, void* fn){
+    emitMovImm(buf, RAX, (uint64_t)(uintptr_t)fn);
+    EMIT(buf, 0xff, 0xd0);               //call rax
+}
+
+//检查reg是不是integer，用tmp做临时寄存器。执行后ZF为1表示是integer
+static void emitCheckInt(CodeBuffer* buf, int reg, int tmp){
+    emitMov(buf, tmp, reg);
+    EMIT(buf, 0x48, 0x31, 0xe8 | tmp);   //xor tmp, rbp
+    EMIT(buf, 0x48, 0xc1, 0xe8 | tmp, 0x20);  //shr tmp, 32
+}
+
+//检查a、b是否都是integer，即BOTH_INT。执行后ZF为1表示都是integer
+static void emitCheckBothInt(CodeBuffer* buf, int a, int b, int tmp1, int tmp2){
+    emitMov(buf, tmp1, a);
+    EMIT(buf, 0x48, 0x31, 0xe8 | tmp1);  //xor tmp1, rbp
+    emitMov(buf, tmp2, b);
+    EMIT(buf, 0x48, 0x31, 0xe8 | tmp2);  //xor tmp2, rbp
+    EMIT(buf, 0x48, 0x09, 0xc0 | tmp2<<3 | tmp1);  //or tmp1, tmp2
+    EMIT(buf, 0x48, 0xc1, 0xe8 | tmp1, 0x20);  //shr tmp1, 32
+}
+
+//慢速路径调用C语言函数时，栈顶的值保存在预留的[rsp+8]处
+static void emitSaveTos(CodeBuffer* buf){
+    EMIT(buf, 0x48, 0x89, 0x44, 0x24, 0x08);  //mov [rsp+8], rax
+}
+
+static void emitRestoreTos(CodeBuffer* buf){
+    EMIT(buf, 0x48, 0x8b, 0x44, 0x24, 0x08);  //mov rax, [rsp+8]
+}
+
+//*++sp = tos
+static void emitSpill(CodeBuffer* buf){
+    EMIT(buf, 0x49, 0x83, 0xc4, 0x08);   //add r12, 8
+    EMIT(buf, 0x49, 0x89, 0x04, 0x24);   //mov [r12], rax
+}
+
+//tos = *sp--
+static void emitPop(CodeBuffer* buf){
+    EMIT(buf, 0x49, 0x8b, 0x04, 0x24);   //mov rax, [r12]
+    EMIT(buf, 0x49, 0x83, 0xec, 0x08);   //sub r12, 8
+}
+
+//sp -= n
+static void emitDrop(CodeBuffer* buf, int n){
+    if (n > 0){
+        EMIT(buf, 0x49, 0x81, 0xec);     //sub r12, imm32
+        emit32(buf, n*(int)sizeof(Value));
+    }
+}
+
+//mov reg, [rbx + 本地变量index的偏移量]
+static void emitLoadLocal(CodeBuffer* buf, int reg, int index){
+    EMIT(buf, 0x48, 0x8b, 0x83 | reg<<3);
+    emit32(buf, index*(int)sizeof(Value));
+}
+
+//mov [rbx + 本地变量index的偏移量], reg
+static void emitStoreLocal(CodeBuffer* buf, int reg, int index){
+    EMIT(buf, 0x48, 0x89, 0x83 | reg<<3);
+    emit32(buf, index*(int)sizeof(Value));
+}
+
+//mov [rbx + 栈桢中字段的偏移量], r12，把sp写回栈桢
+static void emitSaveSp(JitCompiler* jc, CodeBuffer* buf){
+    EMIT(buf, 0x4c, 0x89, 0xa3);         //mov [rbx + disp32], r12
+    emit32(buf, jc->frameOffset + (int)offsetof(StackFrame, sp));
+}
+
+//离开函数：把栈桢从topFrame上摘下来，恢复callee-saved寄存器。rax和rdx不能改动
+static void emitLeaveFrame(JitCompiler* jc, CodeBuffer* buf){
+    EMIT(buf, 0x48, 0x8b, 0x8b);         //mov rcx, [rbx + disp32]，即frame->prev
+    emit32(buf, jc->frameOffset + (int)offsetof(StackFrame, prev));
+    emitMovImm(buf, RSI, (uint64_t)(uintptr_t)&topFrame);
+    EMIT(buf, 0x48, 0x89, 0x0e);         //mov [rsi], rcx
+    EMIT(buf, 0x48, 0x83, 0xc4, 0x10);   //add rsp, 16
+    EMIT(buf, 0x5d);                     //pop rbp
+    EMIT(buf, 0x41, 0x5c);               //pop r12
+    EMIT(buf, 0x5b);                     //pop rbx
+}
+
+//函数返回。rax和rdx中是返回值
+static void emitEpilogue(JitCompiler* jc, CodeBuffer* buf){
+    emitLeaveFrame(jc, buf);
+    EMIT(buf, 0xc3);                     //ret
+}
+
+//把sp之上的numParams个参数挪到本地变量处。参数总是在本地变量的上方，从低地址往高地址挪不会覆盖还没挪的参数
+static void emitMoveArgsToLocals(CodeBuffer* buf, int numParams){
+    for (int k = 0; k < numParams; k++){
+        EMIT(buf, 0x49, 0x8b, 0x8c, 0x24);   //mov rcx, [r12 + disp32]
+        emit32(buf, (k + 1)*(int)sizeof(Value));
+        emitStoreLocal(buf, RCX, k);
+    }
+}
+
+//调用自定义函数，参数在sp之上。被调用者编译过就直接调用机器码，否则通过jitFallback。
+//调用结束后，返回值在rax和rdx中（JitResult）。
+//被调用者的栈桢链在本函数的栈桢后面，所以要先把sp写回栈桢，垃圾收集时才能扫描本函数的操作数栈。
+static void emitCallFunction(JitCompiler* jc, CodeBuffer* buf, FunctionSymbol* callee){
+    emitSaveSp(jc, buf);
+    EMIT(buf, 0x49, 0x8d, 0x7c, 0x24, 0x08);  //lea rdi, [r12+8]
+    emitMovImm(buf, RSI, (uint64_t)(uintptr_t)callee);
+    emitMovImm(buf, RAX, (uint64_t)(uintptr_t)&callee->jitCode);
+    EMIT(buf, 0x48, 0x8b, 0x00);         //mov rax, [rax]
+    EMIT(buf, 0x48, 0x85, 0xc0);         //test rax, rax
+    EMIT(buf, 0x75, 0x0a);               //jnz +10
+    emitMovImm(buf, RAX, (uint64_t)(uintptr_t)jitFallback);
+    EMIT(buf, 0xff, 0xd0);               //call rax
+}
+
+//尾调用其他函数，与解释器的replaceStackFrame一样在原地建立被调用者的栈桢：
+//参数挪到本函数的本地变量处，像返回一样离开本函数，再跳转（而不是调用）到被调用者的机器码或jitFallback。
+//这样相互递归的尾调用既不增长虚拟机栈，也不增长C语言的栈。被调用者返回时直接回到本函数的调用者。
+static void emitTailCallFunction(JitCompiler* jc, CodeBuffer* buf, FunctionSymbol* callee){
+    emitMoveArgsToLocals(buf, callee->numParams);
+    emitMov(buf, RDI, RBX);
+    emitMovImm(buf, RAX, (uint64_t)(uintptr_t)&callee->jitCode);
+    EMIT(buf, 0x48, 0x8b, 0x00);         //mov rax, [rax]
+    EMIT(buf, 0x48, 0x85, 0xc0);         //test rax, rax
+    EMIT(buf, 0x75, 0x0a);               //jnz +10
+    emitMovImm(buf, RAX, (uint64_t)(uintptr_t)jitFallback);
+    emitLeaveFrame(jc, buf);
+    emitMovImm(buf, RSI, (uint64_t)(uintptr_t)callee);
+    EMIT(buf, 0xff, 0xe0);               //jmp rax
+}
+
+//安全点：有垃圾收集的请求时，把栈顶写回操作数栈，再进行收集。本函数的栈桢就是topFrame
+static void emitSafepoint(JitCompiler* jc){
+    CodeBuffer* buf = &jc->code;
+    CodeBuffer* stub = &jc->stubs;
+
+    emitMovImm(buf, RCX, (uint64_t)(uintptr_t)&gc_requested);
+    EMIT(buf, 0x83, 0x39, 0x00);         //cmp dword [rcx], 0
+    emitJump(jc, buf, JNZ, ToStub, stub->size);
+    size_t resume = buf->size;
+
+    emitSpill(stub);
+    emitSaveSp(jc, stub);
+    emitCall(stub, (void*)gc_collect);
+    emitPop(stub);
+    emitJump(jc, stub, 0, ToCode, resume);
+}
+
+//比较类跳转指令对应的jcc
+static unsigned char conditionCode(unsigned char opCode){
+    switch(opCode){
+        case ifeq: case if_icmpeq: case if_icmpeq_lc: return 0x84;
+        case ifne: case if_icmpne: case if_icmpne_lc: return 0x85;
+        case iflt: case if_icmplt: case if_icmplt_lc: return 0x8c;
+        case ifge: case if_icmpge: case if_icmpge_lc: return 0x8d;
+        case ifgt: case if_icmpgt: case if_icmpgt_lc: return 0x8f;
+        case ifle: case if_icmple: case if_icmple_lc: return 0x8e;
+        default: return 0;
+    }
+}
+
+//比较类跳转指令对应的CompareOp，供慢速路径使用
+static CompareOp compareOp(unsigned char opCode){
+    switch(opCode){
+        case if_icmpeq: case if_icmpeq_lc: return CMP_EQ;
+        case if_icmpne: case if_icmpne_lc: return CMP_NE;
+        case iflt: case if_icmplt: case if_icmplt_lc: return CMP_LT;
+        case ifge: case if_icmpge: case if_icmpge_lc: return CMP_GE;
+        case ifgt: case if_icmpgt: case if_icmpgt_lc: return CMP_GT;
+        default: return CMP_LE;
+    }
+}
+
+//算术运算：左操作数在rcx，右操作数在rax，结果在rax
+static void emitArith(JitCompiler* jc, unsigned char opCode, FunctionSymbol* functionSym){
+    CodeBuffer* buf = &jc->code;
+    CodeBuffer* stub = &jc->stubs;
+
+    EMIT(buf, 0x49, 0x8b, 0x0c, 0x24);   //mov rcx, [r12]
+    emitDrop(buf, 1);
+    emitCheckBothInt(buf, RCX, RAX, RDX, RSI);
+    emitJump(jc, buf, JNZ, ToStub, stub->size);
+    void* slowPath;
+    switch(opCode){
+        case iadd:
+            EMIT(buf, 0x01, 0xc1);       //add ecx, eax
+            EMIT(buf, 0x89, 0xc8);       //mov eax, ecx
+            slowPath = (void*)value_add;
+            break;
+        case isub:
+            EMIT(buf, 0x29, 0xc1);       //sub ecx, eax
+            EMIT(buf, 0x89, 0xc8);       //mov eax, ecx
+            slowPath = (void*)value_sub;
+            break;
+        case imul:
+            EMIT(buf, 0x0f, 0xaf, 0xc8); //imul ecx, eax
+            EMIT(buf, 0x89, 0xc8);       //mov eax, ecx
+            slowPath = (void*)value_mul;
+            break;
+        default:
+            //除数为0或-1时也走慢速路径，由jitDivide检查除数为0和INT32_MIN / -1，避免idiv触发SIGFPE
+            EMIT(buf, 0x8d, 0x50, 0x01);  //lea edx, [rax + 1]
+            EMIT(buf, 0x83, 0xfa, 0x01);  //cmp edx, 1
+            emitJump(jc, buf, 0x86, ToStub, stub->size);  //jbe
+            EMIT(buf, 0x89, 0xc6);       //mov esi, eax
+            EMIT(buf, 0x89, 0xc8);       //mov eax, ecx
+            EMIT(buf, 0x99);             //cdq
+            EMIT(buf, 0xf7, 0xfe);       //idiv esi
+            slowPath = (void*)jitDivide;
+            break;
+    }
+    EMIT(buf, 0x48, 0x09, 0xe8);         //or rax, rbp，加上integer的标签
+    size_t resume = buf->size;
+
+    //慢速路径
+    emitMov(stub, RDI, RCX);
+    emitMov(stub, RSI, RAX);
+    if (opCode == idiv){
+        emitMovImm(stub, RDX, (uint64_t)(uintptr_t)functionSym);
+    }
+    emitCall(stub, slowPath);
+    emitJump(jc, stub, 0, ToCode, resume);
+}
+
+//decimal运算：左操作数在rcx，右操作数在rax，结果在rax。
+//两个操作数都是decimal时用SSE计算；有一个不是decimal，或者结果是NaN（需要规范化），走慢速路径
+static void emitDecimalArith(JitCompiler* jc, unsigned char opCode){
+    CodeBuffer* buf = &jc->code;
+    CodeBuffer* stub = &jc->stubs;
+
+    EMIT(buf, 0x49, 0x8b, 0x0c, 0x24);   //mov rcx, [r12]
+    emitDrop(buf, 1);
+    EMIT(buf, 0x48, 0x39, 0xe9);         //cmp rcx, rbp
+    emitJump(jc, buf, 0x83, ToStub, stub->size);  //jae，不是decimal
+    EMIT(buf, 0x48, 0x39, 0xe8);         //cmp rax, rbp
+    emitJump(jc, buf, 0x83, ToStub, stub->size);
+    EMIT(buf, 0x66, 0x48, 0x0f, 0x6e, 0xc1);  //movq xmm0, rcx
+    EMIT(buf, 0x66, 0x48, 0x0f, 0x6e, 0xc8);  //movq xmm1, rax
+    void* slowPath;
+    switch(opCode){
+        case dadd:
+            EMIT(buf, 0xf2, 0x0f, 0x58, 0xc1);   //addsd xmm0, xmm1
+            slowPath = (void*)value_dadd;
+            break;
+        case dsub:
+            EMIT(buf, 0xf2, 0x0f, 0x5c, 0xc1);   //subsd xmm0, xmm1
+            slowPath = (void*)value_dsub;
+            break;
+        case dmul:
+            EMIT(buf, 0xf2, 0x0f, 0x59, 0xc1);   //mulsd xmm0, xmm1
+            slowPath = (void*)value_dmul;
+            break;
+        default:
+            EMIT(buf, 0xf2, 0x0f, 0x5e, 0xc1);   //divsd xmm0, xmm1
+            slowPath = (void*)value_ddiv;
+            break;
+    }
+    EMIT(buf, 0x66, 0x0f, 0x2e, 0xc0);   //ucomisd xmm0, xmm0
+    emitJump(jc, buf, 0x8a, ToStub, stub->size);  //jp，结果是NaN
+    EMIT(buf, 0x66, 0x48, 0x0f, 0x7e, 0xc0);  //movq rax, xmm0
+    size_t resume = buf->size;
+
+    emitMov(stub, RDI, RCX);
+    emitMov(stub, RSI, RAX);
+    emitCall(stub, slowPath);
+    emitJump(jc, stub, 0, ToCode, resume);
+}
+
+//本地变量x加上立即数c，结果写回x。用于iinc和iinc_goto
+static void emitIncLocal(JitCompiler* jc, int x, int c){
+    CodeBuffer* buf = &jc->code;
+    CodeBuffer* stub = &jc->stubs;
+
+    emitLoadLocal(buf, RCX, x);
+    emitCheckInt(buf, RCX, RDX);
+    emitJump(jc, buf, JNZ, ToStub, stub->size);
+    EMIT(buf, 0x81, 0xc1);               //add ecx, imm32
+    emit32(buf, c);
+    EMIT(buf, 0x48, 0x09, 0xe9);         //or rcx, rbp
+    size_t resume = buf->size;
+    emitStoreLocal(buf, RCX, x);
+
+    emitSaveTos(stub);
+    emitMov(stub, RDI, RCX);
+    emitMovImm(stub, RSI, INT_VALUE(c));
+    emitCall(stub, (void*)value_add);
+    emitMov(stub, RCX, RAX);
+    emitRestoreTos(stub);
+    emitJump(jc, stub, 0, ToCode, resume);
+}
+
+//比较并跳转的慢速路径：左右操作数在rsi、rdx中
+static void emitCompareStub(JitCompiler* jc, unsigned char opCode, size_t target, size_t resume){
+    CodeBuffer* stub = &jc->stubs;
+    emitSaveTos(stub);
+    EMIT(stub, 0xbf);                    //mov edi, imm32
+    emit32(stub, compareOp(opCode));
+    emitCall(stub, (void*)value_compare);
+    EMIT(stub, 0x85, 0xc0);              //test eax, eax
+    emitRestoreTos(stub);
+    emitJump(jc, stub, JNZ, ToInstruction, target);
+    emitJump(jc, stub, 0, ToCode, resume);
+}
+
+///////////////////////////////////////////////////////////////
+//编译
+
+int compileFunction(FunctionSymbol* functionSym){
+    Instruction* code = functionSym->code;
+    int numInstructions = functionSym->numInstructions;
+
+    JitCompiler compiler;
+    memset(&compiler, 0, sizeof(compiler));
+    JitCompiler* jc = &compiler;
+    jc->frameOffset = functionSym->numVars*(int)sizeof(Value);
+    CodeBuffer* buf = &jc->code;
+    CodeBuffer* stub = &jc->stubs;
+    size_t* offsets = (size_t*)malloc(numInstructions*sizeof(size_t));  //每条指令对应的机器码的位置
+
+    //函数序言：保存要用到的callee-saved寄存器，对齐rsp，并留出16个字节给内置函数写返回值和慢速路径保存栈顶
+    EMIT(buf, 0x53);                     //push rbx
+    EMIT(buf, 0x41, 0x54);               //push r12
+    EMIT(buf, 0x55);                     //push rbp
+    EMIT(buf, 0x48, 0x83, 0xec, 0x10);   //sub rsp, 16
+    EMIT(buf, 0x48, 0x89, 0xfb);         //mov rbx, rdi
+    emitMovImm(buf, RBP, TAG_INTEGER);
+
+    //检查虚拟机栈是否够用。栈溢出时报错并退出
+    size_t overflowStub = stub->size;
+    emitMovImm(stub, RDI, (uint64_t)(uintptr_t)functionSym);
+    emitCall(stub, (void*)jitStackOverflow);
+
+    EMIT(buf, 0x48, 0x8d, 0x87);         //lea rax, [rdi + 栈桢大小]
+    emit32(buf, functionSym->frameSize);
+    emitMovImm(buf, RCX, (uint64_t)(uintptr_t)jitStackLimit);
+    EMIT(buf, 0x48, 0x39, 0xc8);         //cmp rax, rcx
+    emitJump(jc, buf, 0x87, ToStub, overflowStub);  //ja overflow
+    emitMovImm(buf, RCX, (uint64_t)(uintptr_t)nativeStackLimit);
+    EMIT(buf, 0x48, 0x39, 0xcc);         //cmp rsp, rcx
+    emitJump(jc, buf, 0x82, ToStub, overflowStub);  //jb overflow
+
+    //填写StackFrame，把它链到topFrame上
+    EMIT(buf, 0x48, 0x8d, 0x8b);         //lea rcx, [rbx + disp32]，即frame
+    emit32(buf, jc->frameOffset);
+    emitMovImm(buf, RDX, (uint64_t)(uintptr_t)functionSym);
+    EMIT(buf, 0x48, 0x89, 0x51, (unsigned char)offsetof(StackFrame, functionSym));  //mov [rcx + disp8], rdx
+    EMIT(buf, 0x48, 0x89, 0x59, (unsigned char)offsetof(StackFrame, localVars));    //mov [rcx + disp8], rbx
+    emitMovImm(buf, RSI, (uint64_t)(uintptr_t)&topFrame);
+    EMIT(buf, 0x48, 0x8b, 0x16);         //mov rdx, [rsi]
+    EMIT(buf, 0x48, 0x89, 0x51, (unsigned char)offsetof(StackFrame, prev));         //mov [rcx + disp8], rdx
+    EMIT(buf, 0x48, 0x89, 0x0e);         //mov [rsi], rcx
+
+    //参数以外的本地变量初始化为null；空的操作数栈：sp指向哨兵的下一个位置
+    size_t bodyStart = buf->size;
+    if (functionSym->numVars > functionSym->numParams){
+        emitMovImm(buf, RCX, NULL_VALUE);
+        for (int k = functionSym->numParams; k < functionSym->numVars; k++){
+            emitStoreLocal(buf, RCX, k);
+        }
+    }
+    EMIT(buf, 0x4c, 0x8d, 0xa3);         //lea r12, [rbx + disp32]，即哨兵的前一个位置
+    emit32(buf, jc->frameOffset + (int)sizeof(StackFrame) - (int)sizeof(Value));
+
+    for (int i = 0; i < numInstructions; i++){
+        Instruction* instr = &code[i];
+        size_t resume;
+        offsets[i] = buf->size;
+        switch(instr->opCode){
+            case iconst_0: case iconst_1: case iconst_2: case iconst_3: case iconst_4: case iconst_5:
+            case bipush: case sipush: case ldc: case sldc:
+            case dconst_0: case dconst_1: case ldc2_w:
+                emitSpill(buf);
+                emitMovImm(buf, RAX, instr->value);
+                break;
+            case iload: case iload_0: case iload_1: case iload_2: case iload_3:
+                emitSpill(buf);
+                emitLoadLocal(buf, RAX, instr->opCode == iload ? instr->operand : instr->opCode - iload_0);
+                break;
+            case istore: case istore_0: case istore_1: case istore_2: case istore_3:
+                emitStoreLocal(buf, RAX, instr->opCode == istore ? instr->operand : instr->opCode - istore_0);
+                emitPop(buf);
+                break;
+            case pop:
+                emitPop(buf);
+                break;
+            case iadd: case isub: case imul: case idiv:
+                emitArith(jc, instr->opCode, functionSym);
+                break;
+            case dadd: case dsub: case dmul: case ddiv:
+                emitDecimalArith(jc, instr->opCode);
+                break;
+            case i2d:
+                emitCheckInt(buf, RAX, RDX);
+                emitJump(jc, buf, JNZ, ToStub, stub->size);
+                EMIT(buf, 0xf2, 0x0f, 0x2a, 0xc0);   //cvtsi2sd xmm0, eax
+                EMIT(buf, 0x66, 0x48, 0x0f, 0x7e, 0xc0);  //movq rax, xmm0
+                resume = buf->size;
+
+                emitMov(stub, RDI, RAX);
+                emitCall(stub, (void*)value_i2d);
+                emitJump(jc, stub, 0, ToCode, resume);
+                break;
+            case d2i:
+                emitMov(buf, RDI, RAX);
+                emitCall(buf, (void*)value_d2i);
+                break;
+            case lcmp:
+                EMIT(buf, 0x49, 0x8b, 0x3c, 0x24);   //mov rdi, [r12]
+                emitDrop(buf, 1);
+                emitMov(buf, RSI, RAX);
+                emitCall(buf, (void*)value_lcmp);
+                break;
+            case dcmpl: case dcmpg:
+                EMIT(buf, 0x49, 0x8b, 0x3c, 0x24);   //mov rdi, [r12]
+                emitDrop(buf, 1);
+                emitMov(buf, RSI, RAX);
+                EMIT(buf, 0xba);                     //mov edx, imm32
+                emit32(buf, instr->opCode == dcmpl ? -1 : 1);
+                emitCall(buf, (void*)value_dcmp);
+                break;
+            case sadd:
+                EMIT(buf, 0x49, 0x8b, 0x3c, 0x24);   //mov rdi, [r12]
+                emitDrop(buf, 1);
+                emitMov(buf, RSI, RAX);
+                emitCall(buf, (void*)value_concat);
+                break;
+            case iinc:
+                emitIncLocal(jc, instr->operand, instr->operand2);
+                break;
+            case iinc_goto:
+                emitIncLocal(jc, instr->operand, instr->operand2);
+                emitSafepoint(jc);
+                emitJump(jc, buf, 0, ToInstruction, instr->target - code);
+                break;
+            case ifeq: case ifne:
+                emitMov(buf, RCX, RAX);
+                emitPop(buf);
+                emitCheckInt(buf, RCX, RDX);
+                emitJump(jc, buf, JNZ, ToStub, stub->size);
+                EMIT(buf, 0x85, 0xc9);               //test ecx, ecx
+                resume = buf->size;
+                emitJump(jc, buf, conditionCode(instr->opCode), ToInstruction, instr->target - code);
+
+                //慢速路径：按照值的真假设置ZF，再回到上面的jcc
+                emitSaveTos(stub);
+                emitMov(stub, RDI, RCX);
+                emitCall(stub, (void*)value_is_true);
+                EMIT(stub, 0x85, 0xc0);              //test eax, eax
+                emitRestoreTos(stub);
+                emitJump(jc, stub, 0, ToCode, resume);
+                break;
+            case iflt: case ifge: case ifgt: case ifle:
+                emitMov(buf, RCX, RAX);
+                emitPop(buf);
+                emitCheckInt(buf, RCX, RDX);
+                emitJump(jc, buf, JNZ, ToStub, stub->size);
+                EMIT(buf, 0x85, 0xc9);               //test ecx, ecx
+                emitJump(jc, buf, conditionCode(instr->opCode), ToInstruction, instr->target - code);
+                resume = buf->size;
+
+                emitMov(stub, RSI, RCX);
+                emitMovImm(stub, RDX, INT_VALUE(0));
+                emitCompareStub(jc, instr->opCode, instr->target - code, resume);
+                break;
+            case if_icmpeq: case if_icmpne: case if_icmplt: case if_icmpge: case if_icmpgt: case if_icmple:
+                emitMov(buf, RDX, RAX);
+                EMIT(buf, 0x49, 0x8b, 0x0c, 0x24);       //mov rcx, [r12]
+                EMIT(buf, 0x49, 0x8b, 0x44, 0x24, 0xf8); //mov rax, [r12-8]
+                emitDrop(buf, 2);
+                emitCheckBothInt(buf, RCX, RDX, RSI, RDI);
+                emitJump(jc, buf, JNZ, ToStub, stub->size);
+                EMIT(buf, 0x39, 0xd1);               //cmp ecx, edx
+                emitJump(jc, buf, conditionCode(instr->opCode), ToInstruction, instr->target - code);
+                resume = buf->size;
+
+                emitMov(stub, RSI, RCX);
+                emitCompareStub(jc, instr->opCode, instr->target - code, resume);
+                break;
+            case _goto:
+                emitSafepoint(jc);
+                emitJump(jc, buf, 0, ToInstruction, instr->target - code);
+                break;
+            case isub_lc:
+                emitSpill(buf);
+                emitLoadLocal(buf, RAX, instr->operand);
+                emitCheckInt(buf, RAX, RDX);
+                emitJump(jc, buf, JNZ, ToStub, stub->size);
+                EMIT(buf, 0x2d);                     //sub eax, imm32
+                emit32(buf, instr->operand2);
+                EMIT(buf, 0x48, 0x09, 0xe8);         //or rax, rbp
+                resume = buf->size;
+
+                emitMov(stub, RDI, RAX);
+                emitMovImm(stub, RSI, INT_VALUE(instr->operand2));
+                emitCall(stub, (void*)value_sub);
+                emitJump(jc, stub, 0, ToCode, resume);
+                break;
+            case if_icmpeq_lc: case if_icmpne_lc: case if_icmplt_lc:
+            case if_icmpge_lc: case if_icmpgt_lc: case if_icmple_lc:
+                emitLoadLocal(buf, RCX, instr->operand);
+                emitCheckInt(buf, RCX, RDX);
+                emitJump(jc, buf, JNZ, ToStub, stub->size);
+                EMIT(buf, 0x81, 0xf9);               //cmp ecx, imm32
+                emit32(buf, instr->operand2);
+                emitJump(jc, buf, conditionCode(instr->opCode), ToInstruction, instr->target - code);
+                resume = buf->size;
+
+                emitMov(stub, RSI, RCX);
+                emitMovImm(stub, RDX, INT_VALUE(instr->operand2));
+                emitCompareStub(jc, instr->opCode, instr->target - code, resume);
+                break;
+            case iadd_ll_st:
+                emitLoadLocal(buf, RCX, instr->operand);
+                emitLoadLocal(buf, RDX, instr->operand2);
+                emitCheckBothInt(buf, RCX, RDX, RSI, RDI);
+                emitJump(jc, buf, JNZ, ToStub, stub->size);
+                EMIT(buf, 0x01, 0xd1);               //add ecx, edx
+                EMIT(buf, 0x48, 0x09, 0xe9);         //or rcx, rbp
+                resume = buf->size;
+                emitStoreLocal(buf, RCX, instr->operand3);
+
+                emitSaveTos(stub);
+                emitMov(stub, RDI, RCX);
+                emitMov(stub, RSI, RDX);
+                emitCall(stub, (void*)value_add);
+                emitMov(stub, RCX, RAX);
+                emitRestoreTos(stub);
+                emitJump(jc, stub, 0, ToCode, resume);
+                break;
+            case ireturn:
+                EMIT(buf, 0xba, 0x01, 0x00, 0x00, 0x00);  //mov edx, 1，hasValue = 1
+                emitEpilogue(jc, buf);
+                break;
+            case _return:
+                EMIT(buf, 0x31, 0xd2);               //xor edx, edx
+                emitEpilogue(jc, buf);
+                break;
+            case invokestatic:{
+                FunctionSymbol* callee = instr->callee;
+                emitSafepoint(jc);
+                emitSpill(buf);
+                emitDrop(buf, callee->numParams);
+                if (callee->native != NULL){
+                    //native(numParams, sp + 1, rsp)，返回值写在栈上预留的位置
+                    EMIT(buf, 0xbf);                     //mov edi, imm32
+                    emit32(buf, callee->numParams);
+                    EMIT(buf, 0x49, 0x8d, 0x74, 0x24, 0x08);  //lea rsi, [r12+8]
+                    EMIT(buf, 0x48, 0x89, 0xe2);         //mov rdx, rsp
+                    emitCall(buf, (void*)callee->native);
+                    EMIT(buf, 0x85, 0xc0);               //test eax, eax
+                    EMIT(buf, 0x74, 0x06);               //jz +6
+                    EMIT(buf, 0x48, 0x8b, 0x04, 0x24);   //mov rax, [rsp]
+                    EMIT(buf, 0xeb, 0x08);               //jmp +8
+                    emitPop(buf);
+                }
+                else{
+                    emitCallFunction(jc, buf, callee);
+                    EMIT(buf, 0x85, 0xd2);               //test edx, edx
+                    EMIT(buf, 0x75, 0x08);               //jnz +8，有返回值，它就是新的栈顶
+                    emitPop(buf);
+                }
+                break;
+            }
+            case invoketail:{
+                FunctionSymbol* callee = instr->callee;
+                emitSafepoint(jc);
+                emitSpill(buf);
+                emitDrop(buf, callee->numParams);
+                if (callee == functionSym){
+                    //自身递归：参数挪到本地变量处，跳回函数开头
+                    emitMoveArgsToLocals(buf, callee->numParams);
+                    emitJump(jc, buf, 0, ToCode, bodyStart);
+                }
+                else{
+                    //被调用者的返回值就是本函数的返回值
+                    emitTailCallFunction(jc, buf, callee);
+                }
+                break;
+            }
+            default:
+                //JIT不支持的指令，这个函数只能解释执行
+                free(jc->code.data);
+                free(jc->stubs.data);
+                free(jc->fixups);
+                free(offsets);
+                functionSym->callCount = -1;
+                return -1;
+        }
+    }
+
+    //把慢速路径接在函数体后面，再填写跳转地址
+    size_t stubsStart = buf->size;
+    emitBytes(buf, stub->data, stub->size);
+    for (int i = 0; i < jc->numFixups; i++){
+        Fixup* fixup = &jc->fixups[i];
+        size_t pos = fixup->buf == stub ? stubsStart + fixup->pos : fixup->pos;
+        size_t target;
+        switch(fixup->kind){
+            case ToInstruction: target = offsets[fixup->target]; break;
+            case ToCode: target = fixup->target; break;
+            default: target = stubsStart + fixup->target; break;
+        }
+        int32_t rel = (int32_t)(target - (pos + 4));
+        memcpy(buf->data + pos, &rel, 4);
+    }
+
+    void* mem = installCode(buf->data, buf->size);
+    free(jc->code.data);
+    free(jc->stubs.data);
+    free(jc->fixups);
+    free(offsets);
+    if (mem == NULL){
+        functionSym->callCount = -1;
+        return -1;
+    }
+
+    functionSym->jitCode = (JitFunction)mem;
+    return 0;
+}
+
+#endif
@@ -0,0 +1,23 @@
+//模板JIT：把热点函数翻译成x86-64机器码
+
+#ifndef PLAYSCRIPT_JIT
+#define PLAYSCRIPT_JIT
+
+#include "playvm.h"
+#include "symbol.h"
+
+#ifdef USE_JIT
+
+//初始化JIT。stackLimit是虚拟机栈的上界，JIT函数的栈桢不能超过这个位置。
+void initJit(unsigned char* stackLimit);
+
+//把函数编译成机器码，成功时设置functionSym->jitCode并返回0。
+//函数中有JIT不支持的指令时返回-1，以后该函数一直解释执行。
+int compileFunction(FunctionSymbol* functionSym);
+
+//释放所有JIT生成的机器码
+void deleteJit();
+
+#endif
+
+#endif
@@ -1,437 +1,898 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
+#include <errno.h>
 #include <time.h> 
 
 #include "types.h"
 #include "symbol.h"
 #include "vm.h"
 
+#ifdef USE_MMAP_LOADER
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#if defined(__unix__) || defined(__APPLE__)  //macOS不定义__unix__
+#include <unistd.h>
+#include <sys/resource.h>
+#endif
+
 #include "../rt/string.h"
 #include "../rt/number.h"
+#include "../rt/mem.h"
+#include "../rt/output.h"
+#include "../rt/sysfuncs.h"
+
+#include "jit.h"
+#include "verifier.h"
+#include "profile.h"
+
+///////////////////////////////////////////////////////////////
+//指令分派
+//USE_COMPUTED_GOTO时采用直接线索化（direct threading）：每条指令在预解码时就记下了处理程序的地址，
+//处理程序执行完毕后直接跳到下一条指令的处理程序。每个处理程序都有自己的间接跳转，CPU可以分别
+//为它们做分支预测。否则使用switch分派，所有指令共用一个间接跳转。
+#ifdef USE_COMPUTED_GOTO
+    #define TARGET(op) case op: L_##op
+    #define TARGET_DEFAULT default: L_unknown
+    #define DISPATCH() goto *ip->handler
+#else
+    #define TARGET(op) case op
+    #define TARGET_DEFAULT default
+    #define DISPATCH() continue
+#endif
+
+//执行下一条指令
+#define NEXT() {ip++; DISPATCH();}
+
+//比较并跳转。isInt为真时a、b都是integer，直接比较，否则调用value_compare。
+//两条路径各自分派，免得编译器把它们合并成一个条件值再判断。
+#define COMPARE_AND_JUMP(isInt, a, b, op, cmpOp) { \
+        if (isInt){ \
+            if (AS_INT(a) op AS_INT(b)){ \
+                ip = ip->target; \
+                DISPATCH(); \
+            } \
+            NEXT(); \
+        } \
+        if (value_compare(cmpOp, a, b)){ \
+            ip = ip->target; \
+            DISPATCH(); \
+        } \
+        NEXT(); \
+    }
+
+//操作数栈栈顶缓存在tos中，sp指向栈顶之下的元素。
+//空栈时sp指向data[-2]，tos中是无意义的值；因此操作数栈的下方要预留一个哨兵位置，
+//以便在空栈上做PUSH时有地方写入这个无意义的值。
+#define PUSH(v) {*++sp = tos; tos = (v);}
+
+//从栈桢中载入操作数栈和本地变量的状态
+#define LOAD_FRAME() {sp = frame->sp; \
+                      tos = *sp--; \
+                      locals = frame->localVars;}
+
+//安全点：有垃圾收集的请求时，把栈顶写回栈桢，让当前栈桢成为栈桢链的顶部，再进行收集。
+//放在函数调用和向后跳转处，这样任何循环和递归都会经过安全点。
+#define SAFEPOINT() {if (gc_requested){ \
+                        *++sp = tos; \
+                        frame->sp = sp; \
+                        topFrame = frame; \
+                        gc_collect(); \
+                        sp--; \
+                    }}
+
+//检查当前栈桢（调试模式）。tos也算在栈里，所以栈顶是sp + 1
+#ifdef DEBUG_FRAMES
+    #define CHECK_FRAME() checkFrame(frame, sp + 1)
+#else
+    #define CHECK_FRAME()
+#endif
+
+//执行一条指令之前的操作数栈深度（性能剖析用），tos也算在内。空栈时sp + 1指向哨兵位置
+#ifdef USE_VM_STACK
+    #define STACK_DEPTH() ((int)(sp + 1 - (Value*)(frame + 1)))
+#else
+    #define STACK_DEPTH() ((int)(sp + 1 - (frame->localVars + frame->functionSym->numVars)))
+#endif
+
+//性能剖析的桩：打开--profile时，所有指令的处理程序（switch分派时是dispatchOp）都是它。
+//它在分派表的最后，不与任何操作码重复
+#define PROFILE_SLOT 256
+
+#ifdef USE_COMPUTED_GOTO
+//分派表，由executeFunction(NULL, ...)导出，供预解码时查找处理程序的地址
+static void** handlerTable = NULL;
+#endif
 
 ///////////////////////////////////////////////////////////////
 //栈机
-int execute(BCModule* bcModule){
+
+//栈桢链的顶部。解释器只在安全点和调用JIT代码之前更新它；JIT函数在序言和尾声中更新它。
+StackFrame* topFrame = NULL;
+
+//运行bcModule的main函数。返回值同executeFunction()
+int execute(BCModule* bcModule, Value* result){
     //找到入口函数
     if (bcModule->_main == NULL){
-        printf("Can not find main function.");
-        return -1;
+        fprintf(stderr, "Can not find main function.\n");
+        return -EXIT_BAD_FILE;
     }
-    
-    //当前在执行的函数
-    FunctionSymbol* functionSym = bcModule->_main;
 
-    //创建栈桢
-    StackFrame* frame = createStackFrame(functionSym);
+    return executeFunction(bcModule->_main, NULL, result);
+}
 
-    //当前运行的代码
-    unsigned char* code = NULL;
-    if (functionSym->byteCode != NULL){
-        code = functionSym->byteCode;
+void reportDivisionError(FunctionSymbol* functionSym, int32_t divisor){
+    output_flush();
+    if (divisor == 0){
+        fprintf(stderr, "Division by zero in function '%s'.\n", ((Symbol*)functionSym)->name);
     }
     else{
-        printf("Can not find code for 'main'.");
-        return -1;
+        fprintf(stderr, "Integer overflow in division in function '%s'.\n", ((Symbol*)functionSym)->name);
+    }
+}
+
+//解释执行一个函数，直到它返回。args同createStackFrame。
+//返回值：1表示函数用ireturn返回了一个值，存在*result中；0表示没有返回值；负数表示出错，是退出码的相反数：
+//-EXIT_BAD_FILE表示第一次执行的函数加载或校验失败，-EXIT_STACK_OVERFLOW表示栈溢出，-EXIT_RUNTIME_ERROR是其他运行时错误，比如除数为0。
+//functionSym为NULL时不运行任何代码，只是导出分派表。
+int executeFunction(FunctionSymbol* functionSym, Value* args, Value* result){
+#ifdef USE_COMPUTED_GOTO
+    //分派表：以操作码为下标，存放处理程序的地址。未定义的操作码在导出时填上L_unknown。
+    //标签的地址只通过这个静态表导出，直接赋给全局变量时GCC会误报-Wdangling-pointer
+    static void* dispatchTable[PROFILE_SLOT + 1] = {
+        [PROFILE_SLOT] = &&L_profile,
+        [iconst_0] = &&L_iconst_0,
+        [iconst_1] = &&L_iconst_1,
+        [iconst_2] = &&L_iconst_2,
+        [iconst_3] = &&L_iconst_3,
+        [iconst_4] = &&L_iconst_4,
+        [iconst_5] = &&L_iconst_5,
+        [bipush] = &&L_bipush,
+        [sipush] = &&L_sipush,
+        [ldc] = &&L_ldc,
+        [sldc] = &&L_sldc,
+        [iload] = &&L_iload,
+        [iload_0] = &&L_iload_0,
+        [iload_1] = &&L_iload_1,
+        [iload_2] = &&L_iload_2,
+        [iload_3] = &&L_iload_3,
+        [istore] = &&L_istore,
+        [istore_0] = &&L_istore_0,
+        [istore_1] = &&L_istore_1,
+        [istore_2] = &&L_istore_2,
+        [istore_3] = &&L_istore_3,
+        [pop] = &&L_pop,
+        [iadd] = &&L_iadd,
+        [sadd] = &&L_sadd,
+        [isub] = &&L_isub,
+        [imul] = &&L_imul,
+        [idiv] = &&L_idiv,
+        [iinc] = &&L_iinc,
+        [ireturn] = &&L_ireturn,
+        [_return] = &&L__return,
+        [invokestatic] = &&L_invokestatic,
+        [ifeq] = &&L_ifeq,
+        [ifne] = &&L_ifne,
+        [if_icmpeq] = &&L_if_icmpeq,
+        [if_icmpne] = &&L_if_icmpne,
+        [lcmp] = &&L_lcmp,
+        [if_icmplt] = &&L_if_icmplt,
+        [if_icmpge] = &&L_if_icmpge,
+        [if_icmpgt] = &&L_if_icmpgt,
+        [if_icmple] = &&L_if_icmple,
+        [_goto] = &&L__goto,
+        [isub_lc] = &&L_isub_lc,
+        [if_icmpeq_lc] = &&L_if_icmpeq_lc,
+        [if_icmpne_lc] = &&L_if_icmpne_lc,
+        [if_icmplt_lc] = &&L_if_icmplt_lc,
+        [if_icmpge_lc] = &&L_if_icmpge_lc,
+        [if_icmpgt_lc] = &&L_if_icmpgt_lc,
+        [if_icmple_lc] = &&L_if_icmple_lc,
+        [iadd_ll_st] = &&L_iadd_ll_st,
+        [iinc_goto] = &&L_iinc_goto,
+        [invoketail] = &&L_invoketail,
+        [dconst_0] = &&L_dconst_0,
+        [dconst_1] = &&L_dconst_1,
+        [ldc2_w] = &&L_ldc2_w,
+        [dadd] = &&L_dadd,
+        [dsub] = &&L_dsub,
+        [dmul] = &&L_dmul,
+        [ddiv] = &&L_ddiv,
+        [i2d] = &&L_i2d,
+        [d2i] = &&L_d2i,
+        [dcmpl] = &&L_dcmpl,
+        [dcmpg] = &&L_dcmpg,
+        [iflt] = &&L_iflt,
+        [ifge] = &&L_ifge,
+        [ifgt] = &&L_ifgt,
+        [ifle] = &&L_ifle,
+    };
+    static void* unknownHandler = &&L_unknown;
+
+    if (functionSym == NULL){
+        for (int i = 0; i < PROFILE_SLOT; i++){
+            if (dispatchTable[i] == NULL){
+                dispatchTable[i] = unknownHandler;
+            }
+        }
+        handlerTable = dispatchTable;
+        return 0;
+    }
+#else
+    if (functionSym == NULL){
+        return 0;
     }
+#endif
 
-    //当前代码的位置
-    int codeIndex = 0;
+    //第一次执行时才加载函数。出错信息要排在程序已有的输出后面
+    if (functionSym->state != FunctionReady){
+        output_flush();
+        if (prepareFunction(functionSym) != 0){
+            return -EXIT_BAD_FILE;
+        }
+    }
 
-    //一直执行代码，直到遇到return语句
-    unsigned char opCode = code[codeIndex];
+    //当前在执行的指令
+    Instruction* ip = functionSym->code;
+
+    //创建栈桢，接在调用者（可能是JIT代码）的栈桢后面。这个栈桢返回时，executeFunction就结束了。
+    StackFrame* frame = createStackFrame(functionSym, args);
+    if (frame == NULL){
+        output_flush();
+        fprintf(stderr, "Stack overflow in function '%s'.\n", ((Symbol*)functionSym)->name);
+        return -EXIT_STACK_OVERFLOW;
+    }
+    frame->prev = topFrame;
+    StackFrame* entryFrame = frame;
+
+    //以下三个变量缓存了当前栈桢的状态，以便编译器把它们放在寄存器里：
+    //tos是操作数栈栈顶的值，sp指向栈顶下面的那个元素，locals是本地变量数组。
+    //只有在函数调用、返回时，才与StackFrame同步。
+    Value tos;
+    Value* sp;
+    Value* locals;
+    LOAD_FRAME();
 
     //临时变量
-    unsigned char byte1 = 0;
-    unsigned char byte2 = 0;
-    VM_NUMBER vleft = 0;
-    VM_NUMBER vright = 0;
-    int tempCodeIndex = 0;
-
-    int varIndex;
-    int offset;
-    int constIndex;
-    // int retValue;
-    long retValue;
+    Value vleft = 0;
+    Value vright = 0;
+    Value retValue;
 
     StackFrame* lastFrame;
 
+#ifdef USE_COMPUTED_GOTO
+    //从第一条指令开始，直接跳到它的处理程序。此后不会再经过下面的switch。
+    DISPATCH();
+#endif
+
+    //一直执行代码，直到遇到return语句
     while(1){
-        switch (opCode){
-            case iconst_0:
-                pushToOpStack(frame,0);
-                opCode = code[++codeIndex];
-                continue;
-            case iconst_1:
-                pushToOpStack(frame,1);
-                opCode = code[++codeIndex];
-                continue;
-            case iconst_2:
-                pushToOpStack(frame,2);
-                opCode = code[++codeIndex];
-                continue;
-            case iconst_3:
-                pushToOpStack(frame,3);
-                opCode = code[++codeIndex];
-                continue;
-            case iconst_4:
-                pushToOpStack(frame,4);
-                opCode = code[++codeIndex];
-                continue;
-            case iconst_5:
-                pushToOpStack(frame,5);
-                opCode = code[++codeIndex];
-                continue;
-            case bipush:  //取出1个字节
-                pushToOpStack(frame,code[++codeIndex]); 
-                opCode = code[++codeIndex];
-                continue;
-            case sipush:  //取出2个字节
-                byte1 = code[++codeIndex];
-                byte2 = code[++codeIndex];
-                pushToOpStack(frame,byte1<<8|byte2); 
-                opCode = code[++codeIndex];
-                continue;
-            case ldc:   //从常量池加载
-                constIndex = code[++codeIndex];   
-                NumberConst * numberConst = (NumberConst *)bcModule->consts[constIndex];
-                pushToOpStack(frame,numberConst->value); 
-                opCode = code[++codeIndex];
-                continue;
-            // case sldc:   //从常量池加载字符串
-            //     constIndex = code[++codeIndex];   
-            //     StringConst * stringConst = (StringConst *)bcModule->consts[constIndex];
-            //     pushToOpStack(frame,(VM_NUMBER)string_create_by_str(stringConst->value)); 
-            //     opCode = code[++codeIndex];
-            //     continue;
-            case iload:
-                pushToOpStack(frame,frame->localVars[code[++codeIndex]]);
-                opCode = code[++codeIndex];
-                continue;
-            case iload_0:
-                pushToOpStack(frame,frame->localVars[0]);
-                opCode = code[++codeIndex];
-                continue;
-            case iload_1:
-                pushToOpStack(frame,frame->localVars[1]);
-                opCode = code[++codeIndex];
-                continue;
-            case iload_2:
-                pushToOpStack(frame,frame->localVars[2]);
-                opCode = code[++codeIndex];
-                continue;
-            case iload_3:
-                pushToOpStack(frame,frame->localVars[3]);
-                opCode = code[++codeIndex];
-                continue;
-            case istore:
-                frame->localVars[code[++codeIndex]] = popFromOpStack(frame);
-                opCode = code[++codeIndex];
-                continue;
-            case istore_0:
-                frame->localVars[0] = popFromOpStack(frame);
-                opCode = code[++codeIndex];
-                continue;
-            case istore_1:
-                frame->localVars[1] = popFromOpStack(frame);
-                opCode = code[++codeIndex];
-                continue;
-            case istore_2:
-                frame->localVars[2] = popFromOpStack(frame);
-                opCode = code[++codeIndex];
-                continue;
-            case istore_3:
-                frame->localVars[3] = popFromOpStack(frame);
-                opCode = code[++codeIndex];
-                continue;
-            case iadd:
-                pushToOpStack(frame,popFromOpStack(frame) + popFromOpStack(frame));
-                opCode = code[++codeIndex];
-                continue;
-            // case sadd:
-            //     vright = popFromOpStack(frame);
-            //     vleft = popFromOpStack(frame);
-            //     PlayString * str = string_concat((PlayString *) vleft, (PlayString *) vright);
-            //     pushToOpStack(frame,(VM_NUMBER)str);
-            //     opCode = code[++codeIndex];
-            //     continue;
-            case isub:
-                vright = popFromOpStack(frame);
-                vleft = popFromOpStack(frame);
-                pushToOpStack(frame,vleft - vright);
-                opCode = code[++codeIndex];
-                continue;
-            case imul:
-                pushToOpStack(frame,popFromOpStack(frame) * popFromOpStack(frame));
-                opCode = code[++codeIndex];
-                continue;
-            case idiv:
-                vright = popFromOpStack(frame);
-                vleft = popFromOpStack(frame);
-                pushToOpStack(frame,vleft / vright);
-                opCode = code[++codeIndex];
-                continue;
-            case iinc:
-                varIndex = code[++codeIndex];
-                offset = code[++codeIndex]; 
-                frame->localVars[varIndex] = frame->localVars[varIndex]+offset;
-                opCode = code[++codeIndex];
-                continue;
-            case ireturn:
-            case _return:
+#ifdef USE_COMPUTED_GOTO
+        unsigned int op = ip->opCode;
+#else
+        unsigned int op = ip->dispatchOp;
+    dispatch:
+#endif
+        switch (op){
+            //要入栈的值在预解码时已经计算好，包括常量池中的整数、decimal和字符串
+            TARGET(iconst_0):
+            TARGET(iconst_1):
+            TARGET(iconst_2):
+            TARGET(iconst_3):
+            TARGET(iconst_4):
+            TARGET(iconst_5):
+            TARGET(bipush):
+            TARGET(sipush):
+            TARGET(ldc):
+            TARGET(sldc):
+            TARGET(dconst_0):
+            TARGET(dconst_1):
+            TARGET(ldc2_w):
+                PUSH(ip->value); 
+                NEXT();
+            TARGET(iload):
+                PUSH(locals[ip->operand]);
+                NEXT();
+            TARGET(iload_0):
+                PUSH(locals[0]);
+                NEXT();
+            TARGET(iload_1):
+                PUSH(locals[1]);
+                NEXT();
+            TARGET(iload_2):
+                PUSH(locals[2]);
+                NEXT();
+            TARGET(iload_3):
+                PUSH(locals[3]);
+                NEXT();
+            TARGET(istore):
+                locals[ip->operand] = tos;
+                tos = *sp--;
+                NEXT();
+            TARGET(istore_0):
+                locals[0] = tos;
+                tos = *sp--;
+                NEXT();
+            TARGET(istore_1):
+                locals[1] = tos;
+                tos = *sp--;
+                NEXT();
+            TARGET(istore_2):
+                locals[2] = tos;
+                tos = *sp--;
+                NEXT();
+            TARGET(istore_3):
+                locals[3] = tos;
+                tos = *sp--;
+                NEXT();
+            TARGET(pop):
+                tos = *sp--;
+                NEXT();
+            //算术运算：两个操作数都是integer时直接计算，否则交给rt/value.c中的慢速路径
+            TARGET(iadd):
+                vleft = *sp--;
+                tos = BOTH_INT(vleft, tos) ? INT_VALUE((uint32_t)vleft + (uint32_t)tos) : value_add(vleft, tos);
+                NEXT();
+            TARGET(sadd):
+                vleft = *sp--;
+                tos = value_concat(vleft, tos);
+                NEXT();
+            TARGET(isub):
+                vleft = *sp--;
+                tos = BOTH_INT(vleft, tos) ? INT_VALUE((uint32_t)vleft - (uint32_t)tos) : value_sub(vleft, tos);
+                NEXT();
+            TARGET(imul):
+                vleft = *sp--;
+                tos = BOTH_INT(vleft, tos) ? INT_VALUE((uint32_t)vleft * (uint32_t)tos) : value_mul(vleft, tos);
+                NEXT();
+            TARGET(idiv):
+                vleft = *sp--;
+                if (!BOTH_INT(vleft, tos)){
+                    tos = value_div(vleft, tos);
+                }
+                else if (DIVISION_FAILS(AS_INT(vleft), AS_INT(tos))){
+                    reportDivisionError(frame->functionSym, AS_INT(tos));
+                    return -EXIT_RUNTIME_ERROR;
+                }
+                else{
+                    tos = INT_VALUE(AS_INT(vleft) / AS_INT(tos));
+                }
+                NEXT();
+
+            //decimal运算。操作数都是decimal时直接计算，否则（比如没有经过i2d的integer）走慢速路径
+            TARGET(dadd):
+                vleft = *sp--;
+                tos = BOTH_DECIMAL(vleft, tos) ? DECIMAL_VALUE(AS_DECIMAL(vleft) + AS_DECIMAL(tos)) : value_dadd(vleft, tos);
+                NEXT();
+            TARGET(dsub):
+                vleft = *sp--;
+                tos = BOTH_DECIMAL(vleft, tos) ? DECIMAL_VALUE(AS_DECIMAL(vleft) - AS_DECIMAL(tos)) : value_dsub(vleft, tos);
+                NEXT();
+            TARGET(dmul):
+                vleft = *sp--;
+                tos = BOTH_DECIMAL(vleft, tos) ? DECIMAL_VALUE(AS_DECIMAL(vleft) * AS_DECIMAL(tos)) : value_dmul(vleft, tos);
+                NEXT();
+            TARGET(ddiv):
+                vleft = *sp--;
+                tos = BOTH_DECIMAL(vleft, tos) ? DECIMAL_VALUE(AS_DECIMAL(vleft) / AS_DECIMAL(tos)) : value_ddiv(vleft, tos);
+                NEXT();
+            TARGET(dcmpl):
+                vleft = *sp--;
+                tos = BOTH_DECIMAL(vleft, tos) ? INT_VALUE(decimal_compare(AS_DECIMAL(vleft), AS_DECIMAL(tos), -1)) 
+                                               : value_dcmp(vleft, tos, -1);
+                NEXT();
+            TARGET(dcmpg):
+                vleft = *sp--;
+                tos = BOTH_DECIMAL(vleft, tos) ? INT_VALUE(decimal_compare(AS_DECIMAL(vleft), AS_DECIMAL(tos), 1)) 
+                                               : value_dcmp(vleft, tos, 1);
+                NEXT();
+            TARGET(i2d):
+                tos = IS_INT(tos) ? DECIMAL_VALUE((double)AS_INT(tos)) : value_i2d(tos);
+                NEXT();
+            TARGET(d2i):
+                tos = IS_DECIMAL(tos) ? INT_VALUE(decimal_to_int(AS_DECIMAL(tos))) : value_d2i(tos);
+                NEXT();
+
+            TARGET(lcmp):
+                vleft = *sp--;
+                tos = BOTH_INT(vleft, tos) ? INT_VALUE((AS_INT(vleft) > AS_INT(tos)) - (AS_INT(vleft) < AS_INT(tos)))
+                                           : value_lcmp(vleft, tos);
+                NEXT();
+            TARGET(iinc):
+                vleft = locals[ip->operand];
+                locals[ip->operand] = IS_INT(vleft) ? INT_VALUE((uint32_t)vleft + ip->operand2) 
+                                                    : value_add(vleft, INT_VALUE(ip->operand2));
+                NEXT();
+            TARGET(ireturn):
+                CHECK_FRAME();
+
                 //确定返回值
-                if(opCode == ireturn){
-                    retValue = popFromOpStack(frame);
+                retValue = tos;
+
+                //弹出栈桢，返回到上一级函数，继续执行
+                lastFrame = frame;
+                frame = frame->prev;
+                deleteStackFrame(lastFrame);
+
+                if (lastFrame == entryFrame){ //最外层的函数返回，结束运行
+                    topFrame = frame;
+                    *result = retValue;
+                    return 1;
                 }
 
+                //返回值成为上一级栈桢的新栈顶
+                sp = frame->sp;
+                tos = retValue;
+                locals = frame->localVars;
+                //指令指针设置为返回地址，也就是调用该函数的下一条指令
+                ip = frame->returnAddress;
+                DISPATCH();
+            TARGET(_return):
+                CHECK_FRAME();
+
                 //弹出栈桢，返回到上一级函数，继续执行
                 lastFrame = frame;
                 frame = frame->prev;
                 deleteStackFrame(lastFrame);
 
-                if (frame == NULL){ //主程序返回，结束运行
+                if (lastFrame == entryFrame){ //最外层的函数返回，结束运行
+                    topFrame = frame;
                     return 0;
                 }
-                else{ //返回到上一级调用者
-                    //设置返回值到上一级栈桢
-                    if(opCode == ireturn){
-                        pushToOpStack(frame,retValue);
-                    }    
-                    //设置新的code、codeIndex和oPCode
-                    if (frame->byteCode !=NULL){
-                        //切换到调用者的代码
-                        code = frame->byteCode;
-                        //设置指令指针为返回地址，也就是调用该函数的下一条指令
-                        codeIndex = frame->returnIndex;
-                        opCode = code[codeIndex];
-                        continue;
+
+                LOAD_FRAME();
+                ip = frame->returnAddress;
+                DISPATCH();
+            TARGET(invokestatic):
+                CHECK_FRAME();
+                SAFEPOINT();
+
+                //被调用的函数在预解码时已经从常量池中找出
+                functionSym = ip->callee;
+
+                //内置函数：在加载时已绑定了C语言实现，参数就在操作数栈上
+                if(functionSym->native != NULL){
+                    //把栈顶写回内存，参数就是内存中最上面的numParams个元素
+                    *++sp = tos;
+                    sp -= functionSym->numParams;
+                    if (functionSym->native(functionSym->numParams, sp + 1, &retValue)){
+                        tos = retValue;  //返回值成为新的栈顶
                     }
                     else{
-                        printf("Can not find code for function '%s'.", ((Symbol*)functionSym)->name);
-                        return -1;
+                        tos = *sp--;
                     }
+                    NEXT();
                 }
-                continue;
-            case invokestatic:
-                //从常量池找到被调用的函数
-                byte1 = code[++codeIndex];
-                byte2 = code[++codeIndex];
-                FunctionConst* functionConst = (FunctionConst*)bcModule->consts[byte1<<8|byte2];
-                functionSym = functionConst->functionSym;
-
-                //对于内置函数特殊处理
-                if(strcmp(((Symbol*)functionSym)->name,"println")==0){
-                    //取出一个参数
-                    VM_NUMBER param = popFromOpStack(frame);
-                    opCode = code[++codeIndex];
-                    // printf("%s\n", ((PlayString*)param)->data);
-                    printf("%d\n", param);   //打印显示
-                }
-                else if(strcmp(((Symbol*)functionSym)->name,"tick")==0){
-                    opCode = code[++codeIndex];
-                    VM_NUMBER tick = clock();
-                    // printf("tick: %d\n",tick);
-                    pushToOpStack(frame,tick);
-                }
-                // else if(strcmp(((Symbol*)functionSym)->name,"integer_to_string")==0){
-                //     opCode = code[++codeIndex];
-                //     VM_NUMBER numValue = popFromOpStack(frame);
-                //     PlayString * pstr = integer_to_string((int)numValue);
-                //     pushToOpStack(frame,(VM_NUMBER)pstr);
-                // }
                 else{
-                    //设置返回值地址，为函数调用的下一条指令
-                    frame->returnIndex = codeIndex + 1;
+                    if (functionSym->state != FunctionReady){  //第一次调用，这时才加载
+                        output_flush();
+                        if (prepareFunction(functionSym) != 0){
+                            return -EXIT_BAD_FILE;
+                        }
+                    }
 
-                    //创建新的栈桢
-                    lastFrame = frame;
-                    frame = createStackFrame(functionSym);
-                    frame->prev = lastFrame;
+                    //把栈顶写回内存，这时参数就是内存中最上面的numParams个元素
+                    *++sp = tos;
+                    sp -= functionSym->numParams;
 
-                    //传递参数
-                    int paramCount = ((FunctionType*)((Symbol*)functionSym)->theType)->numParams;
-                    for(int i = paramCount -1; i>= 0; i--){
-                        frame->localVars[i] = popFromOpStack(lastFrame);
+#ifdef USE_JIT
+                    //热点函数：编译成机器码，以后直接调用机器码
+                    if (functionSym->jitCode == NULL && functionSym->callCount >= 0 
+                        && ++functionSym->callCount >= JIT_THRESHOLD){
+                        compileFunction(functionSym);
                     }
-
-                    //设置新的code、codeIndex和oPCode
-                    if (frame->byteCode !=NULL){
-                        //切换到被调用函数的代码
-                        code = frame->byteCode;
-                        //代码指针归零
-                        codeIndex = 0;
-                        opCode = code[codeIndex];
-                        continue;
+                    if (functionSym->jitCode != NULL){
+                        //JIT函数把自己的栈桢接在当前栈桢后面
+                        frame->sp = sp;
+                        topFrame = frame;
+                        JitResult jitResult = functionSym->jitCode(sp + 1, functionSym);
+                        if (jitResult.hasValue){
+                            tos = jitResult.value;
+                        }
+                        else{
+                            tos = *sp--;
+                        }
+                        NEXT();
                     }
-                    else{
-                        printf("Can not find code for function '%s'.", ((Symbol*)functionSym)->name);
-                        return -1;
+#endif
+
+                    //保存当前栈桢的状态。返回地址为函数调用的下一条指令
+                    frame->sp = sp;
+                    frame->returnAddress = ip + 1;
+
+                    //创建新的栈桢，参数就在sp之上
+                    lastFrame = frame;
+                    frame = createStackFrame(functionSym, sp + 1);
+                    if (frame == NULL){
+                        output_flush();
+                        fprintf(stderr, "Stack overflow in function '%s'.\n", ((Symbol*)functionSym)->name);
+                        return -EXIT_STACK_OVERFLOW;
                     }
+                    frame->prev = lastFrame;
+
+                    //切换到被调用函数的第一条指令
+                    LOAD_FRAME();
+                    ip = functionSym->code;
+                    DISPATCH();
                 }
-                continue;
-            case ifeq:
-                byte1 = code[++codeIndex];
-                byte2 = code[++codeIndex];
-                if(popFromOpStack(frame) == 0){
-                    codeIndex = byte1<<8|byte2;
-                    opCode = code[codeIndex];
-                }
-                else{
-                    opCode = code[++codeIndex];
-                }
-                continue; 
-            case ifne:
-                byte1 = code[++codeIndex];
-                byte2 = code[++codeIndex];
-                if(popFromOpStack(frame) != 0){
-                    codeIndex = byte1<<8|byte2;
-                    opCode = code[codeIndex];
-                }
-                else{
-                    opCode = code[++codeIndex];
-                }
-                continue; 
-            case if_icmplt:
-                byte1 = code[++codeIndex];
-                byte2 = code[++codeIndex];
-                vright = popFromOpStack(frame);
-                vleft = popFromOpStack(frame);
-                if(vleft < vright){
-                    codeIndex = byte1<<8|byte2;
-                    opCode = code[codeIndex];
-                }
-                else{
-                    opCode = code[++codeIndex];
-                }
-                continue; 
-            case if_icmpge:
-                byte1 = code[++codeIndex];
-                byte2 = code[++codeIndex];
-                vright = popFromOpStack(frame);
-                vleft = popFromOpStack(frame);
-                if(vleft >= vright){
-                    codeIndex = byte1<<8|byte2;
-                    opCode = code[codeIndex];
+            TARGET(invoketail):
+                CHECK_FRAME();
+                SAFEPOINT();
+
+                //尾调用：被调用函数的栈桢替换当前栈桢，它返回时直接回到当前函数的调用者
+                functionSym = ip->callee;
+                if (functionSym->state != FunctionReady){  //第一次调用，这时才加载
+                    output_flush();
+                    if (prepareFunction(functionSym) != 0){
+                        return -EXIT_BAD_FILE;
+                    }
                 }
-                else{
-                    opCode = code[++codeIndex];
+
+                //把栈顶写回内存，这时参数就是内存中最上面的numParams个元素
+                *++sp = tos;
+                sp -= functionSym->numParams;
+
+                lastFrame = frame;
+                frame = replaceStackFrame(frame, functionSym, sp + 1);
+                if (frame == NULL){
+                    output_flush();
+                    fprintf(stderr, "Stack overflow in function '%s'.\n", ((Symbol*)functionSym)->name);
+                    return -EXIT_STACK_OVERFLOW;
                 }
-                continue; 
-            case if_icmpgt:
-                byte1 = code[++codeIndex];
-                byte2 = code[++codeIndex];
-                vright = popFromOpStack(frame);
-                vleft = popFromOpStack(frame);
-                if(vleft > vright){
-                    codeIndex = byte1<<8|byte2;
-                    opCode = code[codeIndex];
+                if (lastFrame == entryFrame){
+                    entryFrame = frame;
                 }
-                else{
-                    opCode = code[++codeIndex];
-                }
-                continue; 
-            case if_icmple:
-                byte1 = code[++codeIndex];
-                byte2 = code[++codeIndex];
-                vright = popFromOpStack(frame);
-                vleft = popFromOpStack(frame);
-                if(vleft <= vright){
-                    codeIndex = byte1<<8|byte2;
-                    opCode = code[codeIndex];
+
+                LOAD_FRAME();
+                ip = functionSym->code;
+                DISPATCH();
+            TARGET(ifeq):
+                vleft = tos;
+                tos = *sp--;
+                if(vleft == INT_VALUE(0) || (!IS_INT(vleft) && !value_is_true(vleft))){
+                    ip = ip->target;
+                    DISPATCH();
                 }
-                else{
-                    opCode = code[++codeIndex];
+                NEXT(); 
+            TARGET(ifne):
+                vleft = tos;
+                tos = *sp--;
+                if(vleft != INT_VALUE(0) && (IS_INT(vleft) || value_is_true(vleft))){
+                    ip = ip->target;
+                    DISPATCH();
                 }
-                continue; 
-            case _goto:
-                byte1 = code[++codeIndex];
-                byte2 = code[++codeIndex];
-                codeIndex = byte1<<8|byte2;
-                opCode = code[codeIndex];
-                continue;    
+                NEXT(); 
+            //与0比较并跳转，通常跟在dcmpl、dcmpg后面
+            TARGET(iflt):
+                vleft = tos;
+                tos = *sp--;
+                COMPARE_AND_JUMP(IS_INT(vleft), vleft, INT_VALUE(0), <, CMP_LT);
+            TARGET(ifge):
+                vleft = tos;
+                tos = *sp--;
+                COMPARE_AND_JUMP(IS_INT(vleft), vleft, INT_VALUE(0), >=, CMP_GE);
+            TARGET(ifgt):
+                vleft = tos;
+                tos = *sp--;
+                COMPARE_AND_JUMP(IS_INT(vleft), vleft, INT_VALUE(0), >, CMP_GT);
+            TARGET(ifle):
+                vleft = tos;
+                tos = *sp--;
+                COMPARE_AND_JUMP(IS_INT(vleft), vleft, INT_VALUE(0), <=, CMP_LE);
+            TARGET(if_icmpeq):
+                vright = tos;
+                vleft = *sp--;
+                tos = *sp--;
+                COMPARE_AND_JUMP(BOTH_INT(vleft, vright), vleft, vright, ==, CMP_EQ);
+            TARGET(if_icmpne):
+                vright = tos;
+                vleft = *sp--;
+                tos = *sp--;
+                COMPARE_AND_JUMP(BOTH_INT(vleft, vright), vleft, vright, !=, CMP_NE);
+            TARGET(if_icmplt):
+                vright = tos;
+                vleft = *sp--;
+                tos = *sp--;
+                COMPARE_AND_JUMP(BOTH_INT(vleft, vright), vleft, vright, <, CMP_LT);
+            TARGET(if_icmpge):
+                vright = tos;
+                vleft = *sp--;
+                tos = *sp--;
+                COMPARE_AND_JUMP(BOTH_INT(vleft, vright), vleft, vright, >=, CMP_GE);
+            TARGET(if_icmpgt):
+                vright = tos;
+                vleft = *sp--;
+                tos = *sp--;
+                COMPARE_AND_JUMP(BOTH_INT(vleft, vright), vleft, vright, >, CMP_GT);
+            TARGET(if_icmple):
+                vright = tos;
+                vleft = *sp--;
+                tos = *sp--;
+                COMPARE_AND_JUMP(BOTH_INT(vleft, vright), vleft, vright, <=, CMP_LE);
+            TARGET(_goto):
+                SAFEPOINT();
+                ip = ip->target;
+                DISPATCH();    
+
+            //超级指令：操作数都是本地变量和立即数，不需要经过操作数栈
+            TARGET(isub_lc):
+                vleft = locals[ip->operand];
+                PUSH(IS_INT(vleft) ? INT_VALUE((uint32_t)vleft - ip->operand2) : value_sub(vleft, INT_VALUE(ip->operand2)));
+                NEXT();
+            TARGET(if_icmpeq_lc):
+                vleft = locals[ip->operand];
+                COMPARE_AND_JUMP(IS_INT(vleft), vleft, INT_VALUE(ip->operand2), ==, CMP_EQ);
+            TARGET(if_icmpne_lc):
+                vleft = locals[ip->operand];
+                COMPARE_AND_JUMP(IS_INT(vleft), vleft, INT_VALUE(ip->operand2), !=, CMP_NE);
+            TARGET(if_icmplt_lc):
+                vleft = locals[ip->operand];
+                COMPARE_AND_JUMP(IS_INT(vleft), vleft, INT_VALUE(ip->operand2), <, CMP_LT);
+            TARGET(if_icmpge_lc):
+                vleft = locals[ip->operand];
+                COMPARE_AND_JUMP(IS_INT(vleft), vleft, INT_VALUE(ip->operand2), >=, CMP_GE);
+            TARGET(if_icmpgt_lc):
+                vleft = locals[ip->operand];
+                COMPARE_AND_JUMP(IS_INT(vleft), vleft, INT_VALUE(ip->operand2), >, CMP_GT);
+            TARGET(if_icmple_lc):
+                vleft = locals[ip->operand];
+                COMPARE_AND_JUMP(IS_INT(vleft), vleft, INT_VALUE(ip->operand2), <=, CMP_LE);
+            TARGET(iadd_ll_st):
+                vleft = locals[ip->operand];
+                vright = locals[ip->operand2];
+                locals[ip->operand3] = BOTH_INT(vleft, vright) ? INT_VALUE((uint32_t)vleft + (uint32_t)vright) 
+                                                               : value_add(vleft, vright);
+                NEXT();
+            TARGET(iinc_goto):
+                SAFEPOINT();
+                vleft = locals[ip->operand];
+                locals[ip->operand] = IS_INT(vleft) ? INT_VALUE((uint32_t)vleft + ip->operand2) 
+                                                    : value_add(vleft, INT_VALUE(ip->operand2));
+                ip = ip->target;
+                DISPATCH();
+
+#ifndef USE_COMPUTED_GOTO
+            //性能剖析：先记录，再按真正的操作码分派
+            case PROFILE_SLOT:
+                profileInstruction(frame->functionSym, ip, STACK_DEPTH());
+                op = ip->opCode;
+                goto dispatch;
+#endif
 
-            default:
-                printf("Unknown op code: %x.", opCode);
-                return -2;
+            TARGET_DEFAULT:
+                output_flush();
+                fprintf(stderr, "Unknown op code: %x.\n", ip->opCode);
+                return -EXIT_RUNTIME_ERROR;
         }
     }
 
+#ifdef USE_COMPUTED_GOTO
+    //性能剖析：先记录，再跳到这条指令真正的处理程序
+L_profile:
+    profileInstruction(frame->functionSym, ip, STACK_DEPTH());
+    goto *dispatchTable[ip->opCode];
+#endif
+
 }
 
 
-OprandStack* createOprandStack(int maxOpStackSize){
-    OprandStack* stack = (OprandStack*)malloc(sizeof(OprandStack));
-    stack->top = -1;  //空栈时为-1
-    stack->data = (VM_NUMBER *)malloc(maxOpStackSize*sizeof(VM_NUMBER));
-    return stack;
+///////////////////////////////////////////////////////////////
+//栈桢管理
+
+#ifdef DEBUG_FRAMES
+//写在每个StackFrame头部的标记值，被改写说明栈桢被破坏了
+#define FRAME_CANARY 0x5AFEF00Du
+
+//栈桢内存的统计信息
+typedef struct _FrameStats{
+    size_t numFrames;   //创建过的栈桢数量
+    size_t bytesInUse;  //当前占用的字节数
+    size_t peakBytes;   //占用字节数的峰值
+    int numBlocks;      //申请过的内存块数量
+}FrameStats;
+
+static FrameStats frameStats;
+#endif
+
+#ifdef USE_VM_STACK
+//虚拟机栈：预先分配好的一整块连续内存，所有栈桢依次排列在其中。
+//每个栈桢的布局：本地变量 | StackFrame（按指针大小对齐） | 哨兵 | 操作数栈。
+//调用函数时，调用者操作数栈顶部的参数就地成为被调用者的前几个本地变量，不需要复制；
+//返回时，被调用者的栈桢自然就被丢弃了。所以函数调用只是移动一下指针。
+typedef struct _VMStack{
+    Value* base;       //栈底
+    unsigned char* limit;  //栈的上界，栈桢不能超过这个位置
+}VMStack;
+
+static VMStack vmStack;
+
+//向上对齐到指针的大小
+#define ALIGN_TO_POINTER(p) ((void*)(((size_t)(p) + sizeof(void*) - 1) & ~(sizeof(void*) - 1)))
+
+void initVMStack(size_t size){
+    vmStack.base = (Value*)malloc(size);
+    vmStack.limit = (unsigned char*)vmStack.base + size;
+#ifdef DEBUG_FRAMES
+    frameStats.numBlocks = 1;
+#endif
 }
 
-void deleteOprandStack(OprandStack* stack){
-    free(stack->data);
-    free(stack);
+void deleteVMStack(){
+    free(vmStack.base);
 }
 
+//栈桢中哨兵的位置，操作数栈从它的下一个位置开始
+#define FRAME_SENTINEL(frame) ((Value*)((frame) + 1))
+
+#else
+#ifdef USE_ARENA
 void* allocFromArena(size_t size);
-void returnToArena();
+void returnToArena(void* mem);
+#endif
 
-StackFrame * createStackFrame(FunctionSymbol* functionSym){
+#define FRAME_SENTINEL(frame) ((frame)->localVars + (frame)->functionSym->numVars)
+#endif
+
+StackFrame * createStackFrame(FunctionSymbol* functionSym, Value* args){
     StackFrame * frame;
+#ifdef USE_VM_STACK
+    //参数所在的位置就是本地变量的起点；main函数从栈底开始
+    Value* localVars = args != NULL ? args : vmStack.base;
+    if ((unsigned char*)localVars + functionSym->frameSize > vmStack.limit){
+        return NULL;  //栈溢出
+    }
+    frame = (StackFrame*)ALIGN_TO_POINTER(localVars + functionSym->numVars);
+    frame->localVars = localVars;
+    frame->sp = (Value*)(frame + 1);  //空栈时指向哨兵位置
+
+#ifdef DEBUG_FRAMES
+    frameStats.bytesInUse = (unsigned char*)localVars + functionSym->frameSize - (unsigned char*)vmStack.base;
+    if (frameStats.bytesInUse > frameStats.peakBytes){
+        frameStats.peakBytes = frameStats.bytesInUse;
+    }
+#endif
+
+#else
 #ifdef USE_ARENA
-    //一次性获得一个栈桢所需的整块内存，并调整相关数据结构中的指针
+    //一次性获得一个栈桢所需的整块内存：StackFrame | 本地变量 | 哨兵 | 操作数栈
     frame = (StackFrame*)allocFromArena(functionSym->frameSize);
-    frame->localVars = (VM_NUMBER*)(frame + sizeof(StackFrame));
-    frame->oprandStack = (OprandStack*)(frame->localVars + functionSym->numVars*sizeof(VM_NUMBER));
-    frame->oprandStack->data = (VM_NUMBER*)(frame->oprandStack + sizeof(OprandStack));
-    
+    frame->localVars = (Value*)(frame + 1);
 #else
-    //常规的内存分配方式，会分成4小块内存，做4次malloc调用
+    //常规的内存分配方式：StackFrame一块，本地变量和操作数栈一块
     frame = (StackFrame *)malloc(sizeof(StackFrame));
-    if (functionSym->numVars == 0){
-        frame->localVars=NULL;
+    frame->localVars = (Value*)malloc((functionSym->numVars + functionSym->opStackSize + 1)*sizeof(Value));
+#ifdef DEBUG_FRAMES
+    frameStats.numBlocks += 2;
+    frameStats.bytesInUse += functionSym->frameSize;
+    if (frameStats.bytesInUse > frameStats.peakBytes){
+        frameStats.peakBytes = frameStats.bytesInUse;
     }
-    else{
-        frame->localVars = (VM_NUMBER*)malloc((functionSym->numVars)*sizeof(VM_NUMBER));
+#endif
+#endif
+    frame->sp = frame->localVars + functionSym->numVars;  //空栈时指向哨兵位置
+
+    //传递参数
+    if (args != NULL){
+        memcpy(frame->localVars, args, functionSym->numParams*sizeof(Value));
     }
-    frame->oprandStack = createOprandStack(functionSym->opStackSize);
-       
 #endif
 
-    frame->byteCode = functionSym->byteCode;
-    frame->returnIndex = 0;
+    //参数以外的本地变量初始化为null，这样栈桢中的每个位置都是合法的Value
+    for (int i = functionSym->numParams; i < functionSym->numVars; i++){
+        frame->localVars[i] = NULL_VALUE;
+    }
+
+    frame->functionSym = functionSym;
+    frame->returnAddress = NULL;
     frame->prev = NULL;
+#ifdef DEBUG_FRAMES
+    frame->canary = FRAME_CANARY;
+    frameStats.numFrames++;
+#endif
     return frame;
 }
 
 void deleteStackFrame(StackFrame* frame){
-#ifdef USE_ARENA
-    returnToArena();
+#ifdef DEBUG_FRAMES
+    checkFrame(frame, FRAME_SENTINEL(frame));
+    frame->canary = 0;  //已经删除的栈桢不能再使用
+#endif
+#if defined(USE_VM_STACK)
+    //不需要做什么：上一级栈桢的栈顶以上的内存，下次调用时直接复用
+    (void)frame;
+#elif defined(USE_ARENA)
+    returnToArena(frame);
 #else
-    if (frame->localVars)
-        free(frame->localVars);
-    deleteOprandStack(frame->oprandStack);
+#ifdef DEBUG_FRAMES
+    frameStats.bytesInUse -= frame->functionSym->frameSize;
+#endif
+    free(frame->localVars);
     free(frame);
 #endif    
 }
 
-void pushToOpStack(StackFrame* frame, VM_NUMBER value){
-    frame->oprandStack->data[++(frame->oprandStack->top)] = value;
-    // if (frame->oprandStack->top < frame->functionSym->opStackSize){
-    //     frame->oprandStack->data[++(frame->oprandStack->top)] = value;
-    // }
-    // else{
-    //     printf("Error in pushToOpStack, not enough opstack space.\n");
-    // }
+StackFrame * replaceStackFrame(StackFrame* frame, FunctionSymbol* functionSym, Value* args){
+    StackFrame* prev = frame->prev;
+    int numParams = functionSym->numParams;
+#ifdef USE_VM_STACK
+    //参数挪到当前栈桢的本地变量处，在原地建立新栈桢。参数总是在本地变量的上方，可以用memmove
+    Value* localVars = frame->localVars;
+    memmove(localVars, args, numParams*sizeof(Value));
+    frame = createStackFrame(functionSym, localVars);
+#else
+    if (frame->functionSym == functionSym){
+        //自身递归，栈桢的布局不变，直接覆盖本地变量并清空操作数栈
+        memmove(frame->localVars, args, numParams*sizeof(Value));
+        frame->sp = FRAME_SENTINEL(frame);
+        frame->returnAddress = NULL;
+        return frame;
+    }
+    //参数在旧栈桢里，删除旧栈桢之前先保存起来
+    Value savedArgs[numParams > 0 ? numParams : 1];
+    memcpy(savedArgs, args, numParams*sizeof(Value));
+    deleteStackFrame(frame);
+    frame = createStackFrame(functionSym, savedArgs);
+#endif
+    if (frame != NULL){
+        frame->prev = prev;
+    }
+    return frame;
 }
 
-VM_NUMBER popFromOpStack(StackFrame* frame){
-    return frame->oprandStack->data[(frame->oprandStack->top)--];
-    // if (frame->oprandStack->top >=0){
-    //     return frame->oprandStack->data[(frame->oprandStack->top)--];
-    // }
-    // else{
-    //     printf("Error in popFromOpStack, nothing to pop.\n");
-    //     return 0;
-    // }
+#ifdef DEBUG_FRAMES
+//检查栈桢是否完好：头部的canary没有被改写，栈顶top没有越出操作数栈的范围
+void checkFrame(StackFrame* frame, Value* top){
+    FunctionSymbol* functionSym = frame->functionSym;
+    if (frame->canary != FRAME_CANARY){
+        output_flush();
+        fprintf(stderr, "Stack frame at %p is corrupted.\n", (void*)frame);
+        abort();
+    }
+    Value* sentinel = FRAME_SENTINEL(frame);
+    if (top < sentinel || top > sentinel + functionSym->opStackSize){
+        output_flush();
+        fprintf(stderr, "Operand stack of function '%s' out of bounds: depth %d, opStackSize %d.\n", 
+            ((Symbol*)functionSym)->name, (int)(top - sentinel), functionSym->opStackSize);
+        abort();
+    }
+}
+
+void dumpFrameStats(){
+    fprintf(stderr, "栈桢：创建%zu个，内存峰值%zu字节，内存块%d个\n", 
+        frameStats.numFrames, frameStats.peakBytes, frameStats.numBlocks);
+}
+#endif
+
+void pushToOpStack(StackFrame* frame, Value value){
+    *++(frame->sp) = value;
+}
+
+Value popFromOpStack(StackFrame* frame){
+    return *(frame->sp)--;
+}
+
+///////////////////////////////////////////////////////////////////////
+//垃圾收集的根
+
+//标记所有的根：驻留的字符串（包括模块中的字符串常量），以及栈桢链上每个栈桢的本地变量和操作数栈。
+//收集只在安全点进行，这时每个栈桢的sp都已经写回，sp以上的位置都是无效的，不需要扫描。
+static void markRoots(){
+    //字符串常量都是驻留的
+    string_mark_interned();
+
+    for (StackFrame* frame = topFrame; frame != NULL; frame = frame->prev){
+        Value* localVars = frame->localVars;
+        for (int i = 0; i < frame->functionSym->numVars; i++){
+            gc_mark_value(localVars[i]);
+        }
+        for (Value* p = FRAME_SENTINEL(frame) + 1; p <= frame->sp; p++){
+            gc_mark_value(*p);
+        }
+    }
 }
 
 ///////////////////////////////////////////////////////////////////////
@@ -461,9 +922,7 @@ SimpleType * createSimpleType(char* typeName, int numUpperTypes, Type** upperTyp
 }
 
 void deleteSimpleType(SimpleType* simpleType){
-    if(!simpleType->upperTypes){
-        free(simpleType->upperTypes);
-    }
+    free(simpleType->upperTypes);
     free(simpleType);
 }
 
@@ -480,6 +939,7 @@ void dumpFunctionType(Type * t){
 
 FunctionType * createFunctionType(char* typeName, Type* returnType, int numParams, Type** paramTypes){
     FunctionType* functionType = (FunctionType*)malloc(sizeof(FunctionType));
+    functionType->returnType = returnType;
     functionType->numParams = numParams;
     functionType->paramTypes= paramTypes;
     
@@ -491,9 +951,7 @@ FunctionType * createFunctionType(char* typeName, Type* returnType, int numParam
 }
 
 void deleteFunctionType(FunctionType* functionType){
-    if(!functionType->paramTypes){
-        free(functionType->paramTypes);
-    }
+    free(functionType->paramTypes);
     free(functionType);
 }
 
@@ -521,9 +979,7 @@ UnionType * createUnionType(char* typeName, int numTypes, Type** types){
 }
 
 void deleteUnionType(UnionType* unionType){
-    if(!unionType->types){
-        free(unionType->types);
-    }
+    free(unionType->types);
     free(unionType);
 }
 
@@ -561,16 +1017,11 @@ static SysTypes sysTypes;
 ///////////////////////////////////////////////////////////////////
 //Symbol
 
-VarSymbol* createVarSymbol(char* varName, Type* varType){
-    VarSymbol * varSymbol = (VarSymbol*)malloc(sizeof(VarSymbol));
+//本地变量都存放在FunctionSymbol的vars数组中，不单独分配内存
+void initVarSymbol(VarSymbol* varSymbol, char* varName, Type* varType){
     ((Symbol*)varSymbol)->name = varName;
     ((Symbol*)varSymbol)->kind = VariableSym;
     ((Symbol*)varSymbol)->theType = varType;
-    return varSymbol;
-}
-
-void deleteVarSymbol(VarSymbol* varSymbol){
-    free(varSymbol);
 }
 
 void dumpVarSymbol(VarSymbol* varSymbol){
@@ -578,30 +1029,53 @@ void dumpVarSymbol(VarSymbol* varSymbol){
     printf("VarSymbol: %s, type: %s\n", sym->name, sym->theType->name);
 }
 
-FunctionSymbol* createFunctionSymbol(char* functionName, FunctionType* functionType,
-                 int numVars, VarSymbol** vars, int opStackSize, 
+//设置函数记录中的信息，并据此计算栈桢的大小。按需加载的函数在读取函数记录时才调用
+static void setFunctionRecord(FunctionSymbol* functionSym, char* functionName, FunctionType* functionType,
+                 int numVars, VarSymbol* vars, int opStackSize, 
                  int numByteCodes, unsigned char* byteCode){
-    FunctionSymbol* functionSym = (FunctionSymbol*)malloc(sizeof(FunctionSymbol));
     Symbol* sym = (Symbol*)functionSym;
     sym->name = functionName;
     sym->theType = (Type*)functionType;
-    sym->kind = FunctionSym;
+    functionSym->numParams = functionType != NULL ? functionType->numParams : 0;
     functionSym->numVars = numVars;
     functionSym->vars = vars;
     functionSym->opStackSize = opStackSize;
     functionSym->numByteCodes = numByteCodes;
     functionSym->byteCode = byteCode;
 
-    #ifdef USE_ARENA
-    functionSym->frameSize = sizeof(StackFrame) + sizeof(VM_NUMBER)* functionSym->numVars + sizeof(OprandStack) + sizeof(VM_NUMBER)* functionSym->opStackSize;
+    //栈桢的大小：本地变量、StackFrame、哨兵和操作数栈，虚拟机栈中还要加上对齐可能浪费的空间
+    functionSym->frameSize = sizeof(StackFrame) + sizeof(Value)* (functionSym->numVars + functionSym->opStackSize + 1);
+    #ifdef USE_VM_STACK
+    functionSym->frameSize += sizeof(void*) - 1;
+    #endif
+}
+
+FunctionSymbol* createFunctionSymbol(char* functionName, FunctionType* functionType,
+                 int numVars, VarSymbol* vars, int opStackSize, 
+                 int numByteCodes, unsigned char* byteCode){
+    FunctionSymbol* functionSym = (FunctionSymbol*)malloc(sizeof(FunctionSymbol));
+    ((Symbol*)functionSym)->kind = FunctionSym;
+    setFunctionRecord(functionSym, functionName, functionType, numVars, vars, opStackSize, numByteCodes, byteCode);
+    functionSym->numInstructions = 0;
+    functionSym->code = NULL;
+    functionSym->native = NULL;
+    functionSym->state = FunctionReady;
+    functionSym->reader = NULL;
+    functionSym->recordOffset = 0;
+    functionSym->returnKinds = -1;
+    functionSym->profile = NULL;
+    #ifdef USE_JIT
+    functionSym->callCount = profiling ? -1 : 0;  //性能剖析时不做JIT编译，所有指令都要经过解释器
+    functionSym->jitCode = NULL;
     #endif
 
     return functionSym;
 }
 
 void deleteFunctionSymbol(FunctionSymbol* functionSym){
+    //byteCode指向字节码文件的映像，随映像一起释放
     free(functionSym->vars);
-    free(functionSym->byteCode);
+    free(functionSym->code);
     free(functionSym);
 }
 
@@ -613,7 +1087,7 @@ void dumpFunctionSymbol(FunctionSymbol* functionSym){
         printf("  Local Vars:\n  ");
         for (int i = 0; i < functionSym->numVars; i++){
             printf("  ");
-            dumpVarSymbol(functionSym->vars[i]);
+            dumpVarSymbol(&functionSym->vars[i]);
         }
     }
     if (functionSym->byteCode !=NULL){
@@ -640,18 +1114,24 @@ void deleteNumberConst(NumberConst* numberConst){
         free(numberConst);
 }
 
+DecimalConst* createDecimalConst(double value){
+    DecimalConst* decimalConst = (DecimalConst*)malloc(sizeof(DecimalConst));
+    ((Const*)decimalConst)->kind = DecimalC;
+    decimalConst->value = value;
+    return decimalConst;
+}
+
 StringConst* createStringConst(char* value){
     StringConst* stringConst = (StringConst*)malloc(sizeof(StringConst));
     ((Const*)stringConst)->kind = StringC;
     stringConst->value = value;
+    stringConst->string = string_intern(value, strlen(value));
     return stringConst;
 }
 
 void deleteStringConst(StringConst* stringConst){
+    //value指向字节码文件的映像，随映像一起释放；string是驻留的，可能被别的常量共用，由垃圾收集器释放
     if (stringConst != NULL){
-        if (stringConst->value != NULL)
-            free(stringConst->value);
-        
         free(stringConst);
     }
 }
@@ -679,27 +1159,71 @@ BCModule * createBCModule(int numConsts, Const ** consts, FunctionSymbol * _main
     bcModule->_main = _main;
     bcModule->numTypes = numTypes;
     bcModule->types = types;
+    bcModule->image.data = NULL;
+    bcModule->image.size = 0;
+    bcModule->image.mapped = 0;
+    bcModule->reader = NULL;
     return bcModule;
 }
 
+static void deleteBCReader(struct _BCReader* reader);
+
+//释放常量。函数常量连同函数一起释放；系统函数的类型不在模块的类型数组中，也在这里释放。
+//字符串常量的value在字节码文件的映像中，由映像的所有者释放。数组中没有填写的项为NULL
+static void deleteConsts(Const** consts, int numConsts){
+    for (int i = 0; i < numConsts; i++){
+        if (consts[i] == NULL){
+            continue;
+        }
+        if (consts[i]->kind == FunctionC){
+            FunctionSymbol* functionSym = ((FunctionConst*)consts[i])->functionSym;
+            if (i < SYS_FUNS){
+                deleteFunctionType((FunctionType*)((Symbol*)functionSym)->theType);
+            }
+            deleteFunctionConst((FunctionConst*)consts[i]);
+        }
+        else if (consts[i]->kind == StringC){
+            deleteStringConst((StringConst*)consts[i]);
+        }
+        else{
+            free(consts[i]);
+        }
+    }
+    free(consts);
+}
+
+//释放类型，连同它们引用的类型数组。UnionType的kind也是SimpleT，用dump区分
+static void deleteTypes(Type** types, int numTypes){
+    for (int i = 0; i < numTypes; i++){
+        Type* t = types[i];
+        if (t == NULL){
+            continue;
+        }
+        if (t->kind == FunctionT){
+            deleteFunctionType((FunctionType*)t);
+        }
+        else if (t->dump == dumpUnionType){
+            deleteUnionType((UnionType*)t);
+        }
+        else{
+            deleteSimpleType((SimpleType*)t);
+        }
+    }
+    free(types);
+}
+
 void deleteBCModule(BCModule * bcModule){
     if (bcModule != NULL){
         if (bcModule->consts != NULL){
-            for (int i = 0; i < bcModule->numConsts; i++){
-                if (bcModule->consts[i]!=NULL){
-                    free(bcModule->consts[i]);
-                }
-            }
-            free(bcModule->consts);
+            deleteConsts(bcModule->consts, bcModule->numConsts);
         }
         if (bcModule->types != NULL){
-            for (int i = 0; i< bcModule->numTypes; i++){
-                if(bcModule->types[i]!=NULL){
-                    free(bcModule->types[i]);
-                }
-            }
-            free(bcModule->types); 
+            deleteTypes(bcModule->types, bcModule->numTypes);
+        }
+        if (bcModule->reader != NULL){
+            deleteBCReader(bcModule->reader);
         }
+        closeBCFile(&bcModule->image);
         free(bcModule);
     }
 }
@@ -722,10 +1246,16 @@ void dumpBCModule(BCModule * bcModule){
             StringConst * stringConst = (StringConst *)bcModule->consts[i];
             printf("%d. String: %s\n", i+1, stringConst->value);
         }
+        else if (bcModule->consts[i]->kind == DecimalC){
+            DecimalConst * decimalConst = (DecimalConst *)bcModule->consts[i];
+            printf("%d. Decimal: %.17g\n", i+1, decimalConst->value);
+        }
         else if (bcModule->consts[i]->kind == FunctionC){
             FunctionConst * functionConst = (FunctionConst *)bcModule->consts[i];
             printf("%d. Function:\n",i+1);
-            dumpFunctionSymbol(functionConst->functionSym);
+            if (loadFunction(functionConst->functionSym) == 0){  //还没有调用过的函数，这时才读取
+                dumpFunctionSymbol(functionConst->functionSym);
+            }
         }
         else{
             printf("Unsupported const kind: %d.\n", bcModule->consts[i]->kind);
@@ -734,284 +1264,511 @@ void dumpBCModule(BCModule * bcModule){
 }
 
 ////////////////////////////////////////////////////////////////////////
-//读取字节码
+//预解码
+//把函数的字节码翻译成Instruction数组，在加载模块时完成。
+
+//每个操作码所占的字节数（包括操作码本身）。为0的是未定义的操作码，加载时报错。
+static const unsigned char opLengths[256] = {
+    [iconst_0] = 1, [iconst_1] = 1, [iconst_2] = 1, [iconst_3] = 1, [iconst_4] = 1, [iconst_5] = 1,
+    [bipush] = 2, [sipush] = 3, [ldc] = 2, [sldc] = 2,
+    [iload] = 2, [iload_0] = 1, [iload_1] = 1, [iload_2] = 1, [iload_3] = 1,
+    [istore] = 2, [istore_0] = 1, [istore_1] = 1, [istore_2] = 1, [istore_3] = 1, [pop] = 1,
+    [iadd] = 1, [sadd] = 1, [isub] = 1, [imul] = 1, [idiv] = 1, [iinc] = 3, [lcmp] = 1,
+    [ifeq] = 3, [ifne] = 3, [iflt] = 3, [ifge] = 3, [ifgt] = 3, [ifle] = 3,
+    [if_icmpeq] = 3, [if_icmpne] = 3, [if_icmplt] = 3, [if_icmpge] = 3, [if_icmpgt] = 3, [if_icmple] = 3,
+    [_goto] = 3, [ireturn] = 1, [_return] = 1, [invokestatic] = 3,
+    [isub_lc] = 3, [if_icmpeq_lc] = 5, [if_icmpne_lc] = 5, [if_icmplt_lc] = 5, [if_icmpge_lc] = 5,
+    [if_icmpgt_lc] = 5, [if_icmple_lc] = 5, [iadd_ll_st] = 4, [iinc_goto] = 5,
+    [invoketail] = 3, [ldc_w] = 3, [sldc_w] = 3,
+    [dconst_0] = 1, [dconst_1] = 1, [ldc2_w] = 3,
+    [dadd] = 1, [dsub] = 1, [dmul] = 1, [ddiv] = 1, [i2d] = 1, [d2i] = 1, [dcmpl] = 1, [dcmpg] = 1,
+};
 
-//从字节码中读取一个字符串
-char* readString(unsigned char* bc, int* index){
-    int len = bc[(*index)++];
-    char* str = (char*)malloc((len+1)*sizeof(char));
-    for (int i = 0; i< len; i++){
-        str[i] = bc[(*index)++];
+/**
+ * 把函数的字节码翻译成预解码的指令数组，保存在functionSym->code中。
+ * 在代码的末尾会附加一条_return指令，这样执行到代码末尾、或者跳转到代码末尾时，都会正常返回。
+ * 由于函数之间可能前向引用，需要在所有常量都读取完毕之后再调用。
+ * 返回值：0表示成功，-1表示字节码有错误。
+ */
+int decodeFunction(FunctionSymbol* functionSym, int numConsts, Const** consts){
+#ifdef USE_COMPUTED_GOTO
+    if (handlerTable == NULL){
+        executeFunction(NULL, NULL, NULL);  //获取分派表
     }
-    str[len]=0;
-    // printf("readString: %s\n",str);
-    return str;
-}
+#endif
 
-//存放临时的类型信息的结构，此时类型间的引用关系尚未建立
-typedef struct _SimpleTypeInfo{
-    int numUpperTypes;
-    char** upperTypes;
-}SimpleTypeInfo;
+    char* name = ((Symbol*)functionSym)->name;
+    unsigned char* bc = functionSym->byteCode;
+    int numByteCodes = functionSym->numByteCodes;
 
-SimpleTypeInfo * createSimpleTypeInfo(int numUpperTypes, char** upperTypes){
-    SimpleTypeInfo * typeInfo = (SimpleTypeInfo *)malloc(sizeof(SimpleTypeInfo));
-    typeInfo->upperTypes = upperTypes;
-    typeInfo->numUpperTypes = numUpperTypes;
-    return typeInfo;
-}
+    //第一遍：找出每条指令的边界，建立字节码位置到指令下标的映射
+    int* indexMap = (int*)malloc((numByteCodes+1)*sizeof(int));
+    for (int i = 0; i <= numByteCodes; i++){
+        indexMap[i] = -1;
+    }
+    int numInstructions = 0;
+    int pos = 0;
+    while (pos < numByteCodes){
+        indexMap[pos] = numInstructions++;
+        int len = opLengths[bc[pos]];
+        if (len == 0){
+            fprintf(stderr, "Unknown op code %x at %d in function '%s'.\n", bc[pos], pos, name);
+            free(indexMap);
+            return -1;
+        }
+        pos += len;
+    }
+    if (pos > numByteCodes){
+        fprintf(stderr, "Truncated instruction at the end of function '%s'.\n", name);
+        free(indexMap);
+        return -1;
+    }
+    indexMap[numByteCodes] = numInstructions++;  //末尾附加的_return指令
+
+    //第二遍：解码每条指令
+    Instruction* code = (Instruction*)malloc(numInstructions*sizeof(Instruction));
+    Instruction* instr = code;
+    pos = 0;
+    while (pos < numByteCodes){
+        unsigned char opCode = bc[pos];
+        int constIndex;
+        int target;
+        int len;
+
+        instr->opCode = opCode;
+        instr->operand = 0;
+        instr->operand2 = 0;
+        instr->target = NULL;
 
-void deleteSimpleTypeInfo(SimpleTypeInfo * typeInfo){
-    free(typeInfo->upperTypes);
-    free(typeInfo);
-}
+        switch (opCode){
+            case iconst_0: case iconst_1: case iconst_2: case iconst_3: case iconst_4: case iconst_5:
+                instr->value = INT_VALUE(opCode - iconst_0);
+                break;
+            case bipush:
+                instr->operand = (signed char)bc[pos+1];
+                instr->value = INT_VALUE(instr->operand);
+                break;
+            case sipush:
+                instr->operand = (short)(bc[pos+1]<<8|bc[pos+2]);
+                instr->value = INT_VALUE(instr->operand);
+                break;
+            case ldc:
+            case ldc_w:
+                constIndex = opCode == ldc ? bc[pos+1] : bc[pos+1]<<8|bc[pos+2];
+                instr->opCode = ldc;
+                if (constIndex >= numConsts || consts[constIndex]->kind != NumberC){
+                    fprintf(stderr, "Invalid number constant %d in function '%s'.\n", constIndex, name);
+                    free(indexMap);
+                    free(code);
+                    return -1;
+                }
+                instr->operand = ((NumberConst*)consts[constIndex])->value;
+                instr->value = INT_VALUE(instr->operand);
+                break;
+            case dconst_0: case dconst_1:
+                instr->value = DECIMAL_VALUE(opCode - dconst_0);
+                break;
+            case ldc2_w:
+                constIndex = bc[pos+1]<<8|bc[pos+2];
+                if (constIndex >= numConsts || consts[constIndex]->kind != DecimalC){
+                    fprintf(stderr, "Invalid decimal constant %d in function '%s'.\n", constIndex, name);
+                    free(indexMap);
+                    free(code);
+                    return -1;
+                }
+                instr->operand = constIndex;
+                instr->value = DECIMAL_VALUE(((DecimalConst*)consts[constIndex])->value);
+                break;
+            case sldc:
+            case sldc_w:
+                constIndex = opCode == sldc ? bc[pos+1] : bc[pos+1]<<8|bc[pos+2];
+                instr->opCode = sldc;
+                if (constIndex >= numConsts || consts[constIndex]->kind != StringC){
+                    fprintf(stderr, "Invalid string constant %d in function '%s'.\n", constIndex, name);
+                    free(indexMap);
+                    free(code);
+                    return -1;
+                }
+                instr->operand = constIndex;
+                instr->value = OBJECT_VALUE(((StringConst*)consts[constIndex])->string);
+                break;
+            case iload:
+            case istore:
+                instr->operand = bc[pos+1];
+                break;
+            case iinc:
+            case isub_lc:
+                instr->operand = bc[pos+1];
+                instr->operand2 = (signed char)bc[pos+2];
+                break;
+            case iadd_ll_st:
+                instr->operand = bc[pos+1];
+                instr->operand2 = bc[pos+2];
+                instr->operand3 = bc[pos+3];
+                break;
+            case invokestatic:
+                constIndex = bc[pos+1]<<8|bc[pos+2];
+                if (constIndex >= numConsts || consts[constIndex]->kind != FunctionC){
+                    fprintf(stderr, "Invalid function constant %d in function '%s'.\n", constIndex, name);
+                    free(indexMap);
+                    free(code);
+                    return -1;
+                }
+                instr->operand = constIndex;
+                instr->callee = ((FunctionConst*)consts[constIndex])->functionSym;
+                break;
+            case invoketail:  //内置函数没有栈桢，不能尾调用
+                constIndex = bc[pos+1]<<8|bc[pos+2];
+                if (constIndex >= numConsts || consts[constIndex]->kind != FunctionC
+                    || ((FunctionConst*)consts[constIndex])->functionSym->native != NULL){
+                    fprintf(stderr, "Invalid tail call to constant %d in function '%s'.\n", constIndex, name);
+                    free(indexMap);
+                    free(code);
+                    return -1;
+                }
+                instr->operand = constIndex;
+                instr->callee = ((FunctionConst*)consts[constIndex])->functionSym;
+                break;
+            case ifeq: case ifne: case iflt: case ifge: case ifgt: case ifle:
+            case if_icmpeq: case if_icmpne: case if_icmplt: case if_icmpge: case if_icmpgt: case if_icmple:
+            case _goto:
+            case if_icmpeq_lc: case if_icmpne_lc: case if_icmplt_lc: case if_icmpge_lc: case if_icmpgt_lc: case if_icmple_lc:
+            case iinc_goto:
+                //跳转地址总是在指令的最后两个字节；超级指令在前面还有本地变量下标和立即数
+                len = opLengths[opCode];
+                if (len == 5){
+                    instr->operand = bc[pos+1];
+                    instr->operand2 = (signed char)bc[pos+2];
+                }
+                target = bc[pos+len-2]<<8|bc[pos+len-1];
+                if (target > numByteCodes || indexMap[target] < 0){
+                    fprintf(stderr, "Invalid jump target %d in function '%s'.\n", target, name);
+                    free(indexMap);
+                    free(code);
+                    return -1;
+                }
+                instr->target = code + indexMap[target];
+                break;
+            default:
+                break;
+        }
+
+#ifdef USE_COMPUTED_GOTO
+        instr->handler = profiling ? handlerTable[PROFILE_SLOT] : handlerTable[instr->opCode];
+#else
+        instr->dispatchOp = profiling ? PROFILE_SLOT : instr->opCode;
+#endif
+        pos += opLengths[opCode];
+        instr++;
+    }
 
-typedef struct _FunctionTypeInfo{
-    char* returnType;
-    int numParams;
-    char** paramTypes;
-}FunctionTypeInfo;
+    //末尾附加的_return指令
+    instr->opCode = _return;
+    instr->operand = 0;
+    instr->operand2 = 0;
+    instr->target = NULL;
+#ifdef USE_COMPUTED_GOTO
+    instr->handler = profiling ? handlerTable[PROFILE_SLOT] : handlerTable[_return];
+#else
+    instr->dispatchOp = profiling ? PROFILE_SLOT : _return;
+#endif
 
-FunctionTypeInfo * createFuntionTypeInfo(char* returnType, int numParams, char** paramTypes){
-    FunctionTypeInfo * typeInfo = (FunctionTypeInfo *)malloc(sizeof(FunctionTypeInfo));
-    typeInfo->returnType = returnType;
-    typeInfo->numParams = numParams;
-    typeInfo->paramTypes = paramTypes;
-    return typeInfo;
-}
+    free(indexMap);
 
-void deleteFunctionTypeInfo(FunctionTypeInfo * typeInfo){
-    free(typeInfo->paramTypes);
-    free(typeInfo);
+    functionSym->numInstructions = numInstructions;
+    functionSym->code = code;
+    return 0;
 }
 
-typedef struct _UnionTypeInfo{
-    int numTypes;
-    char** types;
-}UnionTypeInfo;
+////////////////////////////////////////////////////////////////////////
+//读取字节码
 
-UnionTypeInfo* createUnionTypeInfo(int numTypes, char** unionTypes){
-    UnionTypeInfo * typeInfo = (UnionTypeInfo *)malloc(sizeof(UnionTypeInfo));
-    typeInfo->types = unionTypes;
-    typeInfo->numTypes = numTypes;
-    return typeInfo;
+/**
+ * 字节码文件的格式（版本2），与TypeScript版本的BCModuleWriter一致（packages/ts-vm/src/vm.ts）。
+ * 文件头8个字节：魔数"PLBC"、版本号、节的数量和2个保留字节。之后是节表，每一项9个字节：
+ * 节的编号、节在文件中的偏移量和长度（各4个字节，低位在前）。节里的整数都是LEB128编码的varint。
+ *   字符串表：字符串数量，每个字符串是UTF-8的字节数、字节和一个结尾的0。名称都用字符串表中的下标表示
+ *   类型：类型数量，每个类型是类别、名称和所引用的类型。类型的引用是下标，前SYS_TYPES个是内置类型，
+ *         被引用的类型总是排在前面
+ *   常量：常量数量，每个常量是类别和值。函数常量的值是函数在函数节中的下标
+ *   函数：函数数量、main函数的下标（没有main时等于函数数量）、每个函数记录在本节中的偏移量（各4个字节，
+ *         低位在前），然后是函数记录：名称、类型、操作数栈大小、本地变量、字节码在代码节中的偏移量和长度
+ *   代码：所有函数的字节码，首尾相接
+ *
+ * 加载时字符串表、类型和常量都只读一遍，每个函数只创建一个桩，记下函数记录的位置。函数第一次执行之前
+ * 才读取它的记录、预解码并校验（见prepareFunction()），从不执行的函数就省掉了这些工作。
+ * */
+#define BC_MAGIC "PLBC"
+#define BC_VERSION 2
+#define BC_HEADER_SIZE 8
+#define BC_SECTION_ENTRY_SIZE 9
+
+typedef enum _BCSectionId{BC_STRINGS = 1, BC_TYPES, BC_CONSTS, BC_FUNCTIONS, BC_CODE, BC_MAX_SECTION = BC_CODE} BCSectionId;
+
+//读取字节码的状态。越界或者引用了不存在的字符串、类型时，把error置为1并返回0或NULL，
+//由调用者在读完一个节以后统一检查，所以读取每个值时不需要检查返回值。
+//加载完以后仍然保留在BCModule中，按需加载函数时用它读取函数记录。
+typedef struct _BCReader{
+    unsigned char* bc;
+    size_t pos;           //当前读取的位置
+    size_t end;           //当前节的末尾
+    int error;
+
+    size_t sectionOffsets[BC_MAX_SECTION + 1];
+    size_t sectionSizes[BC_MAX_SECTION + 1];
+
+    int numStrings;
+    char** strings;       //字符串表，直接指向映像中以0结尾的字符串
+    int numTypes;
+    Type** types;         //内置类型加上类型节中的类型
+    int numConsts;
+    Const** consts;       //预解码时查找常量
+}BCReader;
+
+//把读取的位置移到一个节的开头
+static void seekSection(BCReader* reader, BCSectionId id){
+    reader->pos = reader->sectionOffsets[id];
+    reader->end = reader->sectionOffsets[id] + reader->sectionSizes[id];
 }
 
-void deleteUnionTypeInfo(UnionTypeInfo * typeInfo){
-    free(typeInfo->types);
-    free(typeInfo);
+static unsigned char readByte(BCReader* reader){
+    if (reader->pos >= reader->end){
+        reader->error = 1;
+        return 0;
+    }
+    return reader->bc[reader->pos++];
 }
 
-//从字节码中读取一个SimpleType
-void readSimpleType(unsigned char* bc, int* index, int typeIndex, char** typeNames, Type** types, void** typeInfos){
-    char* typeName = readString(bc, index);
-    int numUpperTypes = bc[(*index)++];
-    char** upperTypes = (char**)malloc(numUpperTypes*sizeof(char*));
-    for (int i = 0; i < numUpperTypes; i++){
-        upperTypes[i] = readString(bc, index);
+//读取无符号的LEB128：每个字节存7位，低位在前，最高位为1表示后面还有字节
+static uint32_t readVarint(BCReader* reader){
+    uint32_t value = 0;
+    for (int shift = 0; shift < 35; shift += 7){
+        unsigned char b = readByte(reader);
+        value |= (uint32_t)(b & 0x7f) << shift;
+        if ((b & 0x80) == 0){
+            return value;
+        }
     }
-
-    SimpleType* simpleType = createSimpleType(typeName, numUpperTypes, NULL);
-    typeNames[typeIndex] = typeName;
-    types[typeIndex] = (Type*)simpleType;
-
-    SimpleTypeInfo * typeInfo = createSimpleTypeInfo(numUpperTypes, upperTypes);
-    typeInfos[typeIndex-SYS_TYPES] = typeInfo;
+    reader->error = 1;
+    return 0;
 }
 
-
-//从字节码中读取一个FunctionType
-void readFunctionType(unsigned char* bc, int* index, int typeIndex, char** typeNames, Type** types, void** typeInfos){
-    char* typeName = readString(bc, index);
-    char* returnType = readString(bc, index);
-    int numParams = bc[(*index)++];
-    char** paramTypes = (char**)malloc(numParams*sizeof(char*));
-    for (int i = 0; i < numParams; i++){
-        paramTypes[i] = readString(bc, index);
+//读取有符号的LEB128：最后一个字节的第6位是符号位
+static int32_t readSignedVarint(BCReader* reader){
+    uint32_t value = 0;
+    int shift = 0;
+    unsigned char b;
+    do{
+        if (shift >= 35){
+            reader->error = 1;
+            return 0;
+        }
+        b = readByte(reader);
+        value |= (uint32_t)(b & 0x7f) << shift;
+        shift += 7;
+    } while (b & 0x80);
+    if (shift < 32 && (b & 0x40)){
+        value |= ~0u << shift;
     }
+    return (int32_t)value;
+}
 
-    FunctionType* functionType = createFunctionType(typeName, NULL, numParams, NULL);   
-    typeNames[typeIndex] = typeName;
-    types[typeIndex] = (Type*)functionType;
+//读取一个varint，要求它小于limit，比如数组的下标或元素个数
+static int readIndex(BCReader* reader, int limit){
+    uint32_t value = readVarint(reader);
+    if (value >= (uint32_t)limit){
+        reader->error = 1;
+        return 0;
+    }
+    return (int)value;
+}
 
-    FunctionTypeInfo * typeInfo = createFuntionTypeInfo(returnType, numParams, paramTypes);
-    typeInfos[typeIndex-SYS_TYPES] = typeInfo;
+//读取元素的个数。每个元素至少占一个字节，所以个数不会超过当前节中剩下的字节数
+static int readCount(BCReader* reader){
+    return readIndex(reader, reader->end - reader->pos + 1);
 }
 
-//从字节码中读取一个UnionType
-void readUnionType(unsigned char* bc, int* index, int typeIndex, char** typeNames, Type** types, void** typeInfos){
-    char* typeName = readString(bc, index);
-    int numTypes = bc[(*index)++];
-    char** unionTypes = (char**)malloc(numTypes*sizeof(char*));
-    for (int i = 0; i < numTypes; i++){
-        unionTypes[i] = readString(bc, index);
+//读取对字符串表的引用
+static char* readString(BCReader* reader){
+    if (reader->numStrings == 0){
+        reader->error = 1;
+        return "";
     }
+    return reader->strings[readIndex(reader, reader->numStrings)];
+}
 
-    UnionType* unionType = createUnionType(typeName, numTypes, NULL);
-    typeNames[typeIndex] = typeName;
-    types[typeIndex] = (Type*)unionType;
+//读取对类型的引用
+static Type* readType(BCReader* reader){
+    return reader->types[readIndex(reader, reader->numTypes)];
+}
 
-    UnionTypeInfo * typeInfo = createUnionTypeInfo(numTypes, unionTypes);
-    typeInfos[typeIndex-SYS_TYPES] = typeInfo;
+//添加系统内置类型。顺序是字节码格式的一部分，类型的引用据此得到内置类型
+void addSystemTypes(Type** types){
+    int index = 0;
+    types[index++] = (Type *)sysTypes.Any;
+    types[index++] = (Type *)sysTypes.Number;
+    types[index++] = (Type *)sysTypes.String;
+    types[index++] = (Type *)sysTypes.Boolean;
+    types[index++] = (Type *)sysTypes.Null;
+    types[index++] = (Type *)sysTypes.Undefined;
+    types[index++] = (Type *)sysTypes.Integer;
+    types[index++] = (Type *)sysTypes.Decimal;
+    types[index++] = (Type *)sysTypes.Void;
 }
 
-//查找名称为typeName的Type
-Type* getType(char* typeName, int numTypes, char** typeNames, Type** types){
-    for (int i = 0; i< numTypes; i++){
-        if (strcmp(typeName, typeNames[i]) == 0){
-            return types[i];
+//读取字符串表。字符串不复制，直接使用映像中的内存，随映像一起释放
+static int readStrings(BCReader* reader){
+    seekSection(reader, BC_STRINGS);
+    reader->numStrings = readCount(reader);
+    reader->strings = (char**)malloc(reader->numStrings * sizeof(char*));
+    for (int i = 0; i < reader->numStrings && !reader->error; i++){
+        size_t len = readVarint(reader);
+        if (len >= reader->end - reader->pos || reader->bc[reader->pos + len] != 0){
+            reader->error = 1;
+            break;
         }
+        reader->strings[i] = (char*)(reader->bc + reader->pos);
+        reader->pos += len + 1;
     }
-    
-    return NULL;
+    return reader->error ? -1 : 0;
 }
 
 /**
- * 生成类型，并建立类型之间正确的引用关系。
- * 完成任务后，释放掉所有的TypeInfo数据所占的内存。
- */
-void buildTypes(int numTypes, char** typeNames, Type** types, void** typeInfos){
-    for (int i = 0; i< numTypes-SYS_TYPES; i++){
-        Type* t = types[i+SYS_TYPES];
-        if (t->kind == SimpleT){
-            SimpleType* simpleType = (SimpleType*)t;
-            SimpleTypeInfo* typeInfo = (SimpleTypeInfo*)typeInfos[i];
-            simpleType->upperTypes = (Type**)malloc(typeInfo->numUpperTypes*sizeof(Type*));
-            for (int j = 0; j < typeInfo->numUpperTypes; j++){
-                simpleType->upperTypes[j] = getType(typeInfo->upperTypes[j], numTypes+SYS_TYPES, typeNames, types);
-            }
-            deleteSimpleTypeInfo(typeInfo);
-        }
-        else if (t->kind == FunctionT){
-            FunctionType* funtionType = (FunctionType*) t;
-            FunctionTypeInfo* typeInfo = (FunctionTypeInfo*)typeInfos[i];
-            funtionType->returnType = getType(typeInfo->returnType, numTypes+SYS_TYPES, typeNames, types);
-            funtionType->paramTypes = (Type**)malloc(typeInfo->numParams*sizeof(Type*));
-            for (int j = 0; j < typeInfo->numParams; j++){
-                funtionType->paramTypes[j] = getType(typeInfo->paramTypes[j], numTypes+SYS_TYPES, typeNames, types);
-            }
-            deleteFunctionTypeInfo(typeInfo);
-        }
-        else if (t->kind == UnionT){
-            UnionType* unionType = (UnionType*)t;
-            UnionTypeInfo* typeInfo = (UnionTypeInfo*)typeInfos[i];
-            unionType->types = (Type**)malloc(typeInfo->numTypes*sizeof(Type*));
-            for (int j = 0; j < typeInfo->numTypes; j++){
-                unionType->types[j] = getType(typeInfo->types[j], numTypes+SYS_TYPES, typeNames, types);
-            }
-            deleteUnionTypeInfo(typeInfo);
+ * 读取类型。每个类型只引用内置类型和它前面的类型，所以读一遍就能建立类型之间的引用关系。
+ * 类型的数组直接按照文件中的数量分配，不需要临时的数据结构。
+ * */
+static int readTypes(BCReader* reader){
+    seekSection(reader, BC_TYPES);
+    int numTypes = readCount(reader);
+    reader->numTypes = numTypes + SYS_TYPES;
+    reader->types = (Type**)calloc(reader->numTypes, sizeof(Type*));
+    addSystemTypes(reader->types);
+
+    for (int i = SYS_TYPES; i < reader->numTypes && !reader->error; i++){
+        int typeKind = readByte(reader);
+        char* typeName = readString(reader);
+        Type* returnType = typeKind == 2 ? reader->types[readIndex(reader, i)] : NULL;
+        int num = readCount(reader);  //父类型、参数类型或者联合的各个类型
+        Type** refs = (Type**)malloc(num * sizeof(Type*));
+        for (int j = 0; j < num; j++){
+            refs[j] = reader->types[readIndex(reader, i)];
         }
-        else{
-            printf("Unsupported type when building types.");
+        switch(typeKind){
+            case 1:
+                reader->types[i] = (Type*)createSimpleType(typeName, num, refs);
+                break;
+            case 2:
+                reader->types[i] = (Type*)createFunctionType(typeName, returnType, num, refs);
+                break;
+            case 3:
+                reader->types[i] = (Type*)createUnionType(typeName, num, refs);
+                break;
+            default:
+                fprintf(stderr, "Unsupported type kind: %d\n", typeKind);
+                free(refs);
+                reader->error = 1;
         }
     }
-
-    //释放内存
-    free(typeInfos);
+    return reader->error ? -1 : 0;
 }
 
-//从字节码中读取一个VarSymbol
-VarSymbol* readVarSymbol(unsigned char* bc, int* index, int numTypes, char** typeNames, Type** types){
-    //变量名称
-    char* varName = readString(bc, index);
-
-    //类型名称
-    char* typeName = readString(bc, index);
-    Type* varType = getType(typeName, numTypes, typeNames, types);
-
-    VarSymbol * varSymbol = createVarSymbol(varName, varType);
-
-    free(typeName); //释放内存
-    
-    return varSymbol;
-}
-
-//从字节码中读取一个FunctionSymbol
-FunctionSymbol* readFunctionSymbol(unsigned char* bc, int* index, int numTypes, 
-                                   char** typeNames, Type** types){
-    //函数名称
-    char* functionName = readString(bc, index);
-
-    //读取类型名称
-    char* typeName = readString(bc, index);
-    FunctionType* functionType = (FunctionType*)getType(typeName, numTypes, typeNames, types);
-    
-    //操作数栈的大小
-    int opStackSize = bc[(*index)++];
-
-    //todo 调试用
-    opStackSize = 20;
+//读取一个函数记录，填写到函数的桩中
+static void readFunctionRecord(BCReader* reader, FunctionSymbol* functionSym){
+    //函数名称和类型
+    char* functionName = readString(reader);
+    Type* functionType = readType(reader);
+    if (functionType->kind != FunctionT){
+        reader->error = 1;
+    }
 
-    //变量个数
-    int numVars = bc[(*index)++];
+    //操作数栈的大小，由校验器证明不会超出
+    int opStackSize = readIndex(reader, 0x10000);
 
-    //读取变量
-    VarSymbol** vars = (VarSymbol**)malloc(numVars * sizeof(VarSymbol*));
+    //读取变量，所有变量放在一个数组中
+    int numVars = readCount(reader);
+    VarSymbol* vars = (VarSymbol*)malloc(numVars * sizeof(VarSymbol));
     for (int i = 0; i < numVars; i++){
-        vars[i] = readVarSymbol(bc, index, numTypes, typeNames, types);
+        char* varName = readString(reader);
+        initVarSymbol(&vars[i], varName, readType(reader));
     }
 
-    //读取函数体的字节码
-    int numByteCodes = bc[(*index)++];
-    unsigned char* byteCode;
-    if (numByteCodes == 0){  //系统函数
-        byteCode = NULL;
+    //函数体的字节码，直接指向字节码文件的映像
+    size_t codeSize = reader->sectionSizes[BC_CODE];
+    size_t codeOffset = readVarint(reader);
+    int numByteCodes = readVarint(reader);
+    unsigned char* byteCode = NULL;  //函数体为空时没有字节码，预解码后只有附加的_return
+    if (codeOffset > codeSize || (size_t)numByteCodes > codeSize - codeOffset){
+        reader->error = 1;
     }
-    else{
-        byteCode = (unsigned char*)malloc(numByteCodes*sizeof(unsigned char));
-        memcpy(byteCode,bc + *index,numByteCodes*sizeof(unsigned char));
-        (*index) += numByteCodes;
+    else if (numByteCodes != 0){
+        byteCode = reader->bc + reader->sectionOffsets[BC_CODE] + codeOffset;
     }
 
-    //创建函数符号
-    FunctionSymbol* functionSym = createFunctionSymbol(functionName, functionType,
-                 numVars, vars, opStackSize, numByteCodes,  byteCode);
-
-    free(typeName); //注意释放内存
-
-    return functionSym;
+    if (reader->error){
+        free(vars);
+        return;
+    }
+    setFunctionRecord(functionSym, functionName, (FunctionType*)functionType,
+                 numVars, vars, opStackSize, numByteCodes, byteCode);
 }
 
-//添加系统内置类型
-void addSystemTypes(char** typeNames, Type** types){
-    int index = 0;
-    typeNames[index] = "any";
-    types[index++] = (Type *)sysTypes.Any;
-
-    typeNames[index] = "number";
-    types[index++] = (Type *)sysTypes.Number;
-
-    typeNames[index] = "string";
-    types[index++] = (Type *)sysTypes.String;
+int loadFunction(FunctionSymbol* functionSym){
+    if (functionSym->state != FunctionStub){
+        return 0;
+    }
 
-    typeNames[index] = "boolean";
-    types[index++] = (Type *)sysTypes.Boolean;
-   
-    typeNames[index] = "null";
-    types[index++] = (Type *)sysTypes.Null;
+    //记录的长度由其中的内容决定，读取的范围是从记录的开头到函数节的末尾
+    BCReader* reader = functionSym->reader;
+    seekSection(reader, BC_FUNCTIONS);
+    reader->pos = functionSym->recordOffset;
+    reader->error = 0;
+    readFunctionRecord(reader, functionSym);
+    if (reader->error){
+        fprintf(stderr, "Malformed function record at offset %zu in bytecode file.\n", functionSym->recordOffset);
+        return -1;
+    }
 
-    typeNames[index] = "undefined";
-    types[index++] = (Type *)sysTypes.Undefined;
+    //函数体为空时也要预解码，得到末尾附加的_return
+    if (decodeFunction(functionSym, reader->numConsts, reader->consts) != 0){
+        return -1;
+    }
+    functionSym->state = FunctionLoaded;
+    return 0;
+}
 
-    typeNames[index] = "integer";
-    types[index++] = (Type *)sysTypes.Integer;
+int prepareFunction(FunctionSymbol* functionSym){
+    if (functionSym->state == FunctionReady){
+        return 0;
+    }
+    if (loadFunction(functionSym) != 0){
+        return -1;
+    }
 
-    typeNames[index] = "decimal";
-    types[index++] = (Type *)sysTypes.Decimal;
+    //校验通过以后，运行时不再检查操作数栈和本地变量的边界
+    if (verifyFunction(functionSym) != 0){
+        return -1;
+    }
+    functionSym->state = FunctionReady;
+    return 0;
+}
 
-    typeNames[index] = "void";
-    types[index++] = (Type *)sysTypes.Void;
+//类型归BCModule所有，常量也是。这里只释放字符串表
+static void deleteBCReader(BCReader* reader){
+    free(reader->strings);
+    free(reader);
 }
 
 //添加系统内置函数
+//内置函数在这里绑定各自的C语言实现（见rt/sysfuncs.c），invokestatic据此直接调用，不需要在运行时比较函数名称。
 void addSystemFunctions(Const** consts){
     //1.println函数
     Type** paramTypes = (Type**)malloc(sizeof(Type*));
     paramTypes[0] = (Type*)sysTypes.Integer;
     FunctionType * functionType =  createFunctionType("@println", (Type*)sysTypes.Void, 1, paramTypes);
-    VarSymbol ** vars = (VarSymbol**)malloc(sizeof(VarSymbol*));
-    vars[0] = createVarSymbol("a", (Type*)sysTypes.Integer);
+    VarSymbol* vars = (VarSymbol*)malloc(sizeof(VarSymbol));
+    initVarSymbol(&vars[0], "a", (Type*)sysTypes.Integer);
     FunctionSymbol* println = createFunctionSymbol("println", functionType, 1, vars, 10, 0, NULL);
+    println->native = native_println;
 
     //加入常数区
     FunctionConst* functionConst = createFunctionConst(println);
@@ -1020,6 +1777,7 @@ void addSystemFunctions(Const** consts){
     //2.tick函数
     functionType =  createFunctionType("@tick", (Type*)sysTypes.Integer, 0, NULL);
     FunctionSymbol* tick = createFunctionSymbol("tick", functionType, 0, NULL, 10, 0, NULL);
+    tick->native = native_tick;
 
     //加入常数区
     functionConst = createFunctionConst(tick);
@@ -1029,9 +1787,10 @@ void addSystemFunctions(Const** consts){
     paramTypes = (Type**)malloc(sizeof(Type*));
     paramTypes[0] = (Type*)sysTypes.Integer;
     functionType =  createFunctionType("@integer_to_string", (Type*)sysTypes.String, 1, paramTypes);
-    vars = (VarSymbol**)malloc(sizeof(VarSymbol*));
-    vars[0] = createVarSymbol("num", (Type*)sysTypes.Integer);
+    vars = (VarSymbol*)malloc(sizeof(VarSymbol));
+    initVarSymbol(&vars[0], "num", (Type*)sysTypes.Integer);
     FunctionSymbol* integer_to_string = createFunctionSymbol("integer_to_string", functionType, 1, vars, 10, 0, NULL);
+    integer_to_string->native = native_integer_to_string;
 
     //加入常数区
     functionConst = createFunctionConst(integer_to_string);
@@ -1039,117 +1798,204 @@ void addSystemFunctions(Const** consts){
 
 }
 
-//从字节码中读取一个BCModule
+//从字节码中读取一个BCModule。文件的格式有错误时，打印原因并返回NULL。
+//函数只创建桩，第一次执行之前才读取、预解码和校验，所以函数中的错误要到那时才会发现
 BCModule* readBCModule(unsigned char* bc, size_t size){
-    //当前读取的位置
-    int bcIndex = 0;
-    int *index = &bcIndex;
-
-    //读取类型
-    char* str = readString(bc, index); //读取”types“字符串
-    // printf("%s\n",strTypes);
-
-    int numTypes = bc[(*index)++];
-    char** typeNames = (char**)malloc((numTypes+ SYS_TYPES)*sizeof(char*));
-    Type** types = (Type**)malloc((numTypes+ SYS_TYPES)*sizeof(Type*));
-    void** typeInfos = (void**)malloc(numTypes*sizeof(void*));
+    BCReader readerData;
+    BCReader* reader = &readerData;
+    memset(reader, 0, sizeof(BCReader));
+    reader->bc = bc;
+    Const** consts = NULL;
+    int numConsts = 0;
+    FunctionSymbol* _main = NULL;  //入口函数
+
+    //1.文件头和节表
+    if (size < BC_HEADER_SIZE || memcmp(bc, BC_MAGIC, 4) != 0){
+        fprintf(stderr, "Not a bytecode file.\n");
+        goto fail;
+    }
+    if (bc[4] != BC_VERSION){
+        fprintf(stderr, "Unsupported bytecode version %d, expecting %d.\n", bc[4], BC_VERSION);
+        goto fail;
+    }
+    int numSections = bc[5];
+    if (size < BC_HEADER_SIZE + (size_t)numSections * BC_SECTION_ENTRY_SIZE){
+        fprintf(stderr, "Truncated bytecode file: incomplete section table.\n");
+        goto fail;
+    }
+    int sectionFound[BC_MAX_SECTION + 1] = {0};
+    for (int i = 0; i < numSections; i++){
+        unsigned char* entry = bc + BC_HEADER_SIZE + i * BC_SECTION_ENTRY_SIZE;
+        uint32_t offset = entry[1] | entry[2] << 8 | entry[3] << 16 | (uint32_t)entry[4] << 24;
+        uint32_t sectionSize = entry[5] | entry[6] << 8 | entry[7] << 16 | (uint32_t)entry[8] << 24;
+        if ((uint64_t)offset + sectionSize > size){
+            fprintf(stderr, "Truncated bytecode file: section %d ends at %llu, file size %zu.\n",
+                entry[0], (unsigned long long)offset + sectionSize, size);
+            goto fail;
+        }
+        if (entry[0] >= BC_STRINGS && entry[0] <= BC_MAX_SECTION){  //不认识的节被忽略
+            reader->sectionOffsets[entry[0]] = offset;
+            reader->sectionSizes[entry[0]] = sectionSize;
+            sectionFound[entry[0]] = 1;
+        }
+    }
+    for (int id = BC_STRINGS; id <= BC_MAX_SECTION; id++){
+        if (!sectionFound[id]){
+            fprintf(stderr, "Missing section %d in bytecode file.\n", id);
+            goto fail;
+        }
+    }
 
-    //添加系统内置类型
-    initSysTypes(&sysTypes);
-    addSystemTypes(typeNames, types);
+    //2.字符串表和类型
+    if (readStrings(reader) != 0){
+        fprintf(stderr, "Malformed string section in bytecode file.\n");
+        goto fail;
+    }
+    initSysTypes(&sysTypes);  //紧接着就放进类型数组，出错时随它一起释放
+    if (readTypes(reader) != 0){
+        fprintf(stderr, "Malformed type section in bytecode file.\n");
+        goto fail;
+    }
 
-    for (int i = 0; i < numTypes; i++){
-        int typeKind = bc[(*index)++];
-        switch(typeKind){
-            case 1:
-                readSimpleType(bc, index, i+SYS_TYPES, typeNames, types, typeInfos);
-                break;
-            case 2:
-                readFunctionType(bc, index, i+SYS_TYPES, typeNames, types, typeInfos);
-                break;
-            case 3:
-                readUnionType(bc, index, i+SYS_TYPES, typeNames, types, typeInfos);
-                break;
-            default:
-                printf("Unsupported type kind: %d\n",typeKind);        
-        }
+    //3.函数表：函数数量、main函数的下标和函数记录的偏移量表。函数记录等到第一次调用时才读取
+    seekSection(reader, BC_FUNCTIONS);
+    int numFunctions = readCount(reader);
+    int mainIndex = readIndex(reader, numFunctions + 1);
+    size_t functionTable = reader->pos;
+    if (reader->error || (size_t)numFunctions * 4 > reader->end - reader->pos){
+        fprintf(stderr, "Malformed function section in bytecode file.\n");
+        goto fail;
     }
-    buildTypes(numTypes+SYS_TYPES, typeNames, types, typeInfos);  //创建类型引用关系，并释放TypeInfo占的内存
-    
-    //2.读取常量
-    free(str); //注意释放内存
-    str = readString(bc, index);
-    int numConsts = bc[(*index)++];   
-    Const** consts = (Const**)malloc((numConsts + SYS_FUNS)*sizeof(Const*));
+
+    //4.常量。函数常量只创建函数的桩，记下函数记录的位置
+    seekSection(reader, BC_CONSTS);
+    numConsts = readCount(reader);
+    consts = (Const**)calloc(numConsts + SYS_FUNS, sizeof(Const*));  //没读到的常量为NULL，出错时不用释放
     addSystemFunctions(consts);
-    FunctionSymbol* _main;  //入口函数
-    for (int i = 0; i< numConsts; i++){
-        int constType = bc[(*index)++];
+    for (int i = 0; i < numConsts && !reader->error; i++){
+        int constType = readByte(reader);
         if (constType == 1){
-            NumberConst* numberConst = createNumberConst(bc[(*index)++]);
-            consts[i+SYS_FUNS] = (Const*)numberConst;
+            consts[i+SYS_FUNS] = (Const*)createNumberConst(readSignedVarint(reader));
         }
         else if (constType == 2){
-            char * strValue = readString(bc, index);
-            StringConst* stringConst = createStringConst(strValue);
-            consts[i+SYS_FUNS] = (Const*)stringConst;
+            consts[i+SYS_FUNS] = (Const*)createStringConst(readString(reader));
+        }
+        else if (constType == 4){
+            //decimal：8个字节的IEEE 754双精度数，高位在前
+            uint64_t bits = 0;
+            for (int k = 0; k < 8; k++){
+                bits = bits << 8 | readByte(reader);
+            }
+            double value;
+            memcpy(&value, &bits, sizeof(value));
+            consts[i+SYS_FUNS] = (Const*)createDecimalConst(value);
         }
         else if (constType == 3){
-            FunctionSymbol* functionSym = readFunctionSymbol(bc, index, numTypes+SYS_TYPES, typeNames, types);
-            FunctionConst* functionConst = createFunctionConst(functionSym);
-            consts[i+SYS_FUNS] = (Const*)functionConst;
-            if (strcmp(((Symbol*)functionSym)->name,"main") == 0){
+            int functionIndex = readIndex(reader, numFunctions);
+            if (reader->error){
+                break;
+            }
+            unsigned char* entry = bc + functionTable + functionIndex * 4;
+            uint32_t recordOffset = entry[0] | entry[1] << 8 | entry[2] << 16 | (uint32_t)entry[3] << 24;
+            if (recordOffset >= reader->sectionSizes[BC_FUNCTIONS]){
+                reader->error = 1;
+                break;
+            }
+            FunctionSymbol* functionSym = createFunctionSymbol(NULL, NULL, 0, NULL, 0, 0, NULL);
+            functionSym->state = FunctionStub;
+            functionSym->recordOffset = reader->sectionOffsets[BC_FUNCTIONS] + recordOffset;
+            consts[i+SYS_FUNS] = (Const*)createFunctionConst(functionSym);
+            if (functionIndex == mainIndex){
                 _main = functionSym;
             }
         }
         else{
-            printf("Unsupported const type: %d", constType); 
+            fprintf(stderr, "Unsupported const type: %d.\n", constType);
+            reader->error = 1;
         }
     }
+    if (reader->error){
+        fprintf(stderr, "Malformed const section in bytecode file.\n");
+        goto fail;
+    }
 
-    free(str);  //释放内存
+    //5.保留读取的状态，按需加载函数时使用，随BCModule一起释放
+    BCReader* savedReader = (BCReader*)malloc(sizeof(BCReader));
+    *savedReader = *reader;
+    savedReader->numConsts = numConsts + SYS_FUNS;
+    savedReader->consts = consts;
+    for (int i = SYS_FUNS; i < numConsts + SYS_FUNS; i++){
+        if (consts[i]->kind == FunctionC){
+            ((FunctionConst*)consts[i])->functionSym->reader = savedReader;
+        }
+    }
+
+    BCModule* bcModule = createBCModule(numConsts+SYS_FUNS, consts, _main, reader->numTypes, reader->types);
+    bcModule->reader = savedReader;
+    return bcModule;
 
-    return createBCModule(numConsts+SYS_FUNS, consts, _main, numTypes+SYS_TYPES, types);
+fail:
+    //释放到出错为止创建的常量、类型和字符串表。字符串和字节码都在映像中，由调用者释放映像
+    if (consts != NULL){
+        deleteConsts(consts, numConsts + SYS_FUNS);
+    }
+    if (reader->types != NULL){
+        deleteTypes(reader->types, reader->numTypes);
+    }
+    free(reader->strings);
+    return NULL;
 }
 
+#if !defined(USE_VM_STACK) && defined(USE_ARENA)
 ///////////////////////////////////////////////////////////////
-//基于Arena的内存管理机制
+//基于Arena的内存管理机制。使用虚拟机栈时用不到，不编译
 //模拟了一个内存栈的机制，连续内存管理。
 //由于栈桢都是伸缩式的申请内存的，所以该Arena实现得比较简单，不会出现内存碎片。
+//每次申请的内存后面，紧跟着一个size_t，记录申请之前的offset，归还时据此恢复。
 
 typedef struct _ArenaBlock{
     size_t size;     //当前这块Arena的大小，从ArenaBlock结构体的底部算起
     size_t offset;   //下一块自由内存的起始地址偏移量，从ArenaBlock结构体的底部算起
 }ArenaBlock;
 
+//ArenaBlock结构体底部的地址，按字节计算偏移量
+#define ARENA_BLOCK_DATA(block) ((unsigned char*)((block) + 1))
+
+//申请的内存大小向上对齐到size_t，保证后面的size_t和下一次申请的内存都是对齐的
+#define ARENA_ALIGN(size) (((size) + sizeof(size_t) - 1) & ~(sizeof(size_t) - 1))
+
 typedef struct _Arena{
     ArenaBlock ** blocks; 
     int numBlocks;
+    int capacity;  //blocks数组的容量，按倍数增长
     int pos;  //指向当前所使用的block的下标
 }Arena;
 
 static Arena arena; //静态变量，让编译器更容易计算其中的数据字段的地址。
 
-//添加Arena，每次添加一块
-void addArenaBlock(int blockSize){
-    ArenaBlock ** newBlocks = (ArenaBlock**)malloc((arena.numBlocks+1)*sizeof(ArenaBlock*));
-    memcpy(newBlocks, arena.blocks, arena.numBlocks*sizeof(ArenaBlock*));
-    free(arena.blocks);
-
-    arena.numBlocks++;
-    arena.blocks=newBlocks;
-
-    // printf("arena.numBlocks:%d", arena.numBlocks);
-
-    //申请一整块内存
-    ArenaBlock* block = (ArenaBlock*)malloc(sizeof(ArenaBlock) + blockSize*sizeof(unsigned char));
-    arena.blocks[arena.numBlocks-1] = block;
+ArenaBlock* createArenaBlock(size_t blockSize){
+    ArenaBlock* block = (ArenaBlock*)malloc(sizeof(ArenaBlock) + blockSize);
     block->offset = 0;
     block->size = blockSize;
+#ifdef DEBUG_FRAMES
+    frameStats.numBlocks++;
+#endif
+    return block;
+}
+
+//添加Arena，每次添加一块
+void addArenaBlock(size_t blockSize){
+    if (arena.numBlocks == arena.capacity){
+        arena.capacity = arena.capacity == 0 ? 8 : arena.capacity*2;
+        arena.blocks = (ArenaBlock**)realloc(arena.blocks, arena.capacity*sizeof(ArenaBlock*));
+    }
+    arena.blocks[arena.numBlocks++] = createArenaBlock(blockSize);
 }
 
 void initArena(){
+    arena.blocks = NULL;
     arena.numBlocks = 0;
+    arena.capacity = 0;
     addArenaBlock(ARENA_BLOCK_SIZE);
     arena.pos = 0;
 }
@@ -1157,41 +2003,60 @@ void initArena(){
 //从Arena中申请内存
 //size:内存块的大小
 void* allocFromArena(size_t size){
-    void* mem;
-    if (arena.blocks[arena.pos]->offset + size + sizeof(size_t)  > arena.blocks[arena.pos]->size){
-        //需要使用一个新的Arena
-        if (arena.pos < arena.numBlocks-1){  //复用已有的内存块
-            arena.pos ++;
+    size = ARENA_ALIGN(size);
+    size_t needed = size + sizeof(size_t);  //加上记录上一个offset的位置
+
+    ArenaBlock* block = arena.blocks[arena.pos];
+    if (block->offset + needed > block->size){
+        //需要使用一个新的Arena。超过ARENA_BLOCK_SIZE的请求，单独用一块足够大的
+        size_t blockSize = needed > ARENA_BLOCK_SIZE ? needed : ARENA_BLOCK_SIZE;
+        arena.pos ++;
+        if (arena.pos == arena.numBlocks){ //申请一块新的Block
+            addArenaBlock(blockSize);
         }
-        else{//申请一块新的Block
-            addArenaBlock(ARENA_BLOCK_SIZE);
+        else if (arena.blocks[arena.pos]->size < needed){ //已有的内存块太小，换成一块足够大的
+            free(arena.blocks[arena.pos]);
+            arena.blocks[arena.pos] = createArenaBlock(blockSize);
         }
+        block = arena.blocks[arena.pos];
     }
 
-    ArenaBlock* block = arena.blocks[arena.pos];
-
     //offset当前的位置的地址，就是新申请内存的地址
-    mem = (void*)(block + sizeof(ArenaBlock) + block->offset); 
-    
-    //移动offset
-    size_t lastOffset = block->offset;
-    block->offset += size;
-    size_t * top = (size_t*)(block + sizeof(ArenaBlock) + block->offset);
-    //写入之前的offset的值
-    *top = lastOffset;   
-    //再往后移一位
-    block->offset+=sizeof(size_t);
+    unsigned char* mem = ARENA_BLOCK_DATA(block) + block->offset;
+
+    //在这块内存的后面写入之前的offset的值，再移动offset
+    *(size_t*)(mem + size) = block->offset;
+    block->offset += needed;
+
+#ifdef DEBUG_FRAMES
+    frameStats.bytesInUse += needed;
+    if (frameStats.bytesInUse > frameStats.peakBytes){
+        frameStats.peakBytes = frameStats.bytesInUse;
+    }
+#endif
     
     return mem;
 }
 
-//把内存归还arena
-void returnToArena(){
+//把最近一次申请的内存mem归还arena
+void returnToArena(void* mem){
     ArenaBlock* block = arena.blocks[arena.pos];
-    //从当前顶部位置往后一个位置，存着上一个offset的位置
-    size_t* prevOffset = (size_t*)(block + sizeof(Arena) + block->offset - sizeof(size_t));
-    block->offset = *prevOffset;
-    if (block->offset == 0){
+    //当前顶部位置的前一个size_t，存着上一个offset的位置
+    size_t prevOffset = *(size_t*)(ARENA_BLOCK_DATA(block) + block->offset - sizeof(size_t));
+
+#ifdef DEBUG_FRAMES
+    //必须按照后进先出的顺序归还
+    if (ARENA_BLOCK_DATA(block) + prevOffset != (unsigned char*)mem){
+        fprintf(stderr, "Arena corrupted: memory %p is not at the top of block %d.\n", mem, arena.pos);
+        abort();
+    }
+    frameStats.bytesInUse -= block->offset - prevOffset;
+#else
+    (void)mem;  //只在调试时用来检查归还的顺序
+#endif
+
+    block->offset = prevOffset;
+    if (block->offset == 0 && arena.pos > 0){
         arena.pos--; //把当前块设置为前一个块
     }
 }
@@ -1204,99 +2069,364 @@ void deleteArena(){
     }
     free(arena.blocks);
 }
+#endif
 
 
 ///////////////////////////////////////////////////////////////
 //主程序
 
 /**
- * 把文件内容读入一整块内存中。
- * char** pdata : 返回数据的内存地址
- * 返回值：内存块的大小。
+ * 打开字节码文件，得到文件内容的映像。
+ * 定义了USE_MMAP_LOADER时，用mmap把文件映射到内存，否则一次性读入一整块内存。
+ * 映像是只读的：字符串和字节码都直接引用其中的内存，见readBCModule。
+ * 返回值：0表示成功；否则已经打印了原因，返回进程的退出码：文件无法读取时为EXIT_NO_INPUT，是空文件时为EXIT_BAD_FILE。
  * */
-#define MAX_BUFFER_LEN 1024
-
-int readBCFile(char* fileName, unsigned char** pdata){
-    //打开文件
-    FILE * file = fopen(fileName,"r");
+int openBCFile(char* fileName, BCImage* image){
+#ifdef USE_MMAP_LOADER
+    int fd = open(fileName, O_RDONLY);
+    if (fd < 0){
+        fprintf(stderr, "%s does not exist.\n", fileName);
+        return EXIT_NO_INPUT;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0){
+        close(fd);
+        fprintf(stderr, "Failed to read %s.\n", fileName);
+        return EXIT_NO_INPUT;
+    }
+    if (st.st_size == 0){  //长度为0的文件不能映射
+        close(fd);
+        fprintf(stderr, "Bytecode file %s is empty.\n", fileName);
+        return EXIT_BAD_FILE;
+    }
+    void* data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);  //映射建立以后，就不再需要文件描述符了
+    if (data == MAP_FAILED){
+        fprintf(stderr, "Failed to map %s.\n", fileName);
+        return EXIT_NO_INPUT;
+    }
+    image->data = (unsigned char*)data;
+    image->size = st.st_size;
+    image->mapped = 1;
+#else
+    FILE * file = fopen(fileName,"rb");
     if (file == NULL){
-        printf("%s, %s",fileName," does not exit/n");
+        fprintf(stderr, "%s does not exist.\n", fileName);
+        return EXIT_NO_INPUT;
+    }
+    fseek(file, 0, SEEK_END);
+    long size = ftell(file);
+    rewind(file);
+    if (size < 0){
         fclose(file);
-        return 0;
+        fprintf(stderr, "Failed to read %s.\n", fileName);
+        return EXIT_NO_INPUT;
+    }
+    if (size == 0){
+        fclose(file);
+        fprintf(stderr, "Bytecode file %s is empty.\n", fileName);
+        return EXIT_BAD_FILE;
+    }
+    image->data = (unsigned char*)malloc(size);
+    image->size = fread(image->data, 1, size, file);
+    image->mapped = 0;
+    fclose(file);
+#endif
+    return 0;
+}
+
+//释放字节码文件的映像
+void closeBCFile(BCImage* image){
+    if (image->data == NULL){
+        return;
+    }
+#ifdef USE_MMAP_LOADER
+    if (image->mapped){
+        munmap(image->data, image->size);
     }
+    else{
+        free(image->data);
+    }
+#else
+    free(image->data);
+#endif
+    image->data = NULL;
+}
 
-    int rc;
-    unsigned char buf[MAX_BUFFER_LEN];
-    unsigned char* data = NULL;
-    size_t totalSize = 0;
-    while( (rc = fread(buf,sizeof(unsigned char), MAX_BUFFER_LEN,file)) != 0 ){
-        //把文件内容合并到一整块内存中
-        size_t oldSize = totalSize;
-        totalSize += rc;
-        unsigned char* oldData = data;
-        data = (unsigned char*)malloc(totalSize*sizeof(unsigned char));
-        if (oldData != NULL){
-            memcpy(data,oldData,oldSize);
-            free(oldData);
+//墙钟时间，单位是毫秒。--stats用它报告执行时间，计时方式与基准测试中的TypeScript引擎一致
+static double wallClockMs(){
+#if defined(__unix__) || defined(__APPLE__)
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+#else
+    return (double)clock() * 1000 / CLOCKS_PER_SEC;
+#endif
+}
+
+//本进程的峰值内存，单位是KB，不知道时返回-1。
+//Linux上ru_maxrss会保留exec之前父进程的峰值（比如从Node里启动时就是Node的内存），所以优先读/proc里的VmHWM
+static long peakRssKB(){
+#ifdef __linux__
+    FILE* f = fopen("/proc/self/status", "r");
+    if (f != NULL){
+        char line[256];
+        long kb = -1;
+        while (fgets(line, sizeof(line), f) != NULL){
+            if (sscanf(line, "VmHWM: %ld kB", &kb) == 1){
+                break;
+            }
+        }
+        fclose(f);
+        if (kb >= 0){
+            return kb;
         }
-        memcpy(data+oldSize,buf,rc);
     }
+#endif
+#if defined(__unix__) || defined(__APPLE__)
+    //ru_maxrss在Linux上以KB为单位，在macOS上以字节为单位
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+#ifdef __APPLE__
+    return usage.ru_maxrss / 1024;
+#else
+    return usage.ru_maxrss;
+#endif
+#else
+    return -1;
+#endif
+}
 
-    fclose(file);
+//解析命令行中的字节数，可以带K、M、G后缀。格式不对、为0或溢出时返回0
+static size_t parseSize(const char* s){
+    if (*s < '0' || *s > '9'){
+        return 0;
+    }
+    char* end;
+    errno = 0;
+    unsigned long long n = strtoull(s, &end, 10);
+    int shift = 0;
+    switch (*end){
+        case 'K': case 'k': shift = 10; end++; break;
+        case 'M': case 'm': shift = 20; end++; break;
+        case 'G': case 'g': shift = 30; end++; break;
+    }
+    if (*end != 0 || errno == ERANGE || n > (SIZE_MAX >> shift)){
+        return 0;
+    }
+    return (size_t)n << shift;
+}
 
-    *pdata = data;    //返回数据的内存地址
-    return totalSize;
+//命令行用法
+static void usage(FILE* out){
+    fprintf(out, "Usage: playvm [options] file.bc\n"
+                    "  --help, -h          print this help\n"
+                    "  --interactive       flush output after every line (default when stdout is a terminal)\n"
+                    "  --dump-bytes        print the bytecode file in hex before running\n"
+                    "  --dump-module       print the loaded module before running\n"
+                    "  --time              print the run time to stderr\n"
+                    "  --stats             print execution wall time, peak memory and allocation statistics to stderr\n"
+                    "  --gc-initial-heap=N collect garbage first when the heap reaches N bytes (suffix K, M or G; default 1M)\n"
+                    "  --gc-grow-factor=N  next collection when the heap reaches N times the live bytes (at least 2; default 2)\n"
+                    "  --gc-max-heap=N     out of memory when more than N bytes are live after a collection (default 1G)\n"
+                    "  --profile[=file]    profile opcodes and functions, report on stderr, JSON to file (default profile.json)\n");
 }
 
 int main(int argc, char** argv){
-    if (argc <= 1){
-        printf("Need a bycode file name.");
-        return 0;
+    //命令行：playvm [选项] 字节码文件，选项见usage()
+    //缺省只运行程序，stdout上只有程序自己的输出。--time和--stats写到stderr，不会混进程序的输出。
+    //退出码：程序正常结束时为0，main函数用ireturn返回了0～EXIT_RESULT_MAX的integer时就是这个值；其他情况见vm.h中的EXIT_*
+    char* fileName = NULL;
+    char* profileFile = "profile.json";
+    int dumpBytes = 0;
+    int dumpModule = 0;
+    int showTime = 0;
+    int showStats = 0;
+    size_t gcInitialHeap = GC_INITIAL_HEAP;
+    size_t gcGrowFactor = GC_HEAP_GROW_FACTOR;
+    size_t gcMaxHeap = GC_MAX_HEAP;
+#if defined(__unix__) || defined(__APPLE__)
+    int interactive = isatty(STDOUT_FILENO);
+#else
+    int interactive = 0;
+#endif
+    for (int i = 1; i < argc; i++){
+        if (strcmp(argv[i], "--help") == 0 || strcmp(argv[i], "-h") == 0){
+            usage(stdout);
+            return 0;
+        }
+        else if (strcmp(argv[i], "--interactive") == 0){
+            interactive = 1;
+        }
+        else if (strcmp(argv[i], "--dump-bytes") == 0){
+            dumpBytes = 1;
+        }
+        else if (strcmp(argv[i], "--dump-module") == 0){
+            dumpModule = 1;
+        }
+        else if (strcmp(argv[i], "--time") == 0){
+            showTime = 1;
+        }
+        else if (strcmp(argv[i], "--stats") == 0){
+            showStats = 1;
+        }
+        else if (strncmp(argv[i], "--gc-initial-heap=", 18) == 0){
+            if ((gcInitialHeap = parseSize(argv[i] + 18)) == 0){
+                fprintf(stderr, "Invalid heap size: %s\n", argv[i]);
+                return EXIT_USAGE;
+            }
+        }
+        else if (strncmp(argv[i], "--gc-grow-factor=", 17) == 0){
+            gcGrowFactor = parseSize(argv[i] + 17);
+            if (gcGrowFactor < 2 || gcGrowFactor > 1024){
+                fprintf(stderr, "Invalid grow factor: %s, expecting 2 to 1024\n", argv[i]);
+                return EXIT_USAGE;
+            }
+        }
+        else if (strncmp(argv[i], "--gc-max-heap=", 14) == 0){
+            if ((gcMaxHeap = parseSize(argv[i] + 14)) == 0){
+                fprintf(stderr, "Invalid heap size: %s\n", argv[i]);
+                return EXIT_USAGE;
+            }
+        }
+        else if (strcmp(argv[i], "--profile") == 0){
+            profiling = 1;
+        }
+        else if (strncmp(argv[i], "--profile=", 10) == 0){
+            profiling = 1;
+            profileFile = argv[i] + 10;
+        }
+        else if (argv[i][0] == '-' || fileName != NULL){
+            fprintf(stderr, "Unknown argument: %s\n", argv[i]);
+            usage(stderr);
+            return EXIT_USAGE;
+        }
+        else{
+            fileName = argv[i];
+        }
+    }
+    if (fileName == NULL){
+        usage(stderr);
+        return EXIT_USAGE;
     }
+    if (gcMaxHeap < gcInitialHeap){
+        fprintf(stderr, "--gc-max-heap must not be smaller than --gc-initial-heap\n");
+        return EXIT_USAGE;
+    }
+    output_init(interactive);
 
     //读取文件内容
-    unsigned char * data;
-    int totalSize = readBCFile(argv[1], &data);
-
-    if(totalSize == 0) return 0;
-    
+    BCImage image;
+    int openResult = openBCFile(fileName, &image);
+    if (openResult != 0) return openResult;
 
     //打印调试信息：字节码文件内容
-    printf("字节码文件的内容:\n");
-    for (int i = 0; i< totalSize; i++){
-        printf("%x ", data[i]);
+    if (dumpBytes){
+        printf("字节码文件的内容:\n");
+        for (size_t i = 0; i< image.size; i++){
+            printf("%x ", image.data[i]);
+        }
+        printf("\n");
     }
-    printf("\n");
 
-    //生成BCModule
-    BCModule* bcModule = readBCModule(data, totalSize);
-    free(data);  //释放内存
+    //生成BCModule。字符串和字节码都直接指向映像，所以映像归BCModule所有，随它一起释放。
+    BCModule* bcModule = readBCModule(image.data, image.size);
+    if (bcModule == NULL){
+        closeBCFile(&image);
+        fprintf(stderr, "Failed to load bytecode file %s.\n", fileName);
+        return EXIT_BAD_FILE;
+    }
+    bcModule->image = image;
 
-    //初始化Arena机制
+    //初始化栈桢所用的内存
+#if defined(USE_VM_STACK)
+    initVMStack(VM_STACK_SIZE);
+#ifdef USE_JIT
+    initJit(vmStack.limit);
+#endif
+#elif defined(USE_ARENA)
     initArena();
+#endif
+
+    //初始化垃圾收集器
+    gc_init(gcInitialHeap, (int)gcGrowFactor, gcMaxHeap, markRoots);
 
     //显示BCModule的内容
-    printf("\n显示BCModule：\n");
-    dumpBCModule(bcModule);
+    if (dumpModule){
+        printf("\n显示BCModule：\n");
+        dumpBCModule(bcModule);
+    }
+    if (dumpBytes || dumpModule){
+        printf("运行字节码:\n");
+    }
 
     //运行字节码
-    printf("运行字节码:\n");
+    if (profiling){
+        profileBegin(bcModule);
+    }
     clock_t begintime = clock();
+    double beginWallMs = wallClockMs();
     
     //运行BCModule
-    execute(bcModule);
+    Value result;
+    int rtn = execute(bcModule, &result);
+    output_flush();
 
     clock_t endtime = clock();
-    
-    // printf("\n耗时：%lu\n", endtime-begintime);
-    printf("耗时：%f 秒\n", (double)(endtime - begintime) / CLOCKS_PER_SEC);
+    double execWallMs = wallClockMs() - beginWallMs;
+
+    int exitCode = 0;
+    if (rtn < 0){
+        exitCode = -rtn;
+    }
+    else if (rtn == 1 && IS_INT(result)){
+        //退出码只有8位，超出范围的返回值会和虚拟机自己的退出码混淆，所以只打印出来
+        int value = AS_INT(result);
+        if (value >= 0 && value <= EXIT_RESULT_MAX){
+            exitCode = value;
+        }
+        else{
+            fprintf(stderr, "main returned %d, which is outside the exit status range 0..%d.\n", value, EXIT_RESULT_MAX);
+            exitCode = EXIT_BAD_RESULT;
+        }
+    }
 
-    //删除掉Arena
+    if (showTime){
+        fprintf(stderr, "耗时：%f 秒\n", (double)(endtime - begintime) / CLOCKS_PER_SEC);
+    }
+
+    if (showStats){
+        //只包括执行程序的时间，不包括加载字节码的时间
+        fprintf(stderr, "exec time: %.3f ms\n", execWallMs);
+        long rssKB = peakRssKB();
+        if (rssKB >= 0){
+            fprintf(stderr, "peak RSS: %ld KB\n", rssKB);
+        }
+        mem_dump_stats(stderr);
+#ifdef DEBUG_FRAMES
+        dumpFrameStats();
+#endif
+    }
+
+    if (profiling){
+        profileEnd(stderr, profileFile);
+    }
+
+    //释放栈桢所用的内存
+#if defined(USE_VM_STACK)
+    deleteVMStack();
+#ifdef USE_JIT
+    deleteJit();
+#endif
+#elif defined(USE_ARENA)
     deleteArena();
+#endif
 
     //释放内存
     deleteBCModule(bcModule);
+    string_intern_clear();
+    gc_shutdown();
 
-    return 0;
+    return exitCode;
 }
 
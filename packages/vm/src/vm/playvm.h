@@ -3,19 +3,74 @@
 #ifndef PLAYSCRIPT_PLAYVM
 #define PLAYSCRIPT_PLAYVM
 
+//栈桢的内存管理方式：
+//USE_VM_STACK：所有栈桢都放在一块预先分配的连续内存（虚拟机栈）中，参数就地传递；
+//否则，如果定义了USE_ARENA，每个栈桢从Arena中申请；都没有定义，则用malloc申请。
+//缺省使用虚拟机栈；编译时加上-DNO_VM_STACK改用Arena，再加上-DNO_ARENA则用malloc（见Makefile中的FRAMES）。
+#if !defined(USE_VM_STACK) && !defined(NO_VM_STACK)
+#define USE_VM_STACK
+#endif
+
 //是否使用Arena内存管理机制
+#if !defined(USE_ARENA) && !defined(NO_ARENA)
 #define USE_ARENA
+#endif
+
+//指令分派方式：GCC/Clang下缺省使用computed goto（labels as values）实现直接线索化分派；
+//编译时加上-DUSE_SWITCH_DISPATCH，则退回到switch分派。
+#if defined(__GNUC__) && !defined(USE_SWITCH_DISPATCH)
+#define USE_COMPUTED_GOTO
+#endif
 
 //Arena中，每个内存块的大小
 #define ARENA_BLOCK_SIZE 4096
 
+//虚拟机栈的大小（字节）
+#define VM_STACK_SIZE (8*1024*1024)
+
+//垃圾收集：堆中对象的总大小超过GC_INITIAL_HEAP时进行第一次收集；以后每次收集之后，
+//下一次收集的阈值是存活对象大小的GC_HEAP_GROW_FACTOR倍，但不小于GC_INITIAL_HEAP。
+//收集之后存活的对象仍然超过GC_MAX_HEAP，就报告内存不足。
+//这些是缺省值，运行时可以用--gc-initial-heap=、--gc-grow-factor=、--gc-max-heap=修改。
+#define GC_INITIAL_HEAP (1024*1024)
+#define GC_HEAP_GROW_FACTOR 2
+#define GC_MAX_HEAP ((size_t)1024*1024*1024)
+
+//加载字节码文件的方式：类Unix系统上用mmap把文件映射到内存，否则读入一块malloc的内存
+#if defined(__unix__) || defined(__APPLE__)
+#define USE_MMAP_LOADER
+#endif
+
 //系统内置类型的数量
 #define SYS_TYPES 9
 
 //系统内置函数的数量
 #define SYS_FUNS 3
 
-#define VM_NUMBER int  //栈机运算的数据类型
-// #define VM_NUMBER long  //栈机运算的数据类型
+//栈机运算的数据类型：带标签的Value，见rt/value.h
+#include "../rt/value.h"
+
+//内置函数（native函数）的调用约定：args指向第一个参数，共argc个。
+//如果有返回值，写入*result并返回1；否则返回0。
+typedef int (*NativeFunction)(int argc, Value* args, Value* result);
+
+//模板JIT：把调用次数达到JIT_THRESHOLD的函数编译成x86-64机器码。
+//只支持x86-64上的类Unix系统，并且要使用虚拟机栈。make JIT=off 可以关掉。
+//JIT代码建立的栈桢不经过createStackFrame，没有统计和检查，所以DEBUG_FRAMES时也不用JIT。
+#if defined(__x86_64__) && defined(__unix__) && defined(USE_VM_STACK) && !defined(NO_JIT) && !defined(DEBUG_FRAMES)
+#define USE_JIT
+#endif
+
+#define JIT_THRESHOLD 100
+
+//JIT函数的返回值。按照System V的调用约定，value放在rax中、hasValue放在rdx中返回。
+typedef struct _JitResult{
+    Value value;
+    int hasValue;
+}JitResult;
+
+//JIT函数的调用约定：locals指向本地变量，前面几个就是参数。
+struct _FunctionSymbol;
+typedef JitResult (*JitFunction)(Value* locals, struct _FunctionSymbol* functionSym);
 
 #endif
@@ -0,0 +1,340 @@
+//性能剖析
+//打开--profile时，预解码把每条指令的处理程序（switch分派时是dispatchOp）都设为解释器中的同一个桩，
+//桩调用profileInstruction()之后再跳到真正的处理程序；没有打开时指令直接分派，两种分派方式都不增加任何开销。剖析期间不做JIT编译，所有代码都经过解释器。
+//
+//函数的时钟周期在调用和返回指令处用rdtsc读取，用一个影子调用栈记下每次调用的开始时间和被调用函数用掉的时间。
+//内置函数没有自己的指令，它的调用在调用者的下一条指令执行之前结束。
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "profile.h"
+#include "../rt/mem.h"
+#include "../rt/output.h"
+
+int profiling = 0;
+
+//读取时钟周期数。没有rdtsc的平台上用纳秒代替
+#if defined(__x86_64__) || defined(__i386__)
+#define CLOCK_UNIT "cycles"
+static inline uint64_t readCycles(){
+    return __rdtsc();
+}
+#else
+#define CLOCK_UNIT "ns"
+static inline uint64_t readCycles(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+#endif
+
+//指令的名称，用于报告
+static const char* opNames[256] = {
+    [iconst_0] = "iconst_0", [iconst_1] = "iconst_1", [iconst_2] = "iconst_2",
+    [iconst_3] = "iconst_3", [iconst_4] = "iconst_4", [iconst_5] = "iconst_5",
+    [dconst_0] = "dconst_0", [dconst_1] = "dconst_1",
+    [bipush] = "bipush", [sipush] = "sipush", [ldc] = "ldc", [sldc] = "sldc", [ldc2_w] = "ldc2_w",
+    [iload] = "iload", [iload_0] = "iload_0", [iload_1] = "iload_1", [iload_2] = "iload_2", [iload_3] = "iload_3",
+    [istore] = "istore", [istore_0] = "istore_0", [istore_1] = "istore_1", [istore_2] = "istore_2", [istore_3] = "istore_3",
+    [pop] = "pop",
+    [iadd] = "iadd", [sadd] = "sadd", [isub] = "isub", [imul] = "imul", [idiv] = "idiv", [iinc] = "iinc",
+    [dadd] = "dadd", [dsub] = "dsub", [dmul] = "dmul", [ddiv] = "ddiv",
+    [i2d] = "i2d", [d2i] = "d2i", [lcmp] = "lcmp", [dcmpl] = "dcmpl", [dcmpg] = "dcmpg",
+    [ifeq] = "ifeq", [ifne] = "ifne", [iflt] = "iflt", [ifge] = "ifge", [ifgt] = "ifgt", [ifle] = "ifle",
+    [if_icmpeq] = "if_icmpeq", [if_icmpne] = "if_icmpne", [if_icmplt] = "if_icmplt",
+    [if_icmpge] = "if_icmpge", [if_icmpgt] = "if_icmpgt", [if_icmple] = "if_icmple",
+    [_goto] = "goto", [ireturn] = "ireturn", [_return] = "return", [invokestatic] = "invokestatic",
+    [isub_lc] = "isub_lc",
+    [if_icmpeq_lc] = "if_icmpeq_lc", [if_icmpne_lc] = "if_icmpne_lc", [if_icmplt_lc] = "if_icmplt_lc",
+    [if_icmpge_lc] = "if_icmpge_lc", [if_icmpgt_lc] = "if_icmpgt_lc", [if_icmple_lc] = "if_icmple_lc",
+    [iadd_ll_st] = "iadd_ll_st", [iinc_goto] = "iinc_goto", [invoketail] = "invoketail",
+};
+
+//影子调用栈中的一次调用
+typedef struct _ProfileCall{
+    FunctionProfile* profile;
+    uint64_t start;         //开始的时间
+    uint64_t childCycles;   //被调用函数用掉的时间
+}ProfileCall;
+
+static struct{
+    uint64_t opCounts[256];
+    uint64_t pairCounts[256][256];   //[前一条][后一条]
+    int lastOp;                      //上一条执行的指令，还没有时为-1
+
+    FunctionProfile* functions;
+    int numFunctions;
+
+    ProfileCall* calls;
+    int numCalls;
+    int callCapacity;
+    int nativePending;      //栈顶是一个内置函数的调用，在下一条指令之前结束
+}prof;
+
+static void enterFunction(FunctionSymbol* functionSym, uint64_t now){
+    if (prof.numCalls == prof.callCapacity){
+        prof.callCapacity = prof.callCapacity == 0 ? 256 : prof.callCapacity * 2;
+        prof.calls = (ProfileCall*)realloc(prof.calls, prof.callCapacity * sizeof(ProfileCall));
+        if (prof.calls == NULL){
+            output_flush();
+            fprintf(stderr, "Out of memory.\n");
+            exit(EXIT_OUT_OF_MEMORY);
+        }
+    }
+    FunctionProfile* profile = functionSym->profile;
+    profile->calls++;
+    profile->active++;
+    ProfileCall* call = &prof.calls[prof.numCalls++];
+    call->profile = profile;
+    call->start = now;
+    call->childCycles = 0;
+}
+
+static void leaveFunction(uint64_t now){
+    ProfileCall* call = &prof.calls[--prof.numCalls];
+    FunctionProfile* profile = call->profile;
+    uint64_t cycles = now - call->start;
+    profile->exclusiveCycles += cycles - call->childCycles;
+    if (--profile->active == 0){
+        profile->inclusiveCycles += cycles;
+    }
+    if (prof.numCalls > 0){
+        prof.calls[prof.numCalls - 1].childCycles += cycles;
+    }
+}
+
+void profileBegin(BCModule* bcModule){
+    prof.lastOp = -1;
+    prof.functions = (FunctionProfile*)calloc(bcModule->numConsts, sizeof(FunctionProfile));
+    prof.numFunctions = 0;
+    for (int i = 0; i < bcModule->numConsts; i++){
+        if (bcModule->consts[i]->kind == FunctionC){
+            FunctionProfile* profile = &prof.functions[prof.numFunctions++];
+            profile->functionSym = ((FunctionConst*)bcModule->consts[i])->functionSym;
+            profile->functionSym->profile = profile;
+        }
+    }
+    if (bcModule->_main != NULL){
+        enterFunction(bcModule->_main, readCycles());
+    }
+}
+
+void profileInstruction(FunctionSymbol* functionSym, Instruction* ip, int depth){
+    int op = ip->opCode;
+    prof.opCounts[op]++;
+    if (prof.lastOp >= 0){
+        prof.pairCounts[prof.lastOp][op]++;
+    }
+    prof.lastOp = op;
+
+    FunctionProfile* profile = functionSym->profile;
+    if (depth > profile->maxStackDepth){
+        profile->maxStackDepth = depth;
+    }
+
+    if (prof.nativePending){
+        prof.nativePending = 0;
+        leaveFunction(readCycles());
+    }
+
+    switch (op){
+        case invokestatic:
+            enterFunction(ip->callee, readCycles());
+            prof.nativePending = ip->callee->native != NULL;
+            break;
+        case invoketail:{  //当前函数结束，被调用的函数接替它
+            uint64_t now = readCycles();
+            leaveFunction(now);
+            enterFunction(ip->callee, now);
+            break;
+        }
+        case ireturn:
+        case _return:
+            leaveFunction(readCycles());
+            break;
+        default:
+            break;
+    }
+}
+
+//排序用的比较函数，都是从大到小
+static uint64_t* sortCounts;   //pairCounts展开成一维数组
+
+static int compareOps(const void* a, const void* b){
+    uint64_t ca = sortCounts[*(const int*)a], cb = sortCounts[*(const int*)b];
+    return ca < cb ? 1 : (ca > cb ? -1 : *(const int*)a - *(const int*)b);
+}
+
+static int compareFunctions(const void* a, const void* b){
+    const FunctionProfile* fa = (const FunctionProfile*)a;
+    const FunctionProfile* fb = (const FunctionProfile*)b;
+    if (fa->exclusiveCycles != fb->exclusiveCycles){
+        return fa->exclusiveCycles < fb->exclusiveCycles ? 1 : -1;
+    }
+    return fa->calls < fb->calls ? 1 : (fa->calls > fb->calls ? -1 : 0);
+}
+
+static const char* opName(int op){
+    return opNames[op] != NULL ? opNames[op] : "unknown";
+}
+
+//JSON字符串，只需要转义引号、反斜杠和控制字符
+static void writeJsonString(FILE* f, const char* s){
+    fputc('"', f);
+    for (; *s; s++){
+        if (*s == '"' || *s == '\\'){
+            fputc('\\', f);
+            fputc(*s, f);
+        }
+        else if ((unsigned char)*s < 0x20){
+            fprintf(f, "\\u%04x", *s);
+        }
+        else{
+            fputc(*s, f);
+        }
+    }
+    fputc('"', f);
+}
+
+//报告中最多列出的指令对
+#define REPORT_PAIRS 20
+
+void profileEnd(FILE* out, char* jsonFile){
+    //程序出错退出时，影子调用栈可能还没有清空
+    uint64_t now = readCycles();
+    while (prof.numCalls > 0){
+        leaveFunction(now);
+    }
+    prof.nativePending = 0;
+
+    uint64_t total = 0;
+    for (int i = 0; i < 256; i++){
+        total += prof.opCounts[i];
+    }
+
+    //单条指令，按执行次数排序
+    int ops[256];
+    int numOps = 0;
+    for (int i = 0; i < 256; i++){
+        if (prof.opCounts[i] > 0){
+            ops[numOps++] = i;
+        }
+    }
+    sortCounts = prof.opCounts;
+    qsort(ops, numOps, sizeof(int), compareOps);
+
+    //指令对，按执行次数排序。下标是前一条 * 256 + 后一条
+    int numPairs = 0;
+    for (int i = 0; i < 256*256; i++){
+        if ((&prof.pairCounts[0][0])[i] > 0){
+            numPairs++;
+        }
+    }
+    int* pairs = (int*)malloc((numPairs + 1) * sizeof(int));
+    numPairs = 0;
+    for (int i = 0; i < 256*256; i++){
+        if ((&prof.pairCounts[0][0])[i] > 0){
+            pairs[numPairs++] = i;
+        }
+    }
+    sortCounts = &prof.pairCounts[0][0];
+    qsort(pairs, numPairs, sizeof(int), compareOps);
+
+    //函数，按不包含被调用函数的时钟周期数排序
+    qsort(prof.functions, prof.numFunctions, sizeof(FunctionProfile), compareFunctions);
+    uint64_t totalCycles = 0;
+    for (int i = 0; i < prof.numFunctions; i++){
+        totalCycles += prof.functions[i].exclusiveCycles;
+    }
+
+    fprintf(out, "\n性能剖析：共执行 %llu 条指令\n", (unsigned long long)total);
+    fprintf(out, "%-16s %14s %8s\n", "op", "count", "%");
+    for (int i = 0; i < numOps; i++){
+        fprintf(out, "%-16s %14llu %8.2f\n", opName(ops[i]), (unsigned long long)prof.opCounts[ops[i]],
+                100.0 * prof.opCounts[ops[i]] / total);
+    }
+
+    fprintf(out, "\n%-33s %14s %8s\n", "op pair", "count", "%");
+    for (int i = 0; i < numPairs && i < REPORT_PAIRS; i++){
+        int first = pairs[i] >> 8, second = pairs[i] & 0xff;
+        fprintf(out, "%-16s %-16s %14llu %8.2f\n", opName(first), opName(second),
+                (unsigned long long)prof.pairCounts[first][second], 100.0 * prof.pairCounts[first][second] / total);
+    }
+
+    fprintf(out, "\n%-20s %12s %16s %16s %8s %10s\n", "function", "calls", "inclusive " CLOCK_UNIT,
+            "exclusive " CLOCK_UNIT, "excl%", "max stack");
+    for (int i = 0; i < prof.numFunctions; i++){
+        FunctionProfile* p = &prof.functions[i];
+        if (p->calls == 0){
+            continue;
+        }
+        char stack[32];
+        if (p->functionSym->native != NULL){
+            strcpy(stack, "-");
+        }
+        else{
+            snprintf(stack, sizeof(stack), "%d/%d", p->maxStackDepth, p->functionSym->opStackSize);
+        }
+        fprintf(out, "%-20s %12llu %16llu %16llu %8.2f %10s\n", ((Symbol*)p->functionSym)->name,
+                (unsigned long long)p->calls, (unsigned long long)p->inclusiveCycles,
+                (unsigned long long)p->exclusiveCycles,
+                totalCycles == 0 ? 0.0 : 100.0 * p->exclusiveCycles / totalCycles, stack);
+    }
+
+    //机器可读的JSON，包括全部指令对
+    FILE* f = fopen(jsonFile, "w");
+    if (f == NULL){
+        fprintf(out, "Can not write profile to %s.\n", jsonFile);
+    }
+    else{
+        fprintf(f, "{\n  \"clockUnit\": \"%s\",\n  \"totalInstructions\": %llu,\n  \"opcodes\": [",
+                CLOCK_UNIT, (unsigned long long)total);
+        for (int i = 0; i < numOps; i++){
+            fprintf(f, "%s\n    {\"op\": \"%s\", \"code\": %d, \"count\": %llu}", i == 0 ? "" : ",",
+                    opName(ops[i]), ops[i], (unsigned long long)prof.opCounts[ops[i]]);
+        }
+        fprintf(f, "\n  ],\n  \"pairs\": [");
+        for (int i = 0; i < numPairs; i++){
+            int first = pairs[i] >> 8, second = pairs[i] & 0xff;
+            fprintf(f, "%s\n    {\"first\": \"%s\", \"second\": \"%s\", \"count\": %llu}", i == 0 ? "" : ",",
+                    opName(first), opName(second), (unsigned long long)prof.pairCounts[first][second]);
+        }
+        fprintf(f, "\n  ],\n  \"functions\": [");
+        int first = 1;
+        for (int i = 0; i < prof.numFunctions; i++){
+            FunctionProfile* p = &prof.functions[i];
+            if (p->calls == 0){
+                continue;
+            }
+            fprintf(f, "%s\n    {\"name\": ", first ? "" : ",");
+            writeJsonString(f, ((Symbol*)p->functionSym)->name);
+            fprintf(f, ", \"native\": %s, \"calls\": %llu, \"inclusiveCycles\": %llu, \"exclusiveCycles\": %llu, "
+                       "\"maxStackDepth\": %d, \"opStackSize\": %d}",
+                    p->functionSym->native != NULL ? "true" : "false", (unsigned long long)p->calls,
+                    (unsigned long long)p->inclusiveCycles, (unsigned long long)p->exclusiveCycles,
+                    p->maxStackDepth, p->functionSym->opStackSize);
+            first = 0;
+        }
+        fprintf(f, "\n  ]\n}\n");
+        fclose(f);
+        fprintf(out, "\n剖析数据已写入 %s\n", jsonFile);
+    }
+
+    //functions已经重新排序，FunctionSymbol中的指针不再有效
+    for (int i = 0; i < prof.numFunctions; i++){
+        prof.functions[i].functionSym->profile = NULL;
+    }
+    free(pairs);
+    free(prof.functions);
+    free(prof.calls);
+    prof.functions = NULL;
+    prof.calls = NULL;
+    prof.numFunctions = prof.numCalls = prof.callCapacity = 0;
+}
@@ -0,0 +1,36 @@
+//性能剖析：命令行加上--profile时，统计每种指令和相邻两条指令的执行次数，
+//以及每个函数的调用次数、包含/不包含被调用函数的时钟周期数和操作数栈的最大深度。
+//用来判断哪些指令序列值得合并成超级指令、哪些函数值得内联或JIT编译。
+
+#ifndef PLAYSCRIPT_PROFILE
+#define PLAYSCRIPT_PROFILE
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "vm.h"
+
+//每个函数的统计数据
+typedef struct _FunctionProfile{
+    FunctionSymbol* functionSym;
+    uint64_t calls;             //调用次数，包括尾调用
+    uint64_t inclusiveCycles;   //包含被调用函数的时钟周期数。递归调用只计算最外层的那次
+    uint64_t exclusiveCycles;   //不包含被调用函数的时钟周期数
+    int maxStackDepth;          //执行过程中操作数栈的最大深度
+    int active;                 //当前在调用栈上的次数，用于处理递归
+}FunctionProfile;
+
+//是否打开了性能剖析。要在加载字节码之前设置，预解码时据此选择指令的处理程序
+extern int profiling;
+
+//为模块中的每个函数分配统计数据，并让main函数开始计时。在execute()之前调用
+void profileBegin(BCModule* bcModule);
+
+//每条指令执行之前调用。depth是执行这条指令之前操作数栈的深度
+void profileInstruction(FunctionSymbol* functionSym, Instruction* ip, int depth);
+
+//结束计时，按执行次数和时钟周期数排序把报告打印到out，并把全部数据以JSON格式写入jsonFile。
+//out应当是stderr，不要和程序自己的输出混在一起
+void profileEnd(FILE* out, char* jsonFile);
+
+#endif
@@ -17,16 +17,40 @@ typedef struct _VarSymbol{
     Symbol symbol;
 } VarSymbol;
 
+struct _Instruction;
+struct _BCReader;
+
+//函数加载的进度。readBCModule()只为字节码中的函数创建桩，第一次调用时才读取、预解码和校验，见prepareFunction()
+typedef enum _FunctionState{
+    FunctionStub,     //只知道函数记录在字节码文件中的位置
+    FunctionLoaded,   //已经读取函数记录并预解码，还没有校验
+    FunctionReady,    //已经校验，可以执行。内置函数创建时就是这个状态
+} FunctionState;
+
 typedef struct _FunctionSymbol{
     Symbol symbol;        //基类数据
+    int numParams;        //参数数量
     int numVars;          //本地变量数量
-    VarSymbol ** vars;    //本地变量信息
+    VarSymbol * vars;     //本地变量信息，numVars个元素的数组
     int opStackSize;      //操作数栈大小
     int numByteCodes;     //字节码数量
     unsigned char* byteCode; //字节码指令
+    int numInstructions;     //预解码后的指令数量
+    struct _Instruction* code; //预解码后的指令，在加载模块时生成
+    NativeFunction native;   //内置函数的C语言实现，自定义函数为NULL
+
+    FunctionState state;        //加载的进度
+    struct _BCReader* reader;   //按需加载时从这里读取函数记录，内置函数为NULL
+    size_t recordOffset;        //函数记录在字节码文件中的位置
+    int returnKinds;            //校验器算出的返回方式，还没有算出时为-1，见verifier.c
    
-    #ifdef USE_ARENA
-    size_t frameSize;     //栈桢的大小
+    size_t frameSize;     //栈桢的大小（字节）
+
+    struct _FunctionProfile* profile;  //--profile时的统计数据，见profile.h
+
+    #ifdef USE_JIT
+    int callCount;          //被解释执行的次数，JIT编译失败后为-1
+    JitFunction jitCode;    //JIT生成的机器码，还没有编译时为NULL
     #endif
 } FunctionSymbol;
 
@@ -0,0 +1,340 @@
+//字节码校验
+//decodeFunction()已经检查了操作码、常量的下标和跳转目标（必须落在指令边界上）。这里与JVM的校验器类似，
+//在预解码后的指令上做抽象解释，证明：
+//  操作数栈不会下溢，深度也不会超过函数声明的opStackSize；
+//  本地变量的下标都小于numVars，参数都能放进本地变量；
+//  调用其他函数之后，操作数栈的深度仍在上面的范围之内。
+//解释器和JIT都依赖这些性质，运行时不再检查。
+//
+//抽象状态是每条指令执行前操作数栈深度的区间[lo, hi]。被调用的函数可能有的路径用ireturn返回、有的路径
+//用_return返回，这时调用之后的深度有两种可能，所以用区间而不是一个确定的值。区间只会扩大，
+//而且上界不超过opStackSize，所以迭代一定会结束。
+//
+//函数是按需加载的，每个函数在第一次执行之前单独校验。校验时需要知道被调用函数的参数数量和返回方式，
+//所以会加载（但不校验）它直接调用的函数，以及从它们出发沿尾调用能到达的函数。
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+
+#include "vm.h"
+#include "verifier.h"
+
+//函数返回的方式，可以组合
+#define RET_VOID  0x1   //_return：调用者的操作数栈上不增加值
+#define RET_VALUE 0x2   //ireturn：返回值成为调用者新的栈顶
+
+//不会继续执行下一条指令的指令
+static int isTerminal(unsigned char opCode){
+    switch(opCode){
+        case _goto: case iinc_goto: case ireturn: case _return: case invoketail:
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+//带跳转目标的指令
+static int hasTarget(unsigned char opCode){
+    switch(opCode){
+        case ifeq: case ifne: case iflt: case ifge: case ifgt: case ifle:
+        case if_icmpeq: case if_icmpne: case if_icmplt: case if_icmpge: case if_icmpgt: case if_icmple:
+        case _goto:
+        case if_icmpeq_lc: case if_icmpne_lc: case if_icmplt_lc: case if_icmpge_lc: case if_icmpgt_lc: case if_icmple_lc:
+        case iinc_goto:
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+//检查指令访问的本地变量是否都在范围之内
+static int localsInRange(Instruction* instr, int numVars){
+    switch(instr->opCode){
+        case iload_0: case iload_1: case iload_2: case iload_3:
+            return instr->opCode - iload_0 < numVars;
+        case istore_0: case istore_1: case istore_2: case istore_3:
+            return instr->opCode - istore_0 < numVars;
+        case iload: case istore: case iinc: case isub_lc: case iinc_goto:
+        case if_icmpeq_lc: case if_icmpne_lc: case if_icmplt_lc: case if_icmpge_lc: case if_icmpgt_lc: case if_icmple_lc:
+            return instr->operand < numVars;
+        case iadd_ll_st:
+            return instr->operand < numVars && instr->operand2 < numVars && instr->operand3 < numVars;
+        default:
+            return 1;
+    }
+}
+
+//指令对操作数栈的影响：先弹出*pops个值，再压入*pushMin到*pushMax个值。
+//被调用函数的returnKinds要已经算出来，见computeReturnKinds()
+static void stackEffect(Instruction* instr, int* pops, int* pushMin, int* pushMax){
+    *pops = 0;
+    *pushMin = *pushMax = 0;
+    switch(instr->opCode){
+        case iconst_0: case iconst_1: case iconst_2: case iconst_3: case iconst_4: case iconst_5:
+        case bipush: case sipush: case ldc: case sldc: case dconst_0: case dconst_1: case ldc2_w:
+        case iload: case iload_0: case iload_1: case iload_2: case iload_3:
+        case isub_lc:
+            *pushMin = *pushMax = 1;
+            break;
+        case istore: case istore_0: case istore_1: case istore_2: case istore_3: case pop:
+        case ifeq: case ifne: case iflt: case ifge: case ifgt: case ifle:
+        case ireturn:
+            *pops = 1;
+            break;
+        case iadd: case sadd: case isub: case imul: case idiv:
+        case dadd: case dsub: case dmul: case ddiv:
+        case lcmp: case dcmpl: case dcmpg:
+            *pops = 2;
+            *pushMin = *pushMax = 1;
+            break;
+        case i2d: case d2i:
+            *pops = 1;
+            *pushMin = *pushMax = 1;
+            break;
+        case if_icmpeq: case if_icmpne: case if_icmplt: case if_icmpge: case if_icmpgt: case if_icmple:
+            *pops = 2;
+            break;
+        case invokestatic:{
+            *pops = instr->callee->numParams;
+            int kinds = instr->callee->returnKinds;
+            if (kinds == 0){  //从不返回，后面的指令执行不到，按两种方式都可能来处理
+                kinds = RET_VOID | RET_VALUE;
+            }
+            *pushMin = (kinds & RET_VOID) ? 0 : 1;
+            *pushMax = (kinds & RET_VALUE) ? 1 : 0;
+            break;
+        }
+        case invoketail:
+            *pops = instr->callee->numParams;
+            break;
+        default:  //iinc、_goto、_return和不使用操作数栈的超级指令
+            break;
+    }
+}
+
+//找出从第一条指令开始能执行到的指令，reached[i]置为1。返回这些指令中返回指令的种类，不包括尾调用
+static int markReachable(FunctionSymbol* functionSym, unsigned char* reached, int* worklist){
+    Instruction* code = functionSym->code;
+    int kinds = 0;
+    int top = 0;
+    reached[0] = 1;
+    worklist[top++] = 0;
+    while (top > 0){
+        int i = worklist[--top];
+        Instruction* instr = &code[i];
+        if (instr->opCode == ireturn){
+            kinds |= RET_VALUE;
+        }
+        else if (instr->opCode == _return){
+            kinds |= RET_VOID;
+        }
+        if (!isTerminal(instr->opCode) && !reached[i+1]){
+            reached[i+1] = 1;
+            worklist[top++] = i+1;
+        }
+        if (hasTarget(instr->opCode)){
+            int t = (int)(instr->target - code);
+            if (!reached[t]){
+                reached[t] = 1;
+                worklist[top++] = t;
+            }
+        }
+    }
+    return kinds;
+}
+
+//对一个函数做抽象解释，检查操作数栈的深度。lo、hi、worklist、queued是调用者提供的工作区
+static int verifyStack(FunctionSymbol* functionSym, int* lo, int* hi, int* worklist, unsigned char* queued){
+    char* name = ((Symbol*)functionSym)->name;
+    Instruction* code = functionSym->code;
+    int n = functionSym->numInstructions;
+    for (int i = 0; i < n; i++){
+        lo[i] = INT_MAX;
+        hi[i] = -1;
+        queued[i] = 0;
+    }
+
+    int top = 0;
+    lo[0] = hi[0] = 0;
+    worklist[top++] = 0;
+    queued[0] = 1;
+    while (top > 0){
+        int i = worklist[--top];
+        queued[i] = 0;
+        Instruction* instr = &code[i];
+
+        int pops, pushMin, pushMax;
+        stackEffect(instr, &pops, &pushMin, &pushMax);
+        if (lo[i] < pops){
+            fprintf(stderr, "Operand stack underflow at instruction %d (op code %x) in function '%s'.\n", i, instr->opCode, name);
+            return -1;
+        }
+        int outLo = lo[i] - pops + pushMin;
+        int outHi = hi[i] - pops + pushMax;
+        if (outHi > functionSym->opStackSize){
+            fprintf(stderr, "Operand stack overflow at instruction %d (op code %x) in function '%s': depth %d, opStackSize %d.\n",
+                i, instr->opCode, name, outHi, functionSym->opStackSize);
+            return -1;
+        }
+
+        //把执行后的状态合并到后继指令上，状态有变化的后继指令重新放入工作表
+        int successors[2];
+        int numSuccessors = 0;
+        if (!isTerminal(instr->opCode)){
+            successors[numSuccessors++] = i + 1;
+        }
+        if (hasTarget(instr->opCode)){
+            successors[numSuccessors++] = (int)(instr->target - code);
+        }
+        for (int k = 0; k < numSuccessors; k++){
+            int s = successors[k];
+            if (outLo < lo[s] || outHi > hi[s]){
+                if (outLo < lo[s]) lo[s] = outLo;
+                if (outHi > hi[s]) hi[s] = outHi;
+                if (!queued[s]){
+                    queued[s] = 1;
+                    worklist[top++] = s;
+                }
+            }
+        }
+    }
+    return 0;
+}
+
+//正在计算返回方式的一组函数中，第i个函数的returnKinds暂时记为IN_GROUP(i)，用来判断一个函数是否已经在组里
+#define IN_GROUP(i) (-2 - (i))
+#define GROUP_INDEX(kinds) (-2 - (kinds))
+
+/**
+ * 计算函数返回的方式，存在functionSym->returnKinds中。内置函数按返回值的类型确定。
+ * 尾调用的函数怎样返回，本函数也就怎样返回，所以先加载从functionSym出发沿尾调用能到达、还没有算出结果的
+ * 所有函数，再在这组函数中反复传播，直到不再变化。成功时返回0，加载失败时返回-1。
+ */
+static int computeReturnKinds(FunctionSymbol* functionSym){
+    if (functionSym->returnKinds >= 0){
+        return 0;
+    }
+    if (functionSym->native != NULL){
+        Type* returnType = ((FunctionType*)((Symbol*)functionSym)->theType)->returnType;
+        functionSym->returnKinds = strcmp(returnType->name, "void") == 0 ? RET_VOID : RET_VALUE;
+        return 0;
+    }
+
+    int ret = 0;
+    int capacity = 4;
+    int numGroup = 0;
+    FunctionSymbol** group = (FunctionSymbol**)malloc(capacity*sizeof(FunctionSymbol*));
+    unsigned char** reached = (unsigned char**)malloc(capacity*sizeof(unsigned char*));
+    int* kinds = (int*)malloc(capacity*sizeof(int));
+    group[numGroup] = functionSym;
+    reached[numGroup] = NULL;
+    kinds[numGroup] = 0;
+    functionSym->returnKinds = IN_GROUP(numGroup++);
+
+    //1.加载这组函数，求出每个函数自己的返回指令
+    for (int i = 0; i < numGroup; i++){
+        FunctionSymbol* g = group[i];
+        if (loadFunction(g) != 0){
+            ret = -1;
+            break;
+        }
+
+        int n = g->numInstructions;
+        int* worklist = (int*)malloc(n*sizeof(int));
+        reached[i] = (unsigned char*)calloc(n, 1);
+        kinds[i] = markReachable(g, reached[i], worklist);
+        free(worklist);
+
+        for (int k = 0; k < n; k++){
+            FunctionSymbol* callee = g->code[k].callee;
+            if (reached[i][k] && g->code[k].opCode == invoketail && callee->returnKinds == -1){
+                if (numGroup == capacity){
+                    capacity *= 2;
+                    group = (FunctionSymbol**)realloc(group, capacity*sizeof(FunctionSymbol*));
+                    reached = (unsigned char**)realloc(reached, capacity*sizeof(unsigned char*));
+                    kinds = (int*)realloc(kinds, capacity*sizeof(int));
+                }
+                group[numGroup] = callee;
+                reached[numGroup] = NULL;
+                kinds[numGroup] = 0;
+                callee->returnKinds = IN_GROUP(numGroup++);
+            }
+        }
+    }
+
+    //2.沿尾调用传播，直到不再变化。组外的函数已经有了最终的结果
+    int changed = ret == 0;
+    while (changed){
+        changed = 0;
+        for (int i = 0; i < numGroup; i++){
+            if (reached[i] == NULL){
+                continue;
+            }
+            Instruction* code = group[i]->code;
+            for (int k = 0; k < group[i]->numInstructions; k++){
+                if (reached[i][k] && code[k].opCode == invoketail){
+                    int calleeKinds = code[k].callee->returnKinds;
+                    if (calleeKinds < 0){
+                        calleeKinds = kinds[GROUP_INDEX(calleeKinds)];
+                    }
+                    if ((kinds[i] | calleeKinds) != kinds[i]){
+                        kinds[i] |= calleeKinds;
+                        changed = 1;
+                    }
+                }
+            }
+        }
+    }
+
+    //3.保存结果。失败时恢复为还没有算出
+    for (int i = 0; i < numGroup; i++){
+        group[i]->returnKinds = ret == 0 ? kinds[i] : -1;
+        free(reached[i]);
+    }
+    free(group);
+    free(reached);
+    free(kinds);
+    return ret;
+}
+
+int verifyFunction(FunctionSymbol* functionSym){
+    char* name = ((Symbol*)functionSym)->name;
+    Instruction* code = functionSym->code;
+    int n = functionSym->numInstructions;
+
+    //1.不依赖操作数栈的检查
+    if (functionSym->numParams > functionSym->numVars){
+        fprintf(stderr, "Function '%s' has %d parameters but only %d local variables.\n",
+            name, functionSym->numParams, functionSym->numVars);
+        return -1;
+    }
+    for (int k = 0; k < n; k++){
+        if (!localsInRange(&code[k], functionSym->numVars)){
+            fprintf(stderr, "Local variable out of range at instruction %d (op code %x) in function '%s'.\n",
+                k, code[k].opCode, name);
+            return -1;
+        }
+    }
+
+    //2.被调用函数的参数数量和返回方式。JIT编译时也要用到被调用函数的参数数量，所以执行不到的调用也要加载
+    for (int k = 0; k < n; k++){
+        if ((code[k].opCode == invokestatic || code[k].opCode == invoketail)
+            && computeReturnKinds(code[k].callee) != 0){
+            return -1;
+        }
+    }
+
+    //3.检查操作数栈
+    int* lo = (int*)malloc(n*sizeof(int));
+    int* hi = (int*)malloc(n*sizeof(int));
+    int* worklist = (int*)malloc(n*sizeof(int));
+    unsigned char* queued = (unsigned char*)malloc(n);
+    int ret = verifyStack(functionSym, lo, hi, worklist, queued);
+    free(lo);
+    free(hi);
+    free(worklist);
+    free(queued);
+    return ret;
+}
@@ -0,0 +1,13 @@
+//字节码校验：函数第一次执行之前证明它的字节码是安全的，运行时不再做边界检查
+
+#ifndef PLAYSCRIPT_VERIFIER
+#define PLAYSCRIPT_VERIFIER
+
+#include "vm.h"
+
+//校验一个自定义函数预解码后的指令，由prepareFunction()在函数第一次执行之前调用。
+//被调用的函数会用loadFunction()加载，以得到它们的参数数量和返回方式。
+//成功时返回0；发现错误时打印出错的函数和指令，返回-1。
+int verifyFunction(FunctionSymbol* functionSym);
+
+#endif
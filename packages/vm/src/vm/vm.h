@@ -13,9 +13,12 @@ typedef enum _OpCode{
     iconst_3 = 0x06,
     iconst_4 = 0x07,
     iconst_5 = 0x08,
+    dconst_0 = 0x0e,
+    dconst_1 = 0x0f,
     bipush   = 0x10,  //8位整数入栈
     sipush   = 0x11,  //16位整数入栈
     ldc      = 0x12,  //从常量池加载，load const
+    ldc2_w   = 0x14,  //从常量池加载decimal，常量的下标占2个字节
     iload    = 0x15,  //本地变量入栈
     iload_0  = 0x1a,
     iload_1  = 0x1b,
@@ -26,12 +29,21 @@ typedef enum _OpCode{
     istore_1 = 0x3c,
     istore_2 = 0x3d,
     istore_3 = 0x3e,
+    pop      = 0x57,  //丢掉栈顶的值，用于值没有被使用的表达式语句
     iadd     = 0x60,
+    dadd     = 0x63,
     isub     = 0x64,
+    dsub     = 0x67,
     imul     = 0x68,
+    dmul     = 0x6b,
     idiv     = 0x6c,
+    ddiv     = 0x6f,
     iinc     = 0x84,
+    i2d      = 0x87,  //integer转decimal
+    d2i      = 0x8e,  //decimal转integer，向0截断
     lcmp     = 0x94,
+    dcmpl    = 0x97,  //比较两个decimal，结果是-1、0或1；有NaN时为-1
+    dcmpg    = 0x98,  //同dcmpl，有NaN时为1
     ifeq     = 0x99,
     ifne     = 0x9a,
     iflt     = 0x9b,
@@ -52,47 +64,107 @@ typedef enum _OpCode{
     //自行扩展的操作码
     sadd     = 0x61,    //字符串连接
     sldc     = 0x13,    //把字符串常量入栈
+
+    //超级指令：由BCGenerator把常见的指令序列合并而成。x、y、z是本地变量下标，c是8位有符号整数
+    isub_lc      = 0xe0, //iload x; iconst/bipush c; isub
+    if_icmpeq_lc = 0xe1, //iload x; iconst/bipush c; if_icmpeq addr
+    if_icmpne_lc = 0xe2,
+    if_icmplt_lc = 0xe3,
+    if_icmpge_lc = 0xe4,
+    if_icmpgt_lc = 0xe5,
+    if_icmple_lc = 0xe6,
+    iadd_ll_st   = 0xe7, //iload x; iload y; iadd; istore z
+    iinc_goto    = 0xe8, //iinc x c; goto addr
+
+    //尾调用：return f(...)时，被调用的函数复用当前函数的栈桢。操作数同invokestatic
+    invoketail   = 0xe9,
+
+    //宽格式：常量的下标占2个字节。预解码时换成ldc、sldc，运行时不会出现
+    ldc_w        = 0xea,
+    sldc_w       = 0xeb,
 }OpCode;
 
+/////////////////////////////////////////////////////////
+//预解码后的指令
+//加载模块时，每个函数的字节码被翻译成一个定长的指令数组。操作数都已解码完毕，
+//跳转目标是目标指令的地址，被调用的函数是FunctionSymbol的指针，
+//这样execute()在运行时就不再需要解码。
+
+typedef struct _Instruction{
+#ifdef USE_COMPUTED_GOTO
+    void* handler;          //处理程序的地址
+#endif
+    unsigned char opCode;   //操作码
+#ifndef USE_COMPUTED_GOTO
+    unsigned short dispatchOp;  //switch分派用的值，通常等于opCode；打开--profile时是性能剖析的桩
+#endif
+    int operand;            //立即数、本地变量的下标或整数常量的值
+    int operand2;           //第二个操作数，如iinc的增量
+    union{
+        struct _Instruction* target;   //跳转指令的目标
+        FunctionSymbol* callee;        //invokestatic、invoketail调用的函数
+        int operand3;                  //第三个操作数，如iadd_ll_st的目标变量
+        Value value;                   //常量入栈指令要入栈的值，如iconst_0、bipush、ldc、sldc、dconst_0、ldc2_w
+    };
+}Instruction;
+
 /////////////////////////////////////////////////////////
 //栈机运行时的数据结构
 
 /**
- * 操作数栈
- * 当栈为空的时候，top = -1;
+ * 栈桢
+ * 本地变量之后是操作数栈。操作数栈的前面预留一个哨兵位置，供execute()缓存栈顶时使用。
+ * 操作数栈为空的时候，sp指向这个哨兵位置。
  * */
-typedef struct _OprandStack{
-    VM_NUMBER * data; //数组
-    int top;       //栈顶的索引值
-}OprandStack;
-
 typedef struct _StackFrame{
-    //指向代码的指针
-    unsigned char* byteCode;
+#ifdef DEBUG_FRAMES
+    //标记值，用于检查栈桢是否被破坏
+    unsigned int canary;
+#endif
+
+    //正在执行的函数
+    FunctionSymbol* functionSym;
 
-    //返回地址
-    int returnIndex;
+    //返回地址：调用其他函数时，本函数中的下一条指令
+    Instruction* returnAddress;
 
     //本地变量数组
-    VM_NUMBER* localVars;  
+    Value* localVars;  
 
-    //操作数栈
-    OprandStack* oprandStack;
+    //操作数栈的栈顶：指向最上面的元素。在调用其他函数时保存。
+    Value* sp;
 
     //指向前一个栈桢的链接
     struct _StackFrame* prev;
 }StackFrame;
 
-StackFrame * createStackFrame(FunctionSymbol* functionSym);
+//栈桢链的顶部，垃圾收集器从这里开始扫描所有的栈桢。
+//解释器和JIT函数的栈桢都链在一起，包括嵌套的executeFunction()调用。
+extern StackFrame* topFrame;
+
+//创建栈桢。args指向调用者操作数栈上的参数，它们成为新栈桢的前numParams个本地变量；
+//args为NULL表示没有参数（比如main函数）。空间不够时返回NULL。
+StackFrame * createStackFrame(FunctionSymbol* functionSym, Value* args);
 void deleteStackFrame(StackFrame* frame);
 
-void pushToOpStack(StackFrame* frame, VM_NUMBER value);
-VM_NUMBER popFromOpStack(StackFrame* frame);
+//尾调用时，用functionSym的栈桢替换掉frame，args同createStackFrame。新栈桢的prev仍是frame->prev。
+StackFrame * replaceStackFrame(StackFrame* frame, FunctionSymbol* functionSym, Value* args);
+
+#ifdef DEBUG_FRAMES
+//检查栈桢是否完好，top指向操作数栈最上面的元素。出错时中止程序。
+void checkFrame(StackFrame* frame, Value* top);
+//打印栈桢的统计，和--stats的其他内容一样写到stderr
+void dumpFrameStats();
+#endif
+
+//不检查边界：加载模块时校验器已经证明操作数栈不会下溢或溢出，见verifier.c
+void pushToOpStack(StackFrame* frame, Value value);
+Value popFromOpStack(StackFrame* frame);
 
 /////////////////////////////////////////////////////////
 //代表一个BCModule的数据结构
 
-typedef enum _ConstKind{NumberC, StringC, FunctionC} ConstKind;
+typedef enum _ConstKind{NumberC, StringC, FunctionC, DecimalC} ConstKind;
 
 typedef struct _Const{
     ConstKind kind;
@@ -103,9 +175,15 @@ typedef struct _NumberConst{
     int value;
 }NumberConst;
 
+typedef struct _DecimalConst{
+    Const c;
+    double value;
+}DecimalConst;
+
 typedef struct _StringConst{
     Const c;
     char* value;
+    PlayString* string;  //运行时使用的字符串对象，加载时驻留，sldc直接把它入栈
 }StringConst;
 
 typedef struct _FunctionConst{
@@ -113,6 +191,16 @@ typedef struct _FunctionConst{
     FunctionSymbol * functionSym;
 }FunctionConst;
 
+//字节码文件在内存中的映像
+typedef struct _BCImage{
+    unsigned char* data;
+    size_t size;
+    int mapped;   //1表示是用mmap映射的，0表示是读入malloc的内存的
+}BCImage;
+
+int openBCFile(char* fileName, BCImage* image);
+void closeBCFile(BCImage* image);
+
 //模块
 //代表一个可运行的程序
 typedef struct _BCModule{
@@ -121,6 +209,39 @@ typedef struct _BCModule{
     FunctionSymbol * _main;   //主函数入口
     int numTypes;
     Type ** types;
+    BCImage image;            //字节码文件的映像，其中的字符串和字节码被直接引用
+    struct _BCReader* reader; //按需加载函数时用的字符串表、类型等，见readBCModule()
 }BCModule;
 
+int decodeFunction(FunctionSymbol* functionSym, int numConsts, Const** consts);
+
+//读取函数记录并预解码，不校验。已经加载过时直接返回0，出错时打印原因并返回-1
+int loadFunction(FunctionSymbol* functionSym);
+
+//第一次执行函数之前调用：加载并校验。已经校验过时直接返回0，出错时打印原因并返回-1
+int prepareFunction(FunctionSymbol* functionSym);
+
+//运行模块的main函数。返回值同executeFunction()
+int execute(BCModule* bcModule, Value* result);
+
+//进程的退出码。0～EXIT_RESULT_MAX留给程序：main函数用ireturn返回的integer在这个范围内时就是退出码。
+//更大的值是虚拟机自己的，运行时出错时是executeFunction()返回值的相反数。
+#define EXIT_RESULT_MAX     63
+#define EXIT_USAGE          64  //命令行参数错误
+#define EXIT_BAD_FILE       65  //字节码文件的内容有错误，包括没有main函数、按需加载的函数校验失败
+#define EXIT_NO_INPUT       66  //无法读取字节码文件
+#define EXIT_RUNTIME_ERROR  70  //运行时错误，比如未知的操作码、integer除以0
+//EXIT_OUT_OF_MEMORY        71     内存不足，见rt/mem.h
+#define EXIT_STACK_OVERFLOW 72  //栈溢出
+#define EXIT_BAD_RESULT     73  //main返回的integer超出了0～EXIT_RESULT_MAX，这个值打印在stderr上
+
+//integer除法出错：除数为0，或者结果溢出（INT32_MIN / -1）
+#define DIVISION_FAILS(dividend, divisor) ((divisor) == 0 || ((divisor) == -1 && (dividend) == INT32_MIN))
+
+//报告integer除法的错误。之后解释器返回-EXIT_RUNTIME_ERROR，JIT代码直接退出
+void reportDivisionError(FunctionSymbol* functionSym, int32_t divisor);
+
+//解释执行一个函数。返回1表示有返回值，存在*result中；0表示没有返回值；负数表示出错，是退出码的相反数。
+int executeFunction(FunctionSymbol* functionSym, Value* args, Value* result);
+
 #endif
\ No newline at end of file
@@ -0,0 +1,22 @@
+/**
+相互尾递归：even和odd互相尾调用。先调用足够多次，让它们被JIT编译，再用很大的n调用。
+尾调用不能让虚拟机栈和C语言的栈增长，否则会栈溢出。
+*/
+function even(n: integer): integer {
+  if (n == 0) {
+    return 1;
+  }
+  return odd(n - 1);
+}
+
+function odd(n: integer): integer {
+  if (n == 0) {
+    return 0;
+  }
+  return even(n - 1);
+}
+
+for (let i: integer = 0; i < 200; i++) {
+  even(20);
+}
+println(even(10000000));
@@ -0,0 +1,138 @@
+//decimal格式化的测试：number_format_decimal的结果与JavaScript的String(x)一致，
+//并且有效数字与用snprintf、strtod逐位尝试求出的最短数字相同。
+//用法：make test
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include "../src/rt/number.h"
+
+static int failures = 0;
+
+//JavaScript中String(x)的结果，由Node生成
+static const struct{
+    double value;
+    const char* expected;
+}cases[] = {
+    {0.1, "0.1"}, {-0.1, "-0.1"}, {0.1 + 0.2, "0.30000000000000004"}, {1.0 / 3, "0.3333333333333333"},
+    {3.35, "3.35"}, {123.456, "123.456"}, {1e15 + 0.5, "1000000000000000.5"},
+    {1e21, "1e+21"}, {1e20 + 65536, "100000000000000070000"}, {1152921504606846976.0, "1152921504606847000"},
+    {1.5e300, "1.5e+300"}, {-2.5e-7, "-2.5e-7"}, {1e-7, "1e-7"}, {1.5e-6, "0.0000015"}, {0.000001, "0.000001"},
+    {5e-324, "5e-324"}, {2.2250738585072014e-308, "2.2250738585072014e-308"}, {2.225073858507201e-308, "2.225073858507201e-308"},
+    {1.7976931348623157e308, "1.7976931348623157e+308"}, {9007199254740993.0, "9007199254740992"},
+    {4.35, "4.35"}, {0.5, "0.5"}, {2.5e15, "2500000000000000"}, {1e16, "10000000000000000"},
+    {123456789012345680000.0, "123456789012345680000"}, {1.2345678901234568e21, "1.2345678901234568e+21"},
+    {NAN, "NaN"}, {INFINITY, "Infinity"}, {-INFINITY, "-Infinity"}, {-0.0, "0"},
+};
+
+//最短的能精确还原的有效数字，用%e和strtod逐位尝试。%e给出的是最接近的P位数字，它不能还原时，
+//比它大1或小1的P位数字仍可能还原，这时它们才是最短的
+static void shortestByPrintf(double x, char* digits){
+    char tmp[40];
+    for (int precision = 1; precision <= 17; precision++){
+        snprintf(tmp, sizeof(tmp), "%.*e", precision - 1, x);
+        if (strtod(tmp, NULL) == x){
+            break;
+        }
+        //取出%e中的数字和指数，试一试相邻的两个数
+        uint64_t m = 0;
+        char* p = tmp;
+        for (; *p != 'e'; p++){
+            if (*p >= '0' && *p <= '9'){
+                m = m * 10 + (*p - '0');
+            }
+        }
+        int exponent = atoi(p + 1) - (precision - 1);
+        int found = 0;
+        for (int delta = -1; delta <= 1 && !found; delta += 2){
+            snprintf(tmp, sizeof(tmp), "%llue%d", (unsigned long long)(m + delta), exponent);
+            found = strtod(tmp, NULL) == x;
+        }
+        if (found){
+            break;
+        }
+    }
+    int k = 0;
+    for (char* p = tmp; *p != 'e'; p++){
+        if (*p >= '0' && *p <= '9'){
+            digits[k++] = *p;
+        }
+    }
+    while (k > 1 && digits[k - 1] == '0'){
+        k--;
+    }
+    digits[k] = 0;
+}
+
+//格式化结果中的有效数字：去掉符号、小数点、指数和首尾的0
+static void significantDigits(const char* s, char* digits){
+    int k = 0;
+    for (const char* p = s; *p != 0 && *p != 'e'; p++){
+        if (*p >= '0' && *p <= '9' && (k > 0 || *p != '0')){
+            digits[k++] = *p;
+        }
+    }
+    while (k > 1 && digits[k - 1] == '0'){
+        k--;
+    }
+    digits[k] = 0;
+}
+
+static void check(double x){
+    char buf[NUMBER_BUFFER_SIZE];
+    char expected[40];
+    char actual[40];
+    int length = number_format_decimal(x, buf);
+    shortestByPrintf(x, expected);
+    significantDigits(buf, actual);
+    if (length != (int)strlen(buf) || strtod(buf, NULL) != x || strcmp(expected, actual) != 0){
+        if (failures++ < 20){
+            printf("FAIL %.17g: %s, expecting digits %s\n", x, buf, expected);
+        }
+    }
+}
+
+//xorshift64*，每次运行的序列都相同
+static uint64_t state = 88172645463325252ULL;
+static uint64_t nextRandom(){
+    state ^= state >> 12;
+    state ^= state << 25;
+    state ^= state >> 27;
+    return state * 2685821657736338717ULL;
+}
+
+int main(){
+    for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++){
+        char buf[NUMBER_BUFFER_SIZE];
+        number_format_decimal(cases[i].value, buf);
+        if (strcmp(buf, cases[i].expected) != 0){
+            printf("FAIL %.17g: %s, expecting %s\n", cases[i].value, buf, cases[i].expected);
+            failures++;
+        }
+    }
+
+    //任意的位模式，覆盖所有的指数，包括非规格化数
+    for (int i = 0; i < 100000; i++){
+        uint64_t bits = nextRandom();
+        double x;
+        memcpy(&x, &bits, sizeof(x));
+        if (isfinite(x)){
+            check(x);
+        }
+    }
+    //有效数字较少的数，以及2的幂（舍入区间不对称）
+    for (int i = 0; i < 100000; i++){
+        check((double)(nextRandom() % 1000000) / pow(10, (double)(nextRandom() % 30)) * pow(10, (double)(nextRandom() % 30)));
+    }
+    for (int e = -1074; e <= 1023; e++){
+        check(ldexp(1, e));
+    }
+
+    if (failures > 0){
+        printf("FAIL number_test: %d\n", failures);
+        return 1;
+    }
+    printf("ok   number_test\n");
+    return 0;
+}
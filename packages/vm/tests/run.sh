@@ -0,0 +1,32 @@
+#!/bin/sh
+#回归测试：用TypeScript版本的编译器把tests目录下的每个.cs程序编译成字节码，在dist/playvm上运行，
+#输出要与同名的.out文件一致。先构建ts-vm（pnpm run build）；TSVM可以换成别的编译命令。
+cd "$(dirname "$0")/.."
+TSVM=${TSVM:-"node ../ts-vm/dist/index.js"}
+
+#ts-vm按路径中的第一个'.'确定字节码文件名，临时目录的名称里不能有'.'
+tmp=$(mktemp -d "${TMPDIR:-/tmp}/playvm_tests_XXXXXX")
+trap 'rm -rf "$tmp"' EXIT
+
+failed=0
+for src in tests/*.cs; do
+    name=$(basename "$src" .cs)
+    #ts-vm把字节码写在源文件旁边
+    cp "$src" "$tmp/$name.cs"
+    $TSVM "$tmp/$name.cs" >/dev/null 2>&1
+    if [ ! -f "$tmp/$name.bc" ]; then
+        echo "FAIL $name: 编译失败"
+        failed=1
+        continue
+    fi
+    ./dist/playvm "$tmp/$name.bc" > "$tmp/$name.txt" 2>&1
+    status=$?
+    if [ $status -eq 0 ] && cmp -s "$tmp/$name.txt" "tests/$name.out"; then
+        echo "ok   $name"
+    else
+        echo "FAIL $name: 退出码$status"
+        diff "tests/$name.out" "$tmp/$name.txt"
+        failed=1
+    fi
+done
+exit $failed
@@ -0,0 +1,17 @@
+/**
+没有声明返回类型的函数作为语句调用：函数体中没有带值的return时，调用不留下值，不能生成pop。
+*/
+function f(x: integer) {
+}
+function g(x: integer) {
+  return x + 1;
+}
+function h(x: integer) {
+  println(x);
+}
+for (let i: integer = 0; i < 3; i++) {
+  f(i);
+  g(i);
+  h(i);
+}
+println(g(41));